@@ -1,6 +1,15 @@
 #include "_rbush.h"
 #include "debug.h"
+#include "flat.h"
+#include "metrics.h"
+#include "simd.h"
+#include "thread_pool.h"
 #include <cmath>
+#include <cstring>
+#include <new>
+#include <queue>
+#include <stdexcept>
+#include <tuple>
 
 namespace rbush {
 
@@ -41,20 +50,310 @@ void BBox::extend(const BBox &other) {
     max_y = std::max(max_y, other.max_y);
 }
 
-// Node implementation
+double BBox::dist_sq(double x, double y) const {
+    const double dx = x < min_x ? min_x - x : (x > max_x ? x - max_x : 0);
+    const double dy = y < min_y ? min_y - y : (y > max_y ? y - max_y : 0);
+    return dx * dx + dy * dy;
+}
 
-template <typename T> BBox Node<T>::dist_bbox(int start, int end) const {
-    BBox bbox;
-    for (int i = start; i < end; ++i) {
-        bbox.extend(*children[i]);
+// BBoxArray implementation
+
+namespace {
+
+// nearest floats below and above a double, so that a box of floats contains the box of doubles
+float float_below(double value) {
+    constexpr float MAX = std::numeric_limits<float>::max();
+    constexpr float INF = std::numeric_limits<float>::infinity();
+    if (value > MAX)
+        return std::isinf(value) ? INF : MAX;
+    if (value < -MAX)
+        return -INF;
+    const float result = static_cast<float>(value);
+    return result > value ? std::nextafter(result, -INF) : result;
+}
+
+float float_above(double value) {
+    constexpr float MAX = std::numeric_limits<float>::max();
+    constexpr float INF = std::numeric_limits<float>::infinity();
+    if (value < -MAX)
+        return std::isinf(value) ? -INF : -MAX;
+    if (value > MAX)
+        return INF;
+    const float result = static_cast<float>(value);
+    return result < value ? std::nextafter(result, INF) : result;
+}
+
+} // namespace
+
+void BBoxArray::AlignedDeleter::operator()(void *data) const {
+    ::operator delete(data, std::align_val_t(simd::WIDTH * sizeof(double)));
+}
+
+void BBoxArray::set_compact(bool compact) {
+    if (compact == _compact)
+        return;
+    _data.reset();
+    _size = 0;
+    _capacity = 0;
+    _compact = compact;
+}
+
+void BBoxArray::set_points(bool points) {
+    if (points == _points)
+        return;
+    _data.reset();
+    _size = 0;
+    _capacity = 0;
+    _points = points;
+}
+
+BBox BBoxArray::operator[](size_t i) const {
+    if (_points) {
+        return BBox(_coords(0)[i], _coords(1)[i], _coords(0)[i], _coords(1)[i]);
+    }
+    if (_compact) {
+        return BBox(_compact_coords(0)[i], _compact_coords(1)[i], _compact_coords(2)[i],
+                    _compact_coords(3)[i]);
+    }
+    return BBox(_coords(0)[i], _coords(1)[i], _coords(2)[i], _coords(3)[i]);
+}
+
+void BBoxArray::reserve(size_t capacity) {
+    if (capacity <= _capacity)
+        return;
+
+    // keep every coordinate array a whole number of SIMD blocks, zeroing the padding so the
+    // kernels never read uninitialized memory
+    capacity = (capacity + simd::WIDTH - 1) / simd::WIDTH * simd::WIDTH;
+    const size_t coord_size = _compact ? sizeof(float) : sizeof(double);
+    const size_t bytes = _num_coords() * capacity * coord_size;
+    char *data =
+        static_cast<char *>(::operator new(bytes, std::align_val_t(simd::WIDTH * sizeof(double))));
+    std::memset(data, 0, bytes);
+    for (size_t i = 0; i < _num_coords() && _size; ++i) {
+        std::memcpy(data + i * capacity * coord_size,
+                    static_cast<char *>(_data.get()) + i * _capacity * coord_size,
+                    _size * coord_size);
+    }
+    _data.reset(data);
+    _capacity = capacity;
+}
+
+void BBoxArray::assign(const BBoxArray &other) {
+    set_compact(other._compact);
+    set_points(other._points);
+    clear();
+    reserve(other._size);
+    const size_t coord_size = _compact ? sizeof(float) : sizeof(double);
+    for (size_t i = 0; i < _num_coords() && other._size; ++i) {
+        std::memcpy(static_cast<char *>(_data.get()) + i * _capacity * coord_size,
+                    static_cast<char *>(other._data.get()) + i * other._capacity * coord_size,
+                    other._size * coord_size);
+    }
+    _size = other._size;
+}
+
+void BBoxArray::push_back(const BBox &bbox) {
+    if (_size == _capacity) {
+        reserve(std::max<size_t>(simd::WIDTH, _capacity * 2));
+    }
+    set(_size++, bbox);
+}
+
+void BBoxArray::set(size_t i, const BBox &bbox) {
+    if (_points) {
+        _coords(0)[i] = bbox.min_x;
+        _coords(1)[i] = bbox.min_y;
+        return;
+    }
+    if (_compact) {
+        _compact_coords(0)[i] = float_below(bbox.min_x);
+        _compact_coords(1)[i] = float_below(bbox.min_y);
+        _compact_coords(2)[i] = float_above(bbox.max_x);
+        _compact_coords(3)[i] = float_above(bbox.max_y);
+        return;
+    }
+    _coords(0)[i] = bbox.min_x;
+    _coords(1)[i] = bbox.min_y;
+    _coords(2)[i] = bbox.max_x;
+    _coords(3)[i] = bbox.max_y;
+}
+
+void BBoxArray::erase(size_t i) {
+    const size_t coord_size = _compact ? sizeof(float) : sizeof(double);
+    for (size_t c = 0; c < _num_coords(); ++c) {
+        char *coords = static_cast<char *>(_data.get()) + c * _capacity * coord_size;
+        std::memmove(coords + i * coord_size, coords + (i + 1) * coord_size,
+                     (_size - i - 1) * coord_size);
+    }
+    --_size;
+}
+
+size_t BBoxArray::intersecting(const BBox &bbox, uint32_t *out) const {
+    return intersecting(bbox, 0, _size, out);
+}
+
+size_t BBoxArray::intersecting(const BBox &bbox, size_t begin, size_t end, uint32_t *out) const {
+    if (_points) {
+        return simd::points_within(_coords(0) + begin, _coords(1) + begin, end - begin, bbox.min_x,
+                                   bbox.min_y, bbox.max_x, bbox.max_y, out);
+    }
+    if (_compact) {
+        return simd::intersecting(_compact_coords(0) + begin, _compact_coords(1) + begin,
+                                  _compact_coords(2) + begin, _compact_coords(3) + begin,
+                                  end - begin, bbox.min_x, bbox.min_y, bbox.max_x, bbox.max_y, out);
+    }
+    return simd::intersecting(_coords(0) + begin, _coords(1) + begin, _coords(2) + begin,
+                              _coords(3) + begin, end - begin, bbox.min_x, bbox.min_y, bbox.max_x,
+                              bbox.max_y, out);
+}
+
+size_t BBoxArray::least_enlargement(const BBox &bbox) const {
+    if (_points) {
+        // the points are boxes whose corners are the same
+        return simd::least_enlargement(_coords(0), _coords(1), _coords(0), _coords(1), _size,
+                                       bbox.min_x, bbox.min_y, bbox.max_x, bbox.max_y);
+    }
+    if (_compact) {
+        return simd::least_enlargement(_compact_coords(0), _compact_coords(1), _compact_coords(2),
+                                       _compact_coords(3), _size, bbox.min_x, bbox.min_y,
+                                       bbox.max_x, bbox.max_y);
+    }
+    return simd::least_enlargement(_coords(0), _coords(1), _coords(2), _coords(3), _size,
+                                   bbox.min_x, bbox.min_y, bbox.max_x, bbox.max_y);
+}
+
+size_t BBoxArray::least_overlap_enlargement(const BBox &bbox) const {
+    // as in the R*-tree, only the children needing the least area enlargement are candidates when
+    // there are many of them, so that the choice stays linear in the number of children
+    constexpr size_t MAX_CANDIDATES = 32;
+    std::vector<std::pair<double, uint32_t>> candidates;
+    candidates.reserve(_size);
+    for (uint32_t i = 0; i < _size; ++i) {
+        const BBox child = (*this)[i];
+        candidates.emplace_back(child.enlarged_area(bbox) - child.area(), i);
+    }
+    if (candidates.size() > MAX_CANDIDATES) {
+        std::partial_sort(candidates.begin(), candidates.begin() + MAX_CANDIDATES,
+                          candidates.end());
+        candidates.resize(MAX_CANDIDATES);
+    }
+
+    size_t best_index = 0;
+    double best_overlap = std::numeric_limits<double>::infinity();
+    double best_enlargement = std::numeric_limits<double>::infinity();
+    double best_area = std::numeric_limits<double>::infinity();
+    for (const auto &[enlargement, i] : candidates) {
+        const BBox child = (*this)[i];
+        double overlap = 0;
+        // a child containing the box overlaps its siblings no more once it is inserted
+        if (!child.contains(bbox)) {
+            BBox enlarged = child;
+            enlarged.extend(bbox);
+            for (uint32_t j = 0; j < _size; ++j) {
+                if (j == i)
+                    continue;
+                const BBox sibling = (*this)[j];
+                overlap += enlarged.intersection_area(sibling) - child.intersection_area(sibling);
+            }
+        }
+        const double area = child.area();
+        if (std::tie(overlap, enlargement, area) <
+            std::tie(best_overlap, best_enlargement, best_area)) {
+            best_index = i;
+            best_overlap = overlap;
+            best_enlargement = enlargement;
+            best_area = area;
+        }
     }
-    return bbox;
+    return best_index;
+}
+
+// BBoxLayout implementation
+
+namespace {
+
+// interned names are compared by identity when looked up in the dict of an object
+py::str intern(const py::str &name) {
+    PyObject *interned = name.inc_ref().ptr();
+    PyUnicode_InternInPlace(&interned);
+    return py::reinterpret_steal<py::str>(interned);
+}
+
+} // namespace
+
+BBoxLayout BBoxLayout::attributes(const py::str &min_x, const py::str &min_y,
+                                  const py::str &max_x, const py::str &max_y) {
+    BBoxLayout layout(Kind::ATTRIBUTES);
+    layout._keys = {intern(min_x), intern(min_y), intern(max_x), intern(max_y)};
+    return layout;
 }
 
-template <typename T> void Node<T>::calc_bbox() {
+BBoxLayout BBoxLayout::items(const py::object &min_x, const py::object &min_y,
+                             const py::object &max_x, const py::object &max_y) {
+    BBoxLayout layout(Kind::ITEMS);
+    layout._keys = {min_x, min_y, max_x, max_y};
+    for (auto &key : layout._keys) {
+        if (py::isinstance<py::str>(key))
+            key = intern(key);
+    }
+    return layout;
+}
+
+BBoxLayout BBoxLayout::offsets(size_t min_x, size_t min_y, size_t max_x, size_t max_y) {
+    BBoxLayout layout(Kind::OFFSETS);
+    layout._offsets = {min_x, min_y, max_x, max_y};
+    return layout;
+}
+
+BBox BBoxLayout::get(const py::handle &item) const {
+    double coords[4];
+    if (_kind == Kind::OFFSETS) {
+        Py_buffer view;
+        if (PyObject_GetBuffer(item.ptr(), &view, PyBUF_SIMPLE) != 0)
+            throw py::error_already_set();
+        const size_t size = view.len;
+        bool fits = true;
+        for (int i = 0; i < 4; ++i) {
+            fits = fits && _offsets[i] + sizeof(double) <= size;
+            if (fits)
+                std::memcpy(&coords[i], static_cast<const char *>(view.buf) + _offsets[i],
+                            sizeof(double));
+        }
+        PyBuffer_Release(&view);
+        if (!fits)
+            throw py::value_error("item of " + std::to_string(size) +
+                                  " bytes is too small for its bbox offsets");
+    } else {
+        for (int i = 0; i < 4; ++i) {
+            py::object value = _kind == Kind::ATTRIBUTES ? py::getattr(item, _keys[i])
+                                                         : py::object(item[_keys[i]]);
+            coords[i] = value.cast<double>();
+        }
+    }
+    return BBox(coords[0], coords[1], coords[2], coords[3]);
+}
+
+// Node implementation
+
+template <typename T> void Node<T>::calc_bbox(const NodeArena<T> &nodes) {
     BBox bbox;
+    if (is_leaf) {
+        for (size_t i = 0; i < child_bboxes.size(); ++i) {
+            bbox.extend(child_bboxes[i]);
+        }
+        static_cast<BBox &>(*this) = bbox;
+        count = items.size();
+        return;
+    }
+
+    child_bboxes.clear();
+    child_bboxes.reserve(children.size());
+    count = 0;
     for (const auto &child : children) {
-        bbox.extend(*child);
+        bbox.extend(nodes[child]);
+        child_bboxes.push_back(nodes[child]);
+        count += nodes[child].count;
     }
     min_x = bbox.min_x;
     min_y = bbox.min_y;
@@ -65,65 +364,278 @@ template <typename T> void Node<T>::calc_bbox() {
 // Explicit template instantiation for common types
 template struct Node<py::dict>;
 template struct Node<py::object>;
+template struct Node<int64_t>;
+
+// NodeArena implementation
+
+template <typename T> NodeId NodeArena<T>::create() {
+    NodeId id;
+    if (!_free.empty()) {
+        id = _free.back();
+        _free.pop_back();
+    } else {
+        if ((_size & CHUNK_MASK) == 0) {
+            _chunks.emplace_back(new Node<T>[CHUNK_SIZE]);
+        }
+        id = _size++;
+    }
+    (*this)[id].generation = _generation;
+    return id;
+}
+
+template <typename T> NodeId NodeArena<T>::create_range(size_t n) {
+    const NodeId first = _size;
+    while (_chunks.size() * CHUNK_SIZE < _size + n) {
+        _chunks.emplace_back(new Node<T>[CHUNK_SIZE]);
+    }
+    _size += n;
+    for (NodeId id = first; id < _size; ++id) {
+        (*this)[id].generation = _generation;
+    }
+    return first;
+}
+
+template <typename T> NodeId NodeArena<T>::copy(NodeId id) {
+    const NodeId copy_id = create();
+    const Node<T> &node = (*this)[id];
+    Node<T> &copy = (*this)[copy_id];
+    static_cast<BBox &>(copy) = node;
+    copy.children = node.children;
+    copy.items = node.items;
+    copy.child_bboxes.assign(node.child_bboxes);
+    copy.count = node.count;
+    copy.parent = node.parent;
+    copy.height = node.height;
+    copy.is_leaf = node.is_leaf;
+    return copy_id;
+}
+
+template <typename T> void NodeArena<T>::destroy(NodeId id) {
+    // reset the slot so it releases its children and items before being reused
+    (*this)[id] = Node<T>();
+    _free.emplace_back(id);
+}
+
+template <typename T> void NodeArena<T>::reset(NodeId id) {
+    (*this)[id] = Node<T>();
+    (*this)[id].generation = _generation;
+}
+
+template <typename T> void NodeArena<T>::clear() {
+    _chunks.clear();
+    _free.clear();
+    _size = 0;
+}
+
+// The free slots are left out, so the copy never creates a node where the original may
+template <typename T> NodeArena<T> NodeArena<T>::share() const {
+    NodeArena<T> arena;
+    arena._chunks = _chunks;
+    arena._size = _size;
+    arena._generation = _generation;
+    return arena;
+}
+
+// Explicit template instantiation for common types
+template class NodeArena<py::dict>;
+template class NodeArena<py::object>;
+template class NodeArena<int64_t>;
+
+// SnapshotRegistry implementation
+
+std::shared_ptr<void> SnapshotRegistry::lease(const std::shared_ptr<SnapshotRegistry> &registry,
+                                              uint64_t generation) {
+    std::lock_guard<std::mutex> lock(registry->_mutex);
+    registry->_generations.insert(generation);
+    return std::shared_ptr<void>(registry.get(), [registry, generation](void *) {
+        std::lock_guard<std::mutex> lock(registry->_mutex);
+        registry->_generations.erase(generation);
+    });
+}
+
+uint64_t SnapshotRegistry::newest() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _generations.empty() ? 0 : *_generations.rbegin();
+}
 
 // RBushBase implementation
 
+// entries a node needs for its subtrees to be built in parallel, below it the tasks cost more
+// than they save
+constexpr int PARALLEL_BUILD_SIZE = 1 << 14;
+
+// share of the nodes of a subtree that bulk loading it again must save for optimize to repack it
+constexpr double REPACK_WASTE = 0.1;
+
 template <typename T>
-RBushBase<T>::RBushBase(size_t max_entries)
+RBushBase<T>::RBushBase(size_t max_entries, bool identity_index, size_t insert_buffer,
+                        InsertStrategy insert_strategy, bool compact_bboxes, bool points)
     : _max_entries(std::max<size_t>(4, max_entries)),
-      _min_entries(std::max<size_t>(2, std::ceil(_max_entries * 0.4))) {
-    _root = std::make_unique<Node<T>>();
-    _root->height = 1;
-    _root->is_leaf = true;
+      _min_entries(std::max<size_t>(2, std::ceil(_max_entries * 0.4))),
+      _insert_buffer(insert_buffer), _insert_strategy(insert_strategy),
+      _compact_bboxes(compact_bboxes), _points(points), _identity_index(identity_index) {
+    _root = _create_leaf();
+    _buffer = _create_leaf();
 }
 
 template <typename T> void RBushBase<T>::clear() {
-    _root = std::make_unique<Node<T>>();
-    _root->height = 1;
-    _root->is_leaf = true;
+    _begin_change();
+    ++_version;
+    _nodes.clear();
+    _index.clear();
+    _forget_snapshots();
+    _root = _create_leaf();
+    _buffer = _create_leaf();
+}
+
+template <typename T> NodeId RBushBase<T>::_create_leaf() {
+    const NodeId id = _nodes.create();
+    _set_layout(_nodes[id]);
+    return id;
+}
+
+template <typename T> void RBushBase<T>::_set_layout(Node<T> &node) const {
+    node.child_bboxes.set_compact(_compact_bboxes && !node.is_leaf);
+    node.child_bboxes.set_points(_points && node.is_leaf);
 }
 
 template <typename T> void RBushBase<T>::insert(const T &item) {
     DEBUG_TIMER("insert");
-    std::unique_ptr<Node<T>> item_node = std::make_unique<Node<T>>(item);
-    BBox bbox = to_bbox(item);
-    item_node->min_x = bbox.min_x;
-    item_node->min_y = bbox.min_y;
-    item_node->max_x = bbox.max_x;
-    item_node->max_y = bbox.max_y;
-    _insert(std::move(item_node), _root->height - 1);
+    metrics::OpTimer timer(metrics::Op::INSERT);
+    _insert_entry(item, to_bbox(item));
+}
+
+template <typename T> void RBushBase<T>::_insert_entry(const T &item, const BBox &bbox) {
+    _begin_change();
+    ++_version;
+    if (!_insert_buffer) {
+        _insert(Entry<T>{bbox, item});
+        return;
+    }
+
+    const NodeId buffer_id = _writable(_buffer);
+    Node<T> &buffer = _nodes[buffer_id];
+    buffer.items.emplace_back(item);
+    buffer.child_bboxes.push_back(bbox);
+    buffer.extend(bbox);
+    ++buffer.count;
+    _index_item(item, buffer_id);
+    if (buffer.items.size() >= _insert_buffer)
+        flush();
+}
+
+template <typename T> void RBushBase<T>::flush() {
+    DEBUG_TIMER("flush");
+    if (_nodes[_buffer].items.empty())
+        return;
+    metrics::OpTimer timer(metrics::Op::FLUSH);
+    _begin_change();
+    ++_version;
+    const NodeId buffer = _writable(_buffer);
+    Node<T> &node = _nodes[buffer];
+    std::vector<Entry<T>> entries;
+    entries.reserve(node.items.size());
+    for (size_t i = 0; i < node.items.size(); ++i) {
+        _unindex_item(node.items[i], buffer);
+        entries.push_back({node.child_bboxes[i], std::move(node.items[i])});
+    }
+    _nodes.reset(buffer);
+    _set_layout(_nodes[buffer]);
+    _merge(entries);
+}
+
+template <typename T> void RBushBase<T>::_insert(const Entry<T> &entry) {
+    if (_insert_strategy != InsertStrategy::RSTAR) {
+        _insert_into(&entry, 0, _nodes[_root].height - 1, nullptr);
+        return;
+    }
+
+    Reinsertion reinsertion;
+    _insert_into(&entry, 0, _nodes[_root].height - 1, &reinsertion);
+    _reinsert(reinsertion);
+}
+
+template <typename T> void RBushBase<T>::_insert(NodeId node, int level) {
+    if (_insert_strategy != InsertStrategy::RSTAR) {
+        _insert_into(nullptr, node, level, nullptr);
+        return;
+    }
+
+    Reinsertion reinsertion;
+    _insert_into(nullptr, node, level, &reinsertion);
+    _reinsert(reinsertion);
 }
 
-template <typename T> void RBushBase<T>::_insert(std::unique_ptr<Node<T>> item_node, int level) {
+template <typename T> void RBushBase<T>::_reinsert(Reinsertion &reinsertion) {
+    while (!reinsertion.entries.empty() || !reinsertion.nodes.empty()) {
+        if (!reinsertion.entries.empty()) {
+            const Entry<T> entry = std::move(reinsertion.entries.back());
+            reinsertion.entries.pop_back();
+            _insert_into(&entry, 0, _nodes[_root].height - 1, &reinsertion);
+            continue;
+        }
+        const auto [node, height] = reinsertion.nodes.back();
+        reinsertion.nodes.pop_back();
+        // the root may have been split meanwhile, so the level is found from the height
+        _insert_into(nullptr, node, _nodes[_root].height - height, &reinsertion);
+    }
+}
+
+template <typename T>
+void RBushBase<T>::_insert_into(const Entry<T> *entry, NodeId node, int level,
+                                Reinsertion *reinsertion) {
     std::vector<std::reference_wrapper<Node<T>>> insert_path;
+    std::vector<size_t> path_indexes;
+    const BBox bbox = entry ? entry->bbox : static_cast<const BBox &>(_nodes[node]);
 
     // find the best node for accommodating the item, saving all nodes along the path too
-    Node<T> &insert_node = _choose_subtree(*item_node, *_root, level, insert_path);
-
-    // Create a reference to the item_node before moving it
-    const BBox &item_bbox = *item_node;
+    Node<T> &insert_node =
+        _choose_subtree(bbox, _nodes[_writable(_root)], level, insert_path, path_indexes);
+    const NodeId insert_node_id =
+        path_indexes.empty()
+            ? _root
+            : insert_path[insert_path.size() - 2].get().children[path_indexes.back()];
+
+    // put the item or the node into the node
+    if (entry) {
+        insert_node.items.emplace_back(entry->item);
+        _index_item(entry->item, insert_node_id);
+    } else {
+        insert_node.children.emplace_back(node);
+        _nodes[node].parent = insert_node_id;
+    }
+    insert_node.child_bboxes.push_back(bbox);
+    insert_node.extend(bbox);
 
-    // put the item into the node
-    insert_node.children.emplace_back(std::move(item_node));
-    insert_node.extend(item_bbox);
+    // the splits below recount the nodes they touch, which stay under the same parent
+    const uint32_t count = entry ? 1 : _nodes[node].count;
+    for (auto &path_node : insert_path) {
+        path_node.get().count += count;
+    }
 
-    // split on node overflow; propagate upwards if necessary
-    while (level >= 0) {
-        if (insert_path[level].get().children.size() > _max_entries) {
-            _split(insert_path, level);
-            --level;
-        } else {
-            break;
+    // split on node overflow; propagate upwards if necessary. With forced reinsertion, the first
+    // overflow at each height takes children out of the node instead, unless it is the root
+    while (level >= 0 && insert_path[level].get().num_children() > _max_entries) {
+        const uint64_t height_bit = uint64_t(1) << insert_path[level].get().height;
+        const NodeId node_id =
+            level ? insert_path[level - 1].get().children[path_indexes[level - 1]] : _root;
+        if (reinsertion && level > 0 && !(reinsertion->heights & height_bit)) {
+            reinsertion->heights |= height_bit;
+            _take_out_farthest(insert_path, node_id, level, *reinsertion);
+            return;
         }
+        _split(insert_path, path_indexes, node_id, level);
+        --level;
     }
 
     // adjust bboxes along the insertion path
-    _adjust_parent_bboxes(item_bbox, insert_path, level);
+    _adjust_parent_bboxes(bbox, insert_path, path_indexes, level);
 }
 
 template <typename T>
 Node<T> &RBushBase<T>::_choose_subtree(const BBox &bbox, Node<T> &node, int level,
-                                       std::vector<std::reference_wrapper<Node<T>>> &path) {
+                                       std::vector<std::reference_wrapper<Node<T>>> &path,
+                                       std::vector<size_t> &path_indexes) {
     std::reference_wrapper<Node<T>> target_node = std::ref(node);
     while (true) {
         path.emplace_back(target_node);
@@ -131,87 +643,111 @@ Node<T> &RBushBase<T>::_choose_subtree(const BBox &bbox, Node<T> &node, int leve
         if (target_node.get().is_leaf || static_cast<int>(path.size()) - 1 == level)
             break;
 
-        double min_area = std::numeric_limits<double>::infinity();
-        double min_enlargement = std::numeric_limits<double>::infinity();
-        bool found = false;
-
-        for (const auto &child : target_node.get().children) {
-            double area = child->area();
-            double enlargement = child->enlarged_area(bbox) - area;
-
-            if (enlargement < min_enlargement) {
-                min_area = std::min(min_area, area);
-                min_enlargement = enlargement;
-                target_node = *child;
-                found = true;
-            } else if (enlargement == min_enlargement && area < min_area) {
-                min_area = area;
-                target_node = *child;
-                found = true;
-            }
-        }
-        if (!found)
-            target_node = *target_node.get().children[0];
+        // choose the child with least area enlargement, then least area, from the packed bboxes.
+        // R* chooses among the nodes of the level inserted into by their overlap instead
+        const BBoxArray &child_bboxes = target_node.get().child_bboxes;
+        const size_t target_index =
+            _insert_strategy == InsertStrategy::RSTAR && static_cast<int>(path.size()) == level
+                ? child_bboxes.least_overlap_enlargement(bbox)
+                : child_bboxes.least_enlargement(bbox);
+        path_indexes.emplace_back(target_index);
+        target_node = _nodes[_writable(target_node.get().children[target_index])];
     }
     return target_node;
 }
 
-template <typename T>
-void RBushBase<T>::_split(std::vector<std::reference_wrapper<Node<T>>> &insert_path, int level) {
-    Node<T> &node = insert_path[level].get();
-    const int M = node.children.size();
-    const int m = _min_entries;
-
-    _choose_split_axis(node, m, M);
-
-    const int split_index = _choose_split_index(node, m, M);
-
-    auto new_node = std::make_unique<Node<T>>();
-    new_node->children.insert(new_node->children.end(),
-                              std::make_move_iterator(node.children.begin() + split_index),
-                              std::make_move_iterator(node.children.end()));
-    node.children.resize(split_index);
-    new_node->height = node.height;
-    new_node->is_leaf = node.is_leaf;
+namespace {
+
+// Scratch space of a split, sized at compile time for the common fan-outs so that the loops over
+// the children have constant bounds, and at run time for the others (N = 0)
+template <int N> struct SplitScratch {
+    explicit SplitScratch(int) {}
+
+    std::array<BBox, N> boxes;
+    // bbox of the children from the i-th on, in split order
+    std::array<BBox, N> suffixes;
+    std::array<uint32_t, N> order;
+};
+
+template <> struct SplitScratch<0> {
+    explicit SplitScratch(int n) : boxes(n), suffixes(n), order(n) {}
+
+    std::vector<BBox> boxes;
+    std::vector<BBox> suffixes;
+    std::vector<uint32_t> order;
+};
+
+// Total margin of the bboxes of the first and of the last k children, for k from m to M - m
+template <int N> double split_margins(const SplitScratch<N> &scratch, int M, int m) {
+    const auto box = [&](int i) -> const BBox & { return scratch.boxes[scratch.order[i]]; };
+    BBox left_bbox;
+    BBox right_bbox;
+    for (int i = 0; i < m; ++i) {
+        left_bbox.extend(box(i));
+    }
+    for (int i = M - m; i < M; ++i) {
+        right_bbox.extend(box(i));
+    }
+    double margin = left_bbox.margin() + right_bbox.margin();
 
-    node.calc_bbox();
-    new_node->calc_bbox();
+    for (int i = m; i < M - m; ++i) {
+        left_bbox.extend(box(i));
+        margin += left_bbox.margin();
+    }
 
-    if (level) {
-        insert_path[level - 1].get().children.emplace_back(std::move(new_node));
-    } else {
-        _split_root(node, *new_node);
+    for (int i = M - m - 1; i >= m; --i) {
+        right_bbox.extend(box(i));
+        margin += right_bbox.margin();
     }
+
+    return margin;
 }
 
-template <typename T>
-void RBushBase<T>::_adjust_parent_bboxes(const BBox &bbox,
-                                         std::vector<std::reference_wrapper<Node<T>>> &path,
-                                         int level) {
-    for (int i = level; i >= 0; --i) {
-        path[i].get().extend(bbox);
+// Sorts the children of an overflowing node along the axis whose splits have the least total
+// margin, then returns the split index where the two halves overlap the least, or else have the
+// least area. The bboxes are copied from the packed ones of the node so that sorting and scanning
+// them does not go through the arena, and the prefix and suffix bboxes are each computed once.
+// The children are node ids or the items of a leaf, and their bboxes are sorted along with them
+template <int N, typename C>
+int split_children(std::vector<C> &children, BBoxArray &child_bboxes, int m) {
+    const int M = N > 0 ? N : static_cast<int>(children.size());
+    SplitScratch<N> scratch(M);
+    for (int i = 0; i < M; ++i) {
+        scratch.boxes[i] = child_bboxes[i];
+        scratch.order[i] = i;
     }
-}
 
-template <typename T> void RBushBase<T>::_split_root(Node<T> &node, Node<T> &new_node) {
-    std::unique_ptr<Node<T>> new_root = std::make_unique<Node<T>>();
-    new_root->height = node.height + 1;
-    new_root->is_leaf = false;
-    new_root->children.emplace_back(std::make_unique<Node<T>>(std::move(node)));
-    new_root->children.emplace_back(std::make_unique<Node<T>>(std::move(new_node)));
-    new_root->calc_bbox();
-    _root = std::move(new_root);
-}
+    const auto begin = scratch.order.begin();
+    const auto end = begin + M;
+    const auto by_min_x = [&](uint32_t a, uint32_t b) {
+        return scratch.boxes[a].min_x < scratch.boxes[b].min_x;
+    };
+    const auto by_min_y = [&](uint32_t a, uint32_t b) {
+        return scratch.boxes[a].min_y < scratch.boxes[b].min_y;
+    };
+    std::sort(begin, end, by_min_x);
+    const double x_margin = split_margins(scratch, M, m);
+    std::sort(begin, end, by_min_y);
+    const double y_margin = split_margins(scratch, M, m);
+    if (x_margin < y_margin)
+        std::sort(begin, end, by_min_x);
+
+    const auto box = [&](int i) -> const BBox & { return scratch.boxes[scratch.order[i]]; };
+    BBox suffix;
+    for (int i = M - 1; i >= 0; --i) {
+        suffix.extend(box(i));
+        scratch.suffixes[i] = suffix;
+    }
 
-template <typename T> int RBushBase<T>::_choose_split_index(Node<T> &node, int m, int M) {
     double min_overlap = std::numeric_limits<double>::infinity();
     double min_area = std::numeric_limits<double>::infinity();
     int split_index = M - m;
-
+    BBox bbox1;
+    for (int i = 0; i < m; ++i) {
+        bbox1.extend(box(i));
+    }
     for (int i = m; i <= M - m; ++i) {
-        BBox bbox1 = node.dist_bbox(0, i);
-        BBox bbox2 = node.dist_bbox(i, M);
-
+        const BBox &bbox2 = scratch.suffixes[i];
         double overlap = bbox1.intersection_area(bbox2);
         double area = bbox1.area() + bbox2.area();
 
@@ -223,108 +759,451 @@ template <typename T> int RBushBase<T>::_choose_split_index(Node<T> &node, int m
             min_area = area;
             split_index = i;
         }
+        bbox1.extend(box(i));
     }
 
+    for (int i = 0; i < M; ++i) {
+        child_bboxes.set(i, box(i));
+    }
+    // the children are moved along the cycles of the order, whose visited entries are marked
+    constexpr uint32_t VISITED = std::numeric_limits<uint32_t>::max();
+    for (int i = 0; i < M; ++i) {
+        if (scratch.order[i] == VISITED)
+            continue;
+        C first = std::move(children[i]);
+        int j = i;
+        while (static_cast<int>(scratch.order[j]) != i) {
+            const int next = scratch.order[j];
+            children[j] = std::move(children[next]);
+            scratch.order[j] = VISITED;
+            j = next;
+        }
+        children[j] = std::move(first);
+        scratch.order[j] = VISITED;
+    }
     return split_index;
 }
 
-template <typename T> void RBushBase<T>::_choose_split_axis(Node<T> &node, int m, int M) {
-    double x_margin = _all_dist_margin(node, m, M, true);
-    double y_margin = _all_dist_margin(node, m, M, false);
+template <typename C> int split_children(std::vector<C> &children, BBoxArray &child_bboxes, int m) {
+    // the node holds max_entries + 1 children
+    switch (children.size()) {
+    case 9:
+        return split_children<9>(children, child_bboxes, m);
+    case 10:
+        return split_children<10>(children, child_bboxes, m);
+    case 17:
+        return split_children<17>(children, child_bboxes, m);
+    case 33:
+        return split_children<33>(children, child_bboxes, m);
+    default:
+        return split_children<0>(children, child_bboxes, m);
+    }
+}
+
+} // namespace
 
-    if (x_margin < y_margin) {
-        std::sort(node.children.begin(), node.children.end(),
-                  [](const auto &a, const auto &b) { return a->min_x < b->min_x; });
+template <typename T>
+void RBushBase<T>::_split(std::vector<std::reference_wrapper<Node<T>>> &insert_path,
+                          std::vector<size_t> &path_indexes, NodeId node_id, int level) {
+    Node<T> &node = insert_path[level].get();
+    const int m = _min_entries;
+    const int split_index = node.is_leaf ? split_children(node.items, node.child_bboxes, m)
+                                         : split_children(node.children, node.child_bboxes, m);
+
+    NodeId new_node_id = _nodes.create();
+    Node<T> &new_node = _nodes[new_node_id];
+    new_node.height = node.height;
+    new_node.is_leaf = node.is_leaf;
+    _set_layout(new_node);
+    if (node.is_leaf) {
+        new_node.items.assign(std::make_move_iterator(node.items.begin() + split_index),
+                              std::make_move_iterator(node.items.end()));
+        node.items.erase(node.items.begin() + split_index, node.items.end());
+        new_node.child_bboxes.reserve(new_node.items.size());
+        for (size_t i = split_index; i < node.child_bboxes.size(); ++i) {
+            new_node.child_bboxes.push_back(node.child_bboxes[i]);
+        }
+        node.child_bboxes.truncate(split_index);
+        _reindex_items(new_node_id, node_id);
+    } else {
+        new_node.children.assign(node.children.begin() + split_index, node.children.end());
+        node.children.resize(split_index);
+    }
+
+    node.calc_bbox(_nodes);
+    new_node.calc_bbox(_nodes);
+    _adopt_children(new_node_id);
+
+    if (level) {
+        new_node.parent = node.parent;
+        Node<T> &parent = insert_path[level - 1].get();
+        parent.children.emplace_back(new_node_id);
+        parent.child_bboxes.set(path_indexes[level - 1], node);
+        parent.child_bboxes.push_back(new_node);
+    } else {
+        _split_root(_root, new_node_id);
     }
 }
 
 template <typename T>
-double RBushBase<T>::_all_dist_margin(Node<T> &node, int m, int M, bool compare_min_x) {
-    if (compare_min_x) {
-        std::sort(node.children.begin(), node.children.end(),
-                  [](const auto &a, const auto &b) { return a->min_x < b->min_x; });
+void RBushBase<T>::_adjust_parent_bboxes(const BBox &bbox,
+                                         std::vector<std::reference_wrapper<Node<T>>> &path,
+                                         std::vector<size_t> &path_indexes, int level) {
+    for (int i = level; i >= 0; --i) {
+        path[i].get().extend(bbox);
+        if (i > 0) {
+            // keep the copy of the bbox packed in the parent in sync
+            path[i - 1].get().child_bboxes.set(path_indexes[i - 1], path[i].get());
+        }
+    }
+}
+
+template <typename T>
+void RBushBase<T>::_take_out_farthest(std::vector<std::reference_wrapper<Node<T>>> &insert_path,
+                                      NodeId node_id, int level, Reinsertion &reinsertion) {
+    Node<T> &node = insert_path[level].get();
+    // the bbox of the node may not include the children added below yet
+    BBox bbox;
+    for (size_t i = 0; i < node.child_bboxes.size(); ++i) {
+        bbox.extend(node.child_bboxes[i]);
+    }
+    const double center_x = (bbox.min_x + bbox.max_x) / 2;
+    const double center_y = (bbox.min_y + bbox.max_y) / 2;
+
+    std::vector<std::pair<double, uint32_t>> by_distance;
+    by_distance.reserve(node.num_children());
+    for (uint32_t i = 0; i < node.num_children(); ++i) {
+        const BBox child = node.child_bboxes[i];
+        const double dx = (child.min_x + child.max_x) / 2 - center_x;
+        const double dy = (child.min_y + child.max_y) / 2 - center_y;
+        by_distance.emplace_back(dx * dx + dy * dy, i);
+    }
+    std::sort(by_distance.begin(), by_distance.end());
+
+    // 30% of the children are taken out as in the R*-tree, and the closest of them are put back
+    // first, so they go last onto the stack
+    const size_t kept = by_distance.size() - std::max<size_t>(1, std::lround(_max_entries * 0.3));
+    if (node.is_leaf) {
+        std::vector<T> items;
+        std::vector<BBox> bboxes;
+        items.reserve(kept);
+        bboxes.reserve(kept);
+        for (size_t i = 0; i < kept; ++i) {
+            items.emplace_back(std::move(node.items[by_distance[i].second]));
+            bboxes.emplace_back(node.child_bboxes[by_distance[i].second]);
+        }
+        for (size_t i = by_distance.size(); i-- > kept;) {
+            const uint32_t index = by_distance[i].second;
+            _unindex_item(node.items[index], node_id);
+            reinsertion.entries.push_back({node.child_bboxes[index], std::move(node.items[index])});
+        }
+        node.items = std::move(items);
+        node.child_bboxes.clear();
+        for (const BBox &bbox : bboxes) {
+            node.child_bboxes.push_back(bbox);
+        }
     } else {
-        std::sort(node.children.begin(), node.children.end(),
-                  [](const auto &a, const auto &b) { return a->min_y < b->min_y; });
+        std::vector<NodeId> children;
+        children.reserve(kept);
+        for (size_t i = 0; i < kept; ++i) {
+            children.emplace_back(node.children[by_distance[i].second]);
+        }
+        for (size_t i = by_distance.size(); i-- > kept;) {
+            reinsertion.nodes.emplace_back(node.children[by_distance[i].second], node.height);
+        }
+        node.children = std::move(children);
     }
 
-    BBox left_bbox = node.dist_bbox(0, m);
-    BBox right_bbox = node.dist_bbox(M - m, M);
-    double margin = left_bbox.margin() + right_bbox.margin();
+    // the node and its ancestors shrink, and lose the items taken out
+    for (int i = level; i >= 0; --i) {
+        insert_path[i].get().calc_bbox(_nodes);
+    }
+}
 
-    for (int i = m; i < M - m; ++i) {
-        left_bbox.extend(*node.children[i]);
-        margin += left_bbox.margin();
+template <typename T> void RBushBase<T>::_split_root(NodeId node, NodeId new_node) {
+    NodeId new_root_id = _nodes.create();
+    Node<T> &new_root = _nodes[new_root_id];
+    new_root.height = _nodes[node].height + 1;
+    new_root.is_leaf = false;
+    _set_layout(new_root);
+    new_root.children.emplace_back(node);
+    new_root.children.emplace_back(new_node);
+    new_root.calc_bbox(_nodes);
+    _adopt_children(new_root_id);
+    _root = new_root_id;
+}
+
+template <typename T> void RBushBase<T>::_adopt_children(NodeId node_id) {
+    for (NodeId child : _nodes[node_id].children) {
+        _nodes[child].parent = node_id;
     }
+}
 
-    for (int i = M - m - 1; i >= m; --i) {
-        right_bbox.extend(*node.children[i]);
-        margin += right_bbox.margin();
+template <typename T> void RBushBase<T>::_refit(NodeId node_id) {
+    while (true) {
+        Node<T> &node = _nodes[node_id];
+        BBox bbox;
+        if (node.is_leaf) {
+            for (size_t i = 0; i < node.child_bboxes.size(); ++i) {
+                bbox.extend(node.child_bboxes[i]);
+            }
+        } else {
+            for (NodeId child : node.children) {
+                bbox.extend(_nodes[child]);
+            }
+        }
+        if (bbox.min_x == node.min_x && bbox.min_y == node.min_y && bbox.max_x == node.max_x &&
+            bbox.max_y == node.max_y)
+            return;
+        static_cast<BBox &>(node) = bbox;
+        if (node_id == _root || node_id == _buffer)
+            return;
+
+        Node<T> &parent = _nodes[node.parent];
+        const auto it = std::find(parent.children.begin(), parent.children.end(), node_id);
+        parent.child_bboxes.set(it - parent.children.begin(), bbox);
+        node_id = node.parent;
     }
+}
 
-    return margin;
+template <typename T> void RBushBase<T>::_index_item(const T &item, NodeId leaf) {
+    if (_identity_index)
+        _index.emplace(identity_key(item), leaf);
 }
 
-template <typename T> void RBushBase<T>::load(std::vector<T> &items) {
-    DEBUG_TIMER("load");
-    if (items.empty())
+template <typename T> void RBushBase<T>::_unindex_item(const T &item, NodeId leaf) {
+    if (!_identity_index)
         return;
+    auto range = _index.equal_range(identity_key(item));
+    for (auto it = range.first; it != range.second; ++it) {
+        if (it->second == leaf) {
+            _index.erase(it);
+            return;
+        }
+    }
+}
 
-    if (items.size() < _min_entries) {
-        for (const auto &item : items) {
-            insert(item);
+// Equal items of the old leaf each have their own index entry, and moving any of them is enough
+template <typename T> void RBushBase<T>::_reindex_items(NodeId leaf, NodeId old_leaf) {
+    if (!_identity_index)
+        return;
+    for (const T &item : _nodes[leaf].items) {
+        auto range = _index.equal_range(identity_key(item));
+        for (auto it = range.first; it != range.second; ++it) {
+            if (it->second == old_leaf) {
+                it->second = leaf;
+                break;
+            }
         }
+    }
+}
+
+template <typename T> void RBushBase<T>::_index_subtree(NodeId node_id) {
+    if (!_identity_index)
         return;
+    std::vector<NodeId> nodes_to_visit{node_id};
+    while (!nodes_to_visit.empty()) {
+        const NodeId id = nodes_to_visit.back();
+        nodes_to_visit.pop_back();
+        const Node<T> &node = _nodes[id];
+        for (const T &item : node.items) {
+            _index_item(item, id);
+        }
+        nodes_to_visit.insert(nodes_to_visit.end(), node.children.begin(), node.children.end());
     }
+}
 
-    std::vector<std::unique_ptr<Node<T>>> nodes;
-    nodes.reserve(items.size());
+template <typename T> void RBushBase<T>::_rebuild_index() {
+    _index.clear();
+    _index_subtree(_root);
+}
+
+// The nodes of a snapshot are those of the tree of its generation or older. The tree copies such a
+// node before changing it, which means copying its ancestors too so that they point to the copy,
+// and it keeps the nodes it takes out until no snapshot may read them, so that a snapshot only
+// reads nodes that nothing writes to. The parents of the shared nodes are the exception, only the
+// tree follows them and they always point to its own copies
+template <typename T> void RBushBase<T>::snapshot_of(RBushBase &tree) {
+    if (tree._lease) {
+        _lease = tree._lease;
+    } else {
+        // the snapshot holds no buffered items, which it could not merge
+        tree.flush();
+        tree._begin_change();
+        if (!tree._snapshots)
+            tree._snapshots = std::make_shared<SnapshotRegistry>();
+        tree._frozen_generation = tree._nodes.generation();
+        _lease = SnapshotRegistry::lease(tree._snapshots, tree._frozen_generation);
+        tree._nodes.next_generation();
+    }
+    ++_version;
+    _nodes = tree._nodes.share();
+    _root = tree._root;
+    _buffer = tree._buffer;
+    _max_entries = tree._max_entries;
+    _min_entries = tree._min_entries;
+    _identity_index = false;
+    _index.clear();
+    _forget_snapshots();
+}
+
+template <typename T> void RBushBase<T>::_begin_change() {
+    if (_lease)
+        throw std::runtime_error("a snapshot cannot be changed");
+    if (!_snapshots)
+        return;
+    const uint64_t frozen = _snapshots->newest();
+    if (frozen == _frozen_generation)
+        return;
+
+    // the nodes newer than the snapshots left can be reused
+    _frozen_generation = frozen;
+    auto reusable = std::partition(_retired.begin(), _retired.end(),
+                                   [&](NodeId id) { return _nodes[id].generation <= frozen; });
+    for (auto it = reusable; it != _retired.end(); ++it) {
+        _nodes.destroy(*it);
+    }
+    _retired.erase(reusable, _retired.end());
+    if (!frozen)
+        _snapshots.reset();
+}
+
+template <typename T> NodeId RBushBase<T>::_writable(NodeId id) {
+    if (!_shared(id))
+        return id;
+
+    // the parent first, so that the copy gets the copy of the parent
+    const bool is_top = id == _root || id == _buffer;
+    const NodeId parent_id = is_top ? 0 : _writable(_nodes[id].parent);
+    const NodeId copy = _nodes.copy(id);
+    if (id == _root) {
+        _root = copy;
+    } else if (id == _buffer) {
+        _buffer = copy;
+    } else {
+        Node<T> &parent = _nodes[parent_id];
+        *std::find(parent.children.begin(), parent.children.end(), id) = copy;
+    }
+    _adopt_children(copy);
+    _reindex_items(copy, id);
+    _retired.emplace_back(id);
+    return copy;
+}
+
+template <typename T> void RBushBase<T>::_release(NodeId id) {
+    if (_shared(id)) {
+        _retired.emplace_back(id);
+    } else {
+        _nodes.destroy(id);
+    }
+}
+
+template <typename T> void RBushBase<T>::_forget_snapshots() {
+    _snapshots.reset();
+    _frozen_generation = 0;
+    _retired.clear();
+}
+
+template <typename T> void RBushBase<T>::load(std::vector<T> &items) {
+    DEBUG_TIMER("load");
+    metrics::OpTimer timer(metrics::Op::LOAD);
+    _begin_change();
+    if (items.empty())
+        return;
+
+    std::vector<Entry<T>> entries;
+    entries.reserve(items.size());
     for (auto &item : items) {
-        auto node = std::make_unique<Node<T>>(item);
-        BBox bbox = to_bbox(item);
-        node->min_x = bbox.min_x;
-        node->min_y = bbox.min_y;
-        node->max_x = bbox.max_x;
-        node->max_y = bbox.max_y;
-        nodes.emplace_back(std::move(node));
+        entries.push_back({to_bbox(item), item});
+    }
+    _load(entries);
+}
+
+template <typename T> void RBushBase<T>::_load(std::vector<Entry<T>> &entries) {
+    if (entries.empty())
+        return;
+    ++_version;
+    _merge(entries);
+}
+
+// Adds entries to the tree, indexing them in the leaves they end up in. The subtree built from
+// them is indexed once built, as the leaves are filled in by several threads
+template <typename T> void RBushBase<T>::_merge(std::vector<Entry<T>> &entries) {
+    if (entries.size() < _min_entries) {
+        for (const Entry<T> &entry : entries) {
+            _insert(entry);
+        }
+        return;
     }
 
     // recursively build the tree with the given data from scratch using OMT algorithm
-    auto node = _build(nodes, 0, nodes.size() - 1, 0);
+    NodeId node = _nodes.create_range(_build_size(entries.size(), 0));
+    _build(entries, 0, entries.size() - 1, 0, node);
+    _index_subtree(node);
 
-    if (_root->children.empty()) {
+    if (_nodes[_root].num_children() == 0) {
         // save as is if tree is empty
-        _root = std::move(node);
-    } else if (_root->height == node->height) {
+        _release(_root);
+        _root = node;
+    } else if (_nodes[_root].height == _nodes[node].height) {
         // split root if trees have the same height
-        _split_root(*_root, *node);
+        _split_root(_root, node);
     } else {
-        if (_root->height < node->height) {
+        if (_nodes[_root].height < _nodes[node].height) {
             // swap trees if inserted one is bigger
             std::swap(_root, node);
         }
 
         // insert the small tree into the large tree at appropriate level
-        int level = _root->height - node->height - 1;
-        _insert(std::move(node), level);
+        int level = _nodes[_root].height - _nodes[node].height - 1;
+        _insert(node, level);
     }
 }
 
+// Number of nodes _build creates for N entries, following the same splits
+template <typename T> size_t RBushBase<T>::_build_size(int N, int height) const {
+    int M = _max_entries;
+    if (N <= M)
+        return 1;
+    if (!height) {
+        height = std::ceil(std::log(N) / std::log(M));
+        M = std::ceil(N / std::pow(M, height - 1));
+    }
+
+    const int N2 = std::ceil(static_cast<double>(N) / M);
+    const int N1 = N2 * std::ceil(std::sqrt(M));
+    size_t size = 1;
+    for (int i = 0; i < N; i += N1) {
+        const int slab_size = std::min(N1, N - i);
+        for (int j = 0; j < slab_size; j += N2) {
+            size += _build_size(std::min(N2, slab_size - j), height - 1);
+        }
+    }
+    return size;
+}
+
+// Each node is built into node_id, its subtree taking the _build_size(N, height) ids from there in
+// preorder. The slabs of a large node are sorted and built in parallel as they only touch their
+// own slice of nodes and their own ids, which keeps the tree the same whatever the thread count
 template <typename T>
-std::unique_ptr<Node<T>> RBushBase<T>::_build(std::vector<std::unique_ptr<Node<T>>> &nodes,
-                                              int left, int right, int height) {
+void RBushBase<T>::_build(std::vector<Entry<T>> &entries, int left, int right, int height,
+                          NodeId node_id) {
     const int N = right - left + 1;
     int M = _max_entries;
+    Node<T> &node = _nodes[node_id];
 
     if (N <= M) {
-        // reached leaf level; return leaf
-        auto node = std::make_unique<Node<T>>();
-        node->children.reserve(N);
+        // reached leaf level; return leaf. The items are moved, which leaves Python objects alone
+        // while the slabs are built without the GIL
+        _set_layout(node);
+        node.items.reserve(N);
+        node.child_bboxes.reserve(N);
         for (int i = left; i <= right; ++i) {
-            node->children.emplace_back(std::move(nodes[i]));
+            node.items.emplace_back(std::move(entries[i].item));
+            node.child_bboxes.push_back(entries[i].bbox);
         }
-        node->calc_bbox();
-        return node;
+        node.calc_bbox(_nodes);
+        return;
     }
 
     if (!height) {
@@ -335,34 +1214,56 @@ std::unique_ptr<Node<T>> RBushBase<T>::_build(std::vector<std::unique_ptr<Node<T
         M = std::ceil(N / std::pow(M, height - 1));
     }
 
-    auto node = std::make_unique<Node<T>>();
-    node->is_leaf = false;
-    node->height = height;
+    node.is_leaf = false;
+    _set_layout(node);
+    node.height = height;
 
     // split the items into M mostly square tiles
     const int N2 = std::ceil(static_cast<double>(N) / M);
     const int N1 = N2 * std::ceil(std::sqrt(M));
 
-    _multi_select(nodes, left, right, N1, true);
+    _multi_select(entries, left, right, N1, true);
 
+    std::vector<int> slabs;
+    NodeId child_id = node_id + 1;
     for (int i = left; i <= right; i += N1) {
+        slabs.emplace_back(i);
         const int right2 = std::min(i + N1 - 1, right);
-        _multi_select(nodes, i, right2, N2, false);
-
         for (int j = i; j <= right2; j += N2) {
             const int right3 = std::min(j + N2 - 1, right2);
-            // pack each entry recursively
-            node->children.emplace_back(_build(nodes, j, right3, height - 1));
+            node.children.emplace_back(child_id);
+            child_id += _build_size(right3 - j + 1, height - 1);
         }
     }
 
-    node->calc_bbox();
-    return node;
+    auto build_slabs = [&](size_t begin, size_t end) {
+        for (size_t slab = begin; slab < end; ++slab) {
+            const int i = slabs[slab];
+            const int right2 = std::min(i + N1 - 1, right);
+            _multi_select(entries, i, right2, N2, false);
+
+            // the tiles of the slab are the children from its first one on
+            size_t child = (i - left) / N2;
+            for (int j = i; j <= right2; j += N2) {
+                const int right3 = std::min(j + N2 - 1, right2);
+                // pack each entry recursively
+                _build(entries, j, right3, height - 1, node.children[child++]);
+            }
+        }
+    };
+    if (N >= PARALLEL_BUILD_SIZE) {
+        ThreadPool::get_instance().parallel_for(slabs.size(), build_slabs);
+    } else {
+        build_slabs(0, slabs.size());
+    }
+
+    node.calc_bbox(_nodes);
+    _adopt_children(node_id);
 }
 
 template <typename T>
-void RBushBase<T>::_multi_select(std::vector<std::unique_ptr<Node<T>>> &nodes, int left, int right,
-                                 int n, bool compare_min_x) {
+void RBushBase<T>::_multi_select(std::vector<Entry<T>> &entries, int left, int right, int n,
+                                 bool compare_min_x) {
     std::vector<int> stack = {left, right};
 
     while (!stack.empty()) {
@@ -375,7 +1276,7 @@ void RBushBase<T>::_multi_select(std::vector<std::unique_ptr<Node<T>>> &nodes, i
             continue;
 
         const int mid = left + std::ceil(static_cast<double>(right - left) / n / 2) * n;
-        _quick_select(nodes, mid, left, right, compare_min_x);
+        _quick_select(entries, mid, left, right, compare_min_x);
 
         stack.emplace_back(left);
         stack.emplace_back(mid);
@@ -385,8 +1286,8 @@ void RBushBase<T>::_multi_select(std::vector<std::unique_ptr<Node<T>>> &nodes, i
 }
 
 template <typename T>
-void RBushBase<T>::_quick_select(std::vector<std::unique_ptr<Node<T>>> &arr, int k, int left,
-                                 int right, bool compare_min_x) const {
+void RBushBase<T>::_quick_select(std::vector<Entry<T>> &arr, int k, int left, int right,
+                                 bool compare_min_x) const {
     while (right > left) {
         if (right - left > 600) {
             const double n = right - left + 1;
@@ -400,12 +1301,12 @@ void RBushBase<T>::_quick_select(std::vector<std::unique_ptr<Node<T>>> &arr, int
             _quick_select(arr, k, new_left, new_right, compare_min_x);
         }
 
-        const std::reference_wrapper<Node<T>> t = *arr[k];
+        const BBox t = arr[k].bbox;
         int i = left;
         int j = right;
 
         std::swap(arr[left], arr[k]);
-        if (_compare_node_min(*arr[right], t, compare_min_x) > 0) {
+        if (_compare_node_min(arr[right].bbox, t, compare_min_x) > 0) {
             std::swap(arr[left], arr[right]);
         }
 
@@ -413,124 +1314,503 @@ void RBushBase<T>::_quick_select(std::vector<std::unique_ptr<Node<T>>> &arr, int
             std::swap(arr[i], arr[j]);
             ++i;
             --j;
-            while (_compare_node_min(*arr[i], t, compare_min_x) < 0)
+            while (_compare_node_min(arr[i].bbox, t, compare_min_x) < 0)
                 ++i;
-            while (_compare_node_min(*arr[j], t, compare_min_x) > 0) {
+            while (_compare_node_min(arr[j].bbox, t, compare_min_x) > 0) {
                 --j;
             }
         }
 
-        if (_compare_node_min(*arr[left], t, compare_min_x) == 0) {
-            std::swap(arr[left], arr[j]);
-        } else {
-            ++j;
-            std::swap(arr[j], arr[right]);
-        }
+        if (_compare_node_min(arr[left].bbox, t, compare_min_x) == 0) {
+            std::swap(arr[left], arr[j]);
+        } else {
+            ++j;
+            std::swap(arr[j], arr[right]);
+        }
+
+        if (j <= k)
+            left = j + 1;
+        if (k <= j)
+            right = j - 1;
+    }
+}
+
+template <typename T>
+double RBushBase<T>::_compare_node_min(const BBox &a, const BBox &b, bool compare_min_x) const {
+    return compare_min_x ? a.min_x - b.min_x : a.min_y - b.min_y;
+}
+
+template <typename T>
+void RBushBase<T>::remove(const T &item, const std::function<bool(const T &, const T &)> &equals) {
+    DEBUG_TIMER("remove");
+    metrics::OpTimer timer(metrics::Op::REMOVE);
+    // the identity index finds the entry without its bbox
+    std::optional<BBox> bbox;
+    if (!_identity_index || equals)
+        bbox = to_bbox(item);
+    flush();
+    _begin_change();
+    ++_version;
+    std::optional<EntryRef> entry = _find_entry(item, bbox, equals);
+    if (!entry)
+        return;
+    std::vector<NodeId> leaves{_detach_entry(*entry)};
+    _condense(leaves);
+}
+
+// The entries are all taken out before the touched nodes are condensed together, so a node shared
+// by many of them is refreshed only once
+template <typename T>
+size_t RBushBase<T>::remove_many(const std::vector<T> &items,
+                                 const std::function<bool(const T &, const T &)> &equals) {
+    DEBUG_TIMER("remove_many");
+    metrics::OpTimer timer(metrics::Op::REMOVE_MANY);
+    std::vector<std::optional<BBox>> bboxes(items.size());
+    if (!_identity_index || equals) {
+        for (size_t i = 0; i < items.size(); ++i) {
+            bboxes[i] = to_bbox(items[i]);
+        }
+    }
+
+    flush();
+    _begin_change();
+    ++_version;
+    std::vector<NodeId> leaves;
+    try {
+        for (size_t i = 0; i < items.size(); ++i) {
+            std::optional<EntryRef> entry = _find_entry(items[i], bboxes[i], equals);
+            if (entry)
+                leaves.emplace_back(_detach_entry(*entry));
+        }
+    } catch (...) {
+        // equals may throw, the entries taken out so far stay removed
+        _condense(leaves);
+        throw;
+    }
+    const size_t removed = leaves.size();
+    _condense(leaves);
+    return removed;
+}
+
+template <typename T>
+bool RBushBase<T>::update(const T &item, const std::optional<BBox> &old_bbox, double slack) {
+    DEBUG_TIMER("update");
+    metrics::OpTimer timer(metrics::Op::UPDATE);
+    if (!old_bbox && !_identity_index)
+        throw std::invalid_argument(
+            "the old bbox of the item is needed without the identity index");
+    const BBox bbox = to_bbox(item);
+    flush();
+    _begin_change();
+    ++_version;
+    std::optional<EntryRef> entry = _find_entry(item, old_bbox, nullptr);
+    if (!entry)
+        return false;
+    std::vector<NodeId> leaves;
+    _move_entry(*entry, bbox, slack, leaves);
+    _condense(leaves);
+    return true;
+}
+
+template <typename T>
+size_t RBushBase<T>::update_many(const std::vector<T> &items,
+                                 const std::optional<std::vector<BBox>> &old_bboxes,
+                                 double slack) {
+    DEBUG_TIMER("update_many");
+    metrics::OpTimer timer(metrics::Op::UPDATE_MANY);
+    if (!old_bboxes && !_identity_index)
+        throw std::invalid_argument(
+            "the old bboxes of the items are needed without the identity index");
+    if (old_bboxes && old_bboxes->size() != items.size())
+        throw std::invalid_argument("there must be one old bbox per item");
+    std::vector<BBox> bboxes;
+    bboxes.reserve(items.size());
+    for (const T &item : items) {
+        bboxes.emplace_back(to_bbox(item));
+    }
+
+    flush();
+    _begin_change();
+    ++_version;
+    size_t updated = 0;
+    std::vector<NodeId> leaves;
+    for (size_t i = 0; i < items.size(); ++i) {
+        std::optional<BBox> old_bbox;
+        if (old_bboxes)
+            old_bbox = (*old_bboxes)[i];
+        std::optional<EntryRef> entry = _find_entry(items[i], old_bbox, nullptr);
+        if (!entry)
+            continue;
+        _move_entry(*entry, bboxes[i], slack, leaves);
+        ++updated;
+    }
+    _condense(leaves);
+    return updated;
+}
+
+// Each pass goes down from the root, so besides the repacking a call costs the pairs of children
+// of the nodes on the way and the counting of the nodes of at most budget items
+template <typename T> size_t RBushBase<T>::optimize(size_t budget) {
+    DEBUG_TIMER("optimize");
+    metrics::OpTimer timer(metrics::Op::OPTIMIZE);
+    flush();
+    _begin_change();
+    ++_version;
+    size_t repacked = 0;
+    size_t work = 0;
+    while (std::optional<NodeId> subtree = _worst_subtree(_root, budget - repacked, work)) {
+        repacked += _nodes[*subtree].count;
+        _repack(*subtree);
+    }
+    return repacked;
+}
 
-        if (j <= k)
-            left = j + 1;
-        if (k <= j)
-            right = j - 1;
+// Subtrees inside the box are dropped as a whole without visiting their entries one by one
+template <typename T> size_t RBushBase<T>::remove_in(const BBox &bbox) {
+    DEBUG_TIMER("remove_in");
+    metrics::OpTimer timer(metrics::Op::REMOVE_IN);
+    flush();
+    _begin_change();
+    ++_version;
+    if (!bbox.intersects(_nodes[_root]))
+        return 0;
+
+    size_t removed = 0;
+    std::vector<NodeId> touched;
+    std::vector<NodeId> nodes_to_search{_root};
+    std::vector<uint32_t> matches;
+    while (!nodes_to_search.empty()) {
+        NodeId node_id = nodes_to_search.back();
+        nodes_to_search.pop_back();
+        Node<T> *node = &_nodes[node_id];
+        matches.resize(std::max(matches.size(), node->num_children()));
+        const size_t num_matches = node->child_bboxes.intersecting(bbox, matches.data());
+
+        // taken out from the back so the indexes of the remaining matches stay valid
+        bool changed = false;
+        for (size_t i = num_matches; i-- > 0;) {
+            const size_t index = matches[i];
+            if (!node->is_leaf && !bbox.contains(node->child_bboxes[index])) {
+                nodes_to_search.emplace_back(node->children[index]);
+                continue;
+            }
+            if (!changed) {
+                node_id = _writable(node_id);
+                node = &_nodes[node_id];
+                changed = true;
+            }
+            if (node->is_leaf) {
+                _unindex_item(node->items[index], node_id);
+                node->items.erase(node->items.begin() + index);
+                node->child_bboxes.erase(index);
+                ++removed;
+            } else {
+                const NodeId child = node->children[index];
+                removed += _nodes[child].count;
+                _destroy_subtree(child);
+                node->children.erase(node->children.begin() + index);
+            }
+        }
+        if (changed)
+            touched.emplace_back(node_id);
     }
+    // the ancestors of the touched nodes are refreshed by the condense pass as well
+    _condense(touched);
+    return removed;
 }
 
-template <typename T>
-double RBushBase<T>::_compare_node_min(const BBox &a, const BBox &b, bool compare_min_x) const {
-    return compare_min_x ? a.min_x - b.min_x : a.min_y - b.min_y;
+namespace {
+
+bool same_bbox(const BBox &a, const BBox &b) {
+    return a.min_x == b.min_x && a.min_y == b.min_y && a.max_x == b.max_x && a.max_y == b.max_y;
 }
 
+} // namespace
+
 template <typename T>
-void RBushBase<T>::remove(const T &item, const std::function<bool(const T &, const T &)> &equals) {
-    DEBUG_TIMER("remove");
-    BBox bbox = to_bbox(item);
-    std::vector<std::reference_wrapper<Node<T>>> path;
+std::optional<EntryRef>
+RBushBase<T>::_find_entry(const T &item, const std::optional<BBox> &bbox,
+                          const std::function<bool(const T &, const T &)> &equals) {
+    if (_identity_index && !equals) {
+        auto range = _index.equal_range(identity_key(item));
+        // of several entries with the same key, prefer one with the same bbox
+        std::optional<EntryRef> found;
+        for (auto it = range.first; it != range.second; ++it) {
+            const Node<T> &leaf = _nodes[it->second];
+            for (size_t i = 0; i < leaf.items.size(); ++i) {
+                if (!same_item(leaf.items[i], item))
+                    continue;
+                if (!bbox || same_bbox(leaf.child_bboxes[i], *bbox))
+                    return EntryRef{it->second, i};
+                if (!found)
+                    found = EntryRef{it->second, i};
+            }
+        }
+        return found;
+    }
+
+    std::vector<NodeId> path;
     std::vector<size_t> children_indexes;
-    std::reference_wrapper<Node<T>> current_node = std::ref(*_root);
+    NodeId current_id = _root;
     size_t children_index = 0;
     bool going_up = false;
 
     // depth-first iterative tree traversal
     while (true) {
-        if (current_node.get().is_leaf) { // search for item
-            auto it = std::find_if(
-                current_node.get().children.begin(), current_node.get().children.end(),
-                [&](const std::unique_ptr<Node<T>> &child) {
-                    return equals ? equals(*child->data, item) : (*child->data).is(item);
-                });
-            if (it != current_node.get().children.end()) {
-                current_node.get().children.erase(it);
-                path.emplace_back(current_node);
-                _condense(path);
-                return;
-            }
+        const Node<T> &current_node = _nodes[current_id];
+        if (current_node.is_leaf) { // search for item
+            auto it = std::find_if(current_node.items.begin(), current_node.items.end(),
+                                   [&](const T &data) {
+                                       return equals ? equals(data, item) : same_item(data, item);
+                                   });
+            if (it != current_node.items.end())
+                return EntryRef{current_id, static_cast<size_t>(it - current_node.items.begin())};
         }
 
-        if (!going_up && !current_node.get().is_leaf &&
-            current_node.get().contains(bbox)) { // go down
-            path.emplace_back(current_node);
+        if (!going_up && !current_node.is_leaf && current_node.contains(*bbox)) { // go down
+            path.emplace_back(current_id);
             children_indexes.emplace_back(children_index);
             children_index = 0;
-            current_node = *current_node.get().children[0];
+            current_id = current_node.children[0];
         } else if (!path.empty() &&
-                   children_index + 1 < path.back().get().children.size()) { // go right
+                   children_index + 1 < _nodes[path.back()].children.size()) { // go right
             going_up = false; // can go down when visiting a new node
-            current_node = *path.back().get().children[++children_index];
+            current_id = _nodes[path.back()].children[++children_index];
         } else if (!path.empty()) { // go up
-            current_node = path.back();
+            current_id = path.back();
             children_index = children_indexes.back();
             path.pop_back();
             children_indexes.pop_back();
             going_up = true; // so it won't go down again when we back to parent
         } else {
             // if we can't go down, up or right, then we're done
-            return;
+            return std::nullopt;
+        }
+    }
+}
+
+template <typename T> NodeId RBushBase<T>::_detach_entry(const EntryRef &entry) {
+    const NodeId leaf_id = _writable(entry.leaf);
+    Node<T> &leaf = _nodes[leaf_id];
+    _unindex_item(leaf.items[entry.index], leaf_id);
+    leaf.items.erase(leaf.items.begin() + entry.index);
+    leaf.child_bboxes.erase(entry.index);
+    return leaf_id;
+}
+
+// An entry moved out of its leaf is reinserted before the leaf is condensed, so that the tree is
+// never left empty meanwhile. Until then the leaf may be left empty, and its ancestors count the
+// entry twice if the entry goes back under them
+template <typename T>
+void RBushBase<T>::_move_entry(const EntryRef &entry, const BBox &bbox, double slack,
+                               std::vector<NodeId> &leaves) {
+    const NodeId leaf_id = _writable(entry.leaf);
+    Node<T> &leaf = _nodes[leaf_id];
+    const BBox grown(leaf.min_x - slack, leaf.min_y - slack, leaf.max_x + slack,
+                     leaf.max_y + slack);
+    if (leaf_id == _root || leaf_id == _buffer || grown.contains(bbox)) {
+        leaf.child_bboxes.set(entry.index, bbox);
+        _refit(leaf_id);
+        return;
+    }
+
+    const Entry<T> moved{bbox, std::move(leaf.items[entry.index])};
+    _unindex_item(moved.item, leaf_id);
+    leaf.items.erase(leaf.items.begin() + entry.index);
+    leaf.child_bboxes.erase(entry.index);
+    leaf.calc_bbox(_nodes);
+    _insert(moved);
+    leaves.emplace_back(leaf_id);
+}
+
+template <typename T> void RBushBase<T>::_destroy_subtree(NodeId node_id) {
+    std::vector<NodeId> nodes_to_destroy{node_id};
+    while (!nodes_to_destroy.empty()) {
+        const NodeId id = nodes_to_destroy.back();
+        nodes_to_destroy.pop_back();
+        const Node<T> &node = _nodes[id];
+        for (const T &item : node.items) {
+            _unindex_item(item, id);
+        }
+        nodes_to_destroy.insert(nodes_to_destroy.end(), node.children.begin(),
+                                node.children.end());
+        _release(id);
+    }
+}
+
+// Overlap alone does not make a node worse, as a packed node of large items overlaps too
+template <typename T> double RBushBase<T>::_badness(const Node<T> &node) const {
+    // the children a node of the same height would need for the count if they were full
+    const double fewest = std::ceil(node.count / std::pow(_max_entries, node.height - 1));
+    double overlap = 0;
+    for (size_t i = 0; i < node.children.size(); ++i) {
+        for (size_t j = i + 1; j < node.children.size(); ++j) {
+            overlap += node.child_bboxes[i].intersection_area(node.child_bboxes[j]);
         }
     }
+    const double area = node.area();
+    return (1 - fewest / node.children.size()) * (1 + (area > 0 ? overlap / area : 0));
 }
 
+// Goes down to the worst children first, then to the next ones while the subtrees found are not
+// worth repacking, counting the nodes of at most budget items so that a call stays bounded
 template <typename T>
-void RBushBase<T>::_condense(std::vector<std::reference_wrapper<Node<T>>> &path) {
-    for (int i = path.size() - 1; i >= 0; --i) {
-        Node<T> &node = path[i].get();
-        if (node.children.empty()) {
-            if (i > 0) {
-                Node<T> &parent = path[i - 1].get();
-                auto it = std::find_if(
-                    parent.children.begin(), parent.children.end(),
-                    [&](const std::unique_ptr<Node<T>> &child) { return child.get() == &node; });
-                if (it != parent.children.end()) {
-                    parent.children.erase(it);
-                }
+std::optional<NodeId> RBushBase<T>::_worst_subtree(NodeId node_id, size_t budget,
+                                                   size_t &work) const {
+    const Node<T> &node = _nodes[node_id];
+    if (node.count > budget) {
+        // the smallest subtrees worth repacking are those of the parents of leaves
+        if (node.height <= 2)
+            return std::nullopt;
+        std::vector<std::pair<double, NodeId>> children;
+        for (NodeId child : node.children) {
+            children.emplace_back(_badness(_nodes[child]), child);
+        }
+        std::sort(children.begin(), children.end(), std::greater<>());
+        for (const auto &[badness, child] : children) {
+            if (badness <= 0 || work >= budget)
+                break;
+            if (std::optional<NodeId> subtree = _worst_subtree(child, budget, work))
+                return subtree;
+        }
+        return std::nullopt;
+    }
+    if (node.is_leaf)
+        return std::nullopt;
+
+    // its nodes are counted against those a bulk load would create, which a repacked subtree has
+    // as many of, so that it is not repacked again
+    work += node.count;
+    size_t nodes = 1;
+    std::vector<NodeId> nodes_to_count{node_id};
+    while (!nodes_to_count.empty()) {
+        const Node<T> &parent = _nodes[nodes_to_count.back()];
+        nodes_to_count.pop_back();
+        nodes += parent.children.size();
+        if (parent.height > 2) {
+            nodes_to_count.insert(nodes_to_count.end(), parent.children.begin(),
+                                  parent.children.end());
+        }
+    }
+    if (_build_size(node.count, 0) > (1 - REPACK_WASTE) * nodes)
+        return std::nullopt;
+    return node_id;
+}
+
+// The entries are built into a new subtree, whose leaves are indexed instead. Having the same
+// entries, the subtree has the same bbox and count, and takes the place of the old one unless it
+// has fewer levels. It is then put back at its own height like a bulk load is
+template <typename T> void RBushBase<T>::_repack(NodeId node_id) {
+    if (_nodes[node_id].count == _nodes[_root].count) {
+        // the ancestors hold nothing else
+        node_id = _root;
+    }
+    const int height = _nodes[node_id].height;
+    const NodeId parent_id = node_id == _root ? 0 : _writable(_nodes[node_id].parent);
+
+    std::vector<Entry<T>> entries;
+    entries.reserve(_nodes[node_id].count);
+    std::vector<NodeId> nodes_to_release{node_id};
+    while (!nodes_to_release.empty()) {
+        const NodeId id = nodes_to_release.back();
+        nodes_to_release.pop_back();
+        const Node<T> &node = _nodes[id];
+        // copied, as a snapshot may still read the leaf
+        for (size_t i = 0; i < node.items.size(); ++i) {
+            _unindex_item(node.items[i], id);
+            entries.push_back({node.child_bboxes[i], node.items[i]});
+        }
+        nodes_to_release.insert(nodes_to_release.end(), node.children.begin(),
+                                node.children.end());
+        _release(id);
+    }
+
+    const NodeId subtree = _nodes.create_range(_build_size(entries.size(), 0));
+    _build(entries, 0, entries.size() - 1, 0, subtree);
+    _index_subtree(subtree);
+    if (node_id == _root) {
+        _root = subtree;
+        return;
+    }
+
+    Node<T> &parent = _nodes[parent_id];
+    const auto child = std::find(parent.children.begin(), parent.children.end(), node_id);
+    if (_nodes[subtree].height == height) {
+        *child = subtree;
+        _nodes[subtree].parent = parent_id;
+        return;
+    }
+    parent.children.erase(child);
+    std::vector<NodeId> emptied{parent_id};
+    _condense(emptied);
+    _insert(subtree, _nodes[_root].height - _nodes[subtree].height - 1);
+}
+
+// Recomputes the nodes that lost children and their ancestors level by level from the leaves up,
+// so that each of them is visited once however many entries were taken out below it, and takes
+// the nodes left empty out of their parents
+template <typename T> void RBushBase<T>::_condense(std::vector<NodeId> &nodes) {
+    if (nodes.empty())
+        return;
+    const int root_height = _nodes[_root].height;
+    std::vector<std::vector<NodeId>> levels(root_height + 1);
+    for (NodeId id : nodes) {
+        levels[_nodes[id].height].emplace_back(id);
+    }
+
+    for (int height = 1; height < root_height; ++height) {
+        std::vector<NodeId> &level = levels[height];
+        std::sort(level.begin(), level.end());
+        level.erase(std::unique(level.begin(), level.end()), level.end());
+        for (NodeId id : level) {
+            Node<T> &node = _nodes[id];
+            const NodeId parent_id = node.parent;
+            if (node.num_children() == 0) {
+                Node<T> &parent = _nodes[parent_id];
+                parent.children.erase(
+                    std::find(parent.children.begin(), parent.children.end(), id));
+                _release(id);
             } else {
-                clear();
+                node.calc_bbox(_nodes);
             }
-        } else {
-            node.calc_bbox();
+            levels[height + 1].emplace_back(parent_id);
         }
     }
+
+    if (_nodes[_root].num_children() == 0) {
+        clear();
+    } else {
+        _nodes[_root].calc_bbox(_nodes);
+    }
 }
 
 template <typename T>
 std::vector<std::reference_wrapper<T>> RBushBase<T>::search(const BBox &bbox) const {
     DEBUG_TIMER("search");
+    metrics::OpTimer timer(metrics::Op::SEARCH);
     std::vector<std::reference_wrapper<T>> result;
-    if (!bbox.intersects(*_root))
-        return result;
-
-    std::vector<std::reference_wrapper<const Node<T>>> nodes_to_search;
-    nodes_to_search.emplace_back(std::cref(*_root));
+    std::vector<std::reference_wrapper<Node<T>>> nodes_to_search;
+    std::vector<uint32_t> matches;
+    for (NodeId top : {_root, _buffer}) {
+        if (bbox.intersects(_nodes[top]))
+            nodes_to_search.emplace_back(_nodes[top]);
+    }
     while (!nodes_to_search.empty()) {
-        const Node<T> &node = nodes_to_search.back().get();
+        Node<T> &node = nodes_to_search.back().get();
         nodes_to_search.pop_back();
-        for (const auto &child : node.children) {
-            if (bbox.intersects(*child)) {
-                if (node.is_leaf) {
-                    result.emplace_back(*child->data);
-                } else if (bbox.contains(*child)) {
-                    _all(*child, result);
-                } else {
-                    nodes_to_search.emplace_back(std::cref(*child));
-                }
+        timer.work.visit(node.num_children(), node.is_leaf);
+        matches.resize(std::max(matches.size(), node.num_children()));
+        const size_t count = node.child_bboxes.intersecting(bbox, matches.data());
+        for (size_t i = 0; i < count; ++i) {
+            if (node.is_leaf) {
+                result.emplace_back(node.items[matches[i]]);
+                continue;
+            }
+            Node<T> &child = _nodes[node.children[matches[i]]];
+            if (bbox.contains(node.child_bboxes[matches[i]])) {
+                _all(child, result);
+            } else {
+                nodes_to_search.emplace_back(child);
             }
         }
     }
@@ -539,57 +1819,407 @@ std::vector<std::reference_wrapper<T>> RBushBase<T>::search(const BBox &bbox) co
 
 template <typename T> bool RBushBase<T>::collides(const BBox &bbox) const {
     DEBUG_TIMER("collides");
+    metrics::OpTimer timer(metrics::Op::COLLIDES);
     std::vector<std::reference_wrapper<const Node<T>>> nodes_to_search;
-    nodes_to_search.emplace_back(std::cref(*_root));
+    std::vector<uint32_t> matches;
+    nodes_to_search.emplace_back(std::cref(_nodes[_root]));
+    nodes_to_search.emplace_back(std::cref(_nodes[_buffer]));
     while (!nodes_to_search.empty()) {
         const Node<T> &node = nodes_to_search.back().get();
         nodes_to_search.pop_back();
-        for (const auto &child : node.children) {
-            if (bbox.intersects(*child)) {
-                if (node.is_leaf || bbox.contains(*child)) {
-                    return true;
-                } else {
-                    nodes_to_search.emplace_back(std::cref(*child));
-                }
+        timer.work.visit(node.num_children(), node.is_leaf);
+        matches.resize(std::max(matches.size(), node.num_children()));
+        const size_t count = node.child_bboxes.intersecting(bbox, matches.data());
+        for (size_t i = 0; i < count; ++i) {
+            if (node.is_leaf || bbox.contains(node.child_bboxes[matches[i]])) {
+                return true;
+            } else {
+                nodes_to_search.emplace_back(std::cref(_nodes[node.children[matches[i]]]));
             }
         }
     }
     return false;
 }
 
+// Subtrees inside the box are counted from their aggregate without being visited
+template <typename T> size_t RBushBase<T>::count(const BBox &bbox) const {
+    DEBUG_TIMER("count");
+    metrics::OpTimer timer(metrics::Op::COUNT);
+    size_t result = 0;
+    std::vector<NodeId> nodes_to_search;
+    std::vector<uint32_t> matches;
+    for (NodeId top : {_root, _buffer}) {
+        if (!bbox.intersects(_nodes[top]))
+            continue;
+        if (bbox.contains(_nodes[top])) {
+            result += _nodes[top].count;
+        } else {
+            nodes_to_search.emplace_back(top);
+        }
+    }
+    while (!nodes_to_search.empty()) {
+        const Node<T> &node = _nodes[nodes_to_search.back()];
+        nodes_to_search.pop_back();
+        timer.work.visit(node.num_children(), node.is_leaf);
+        matches.resize(std::max(matches.size(), node.num_children()));
+        const size_t num_matches = node.child_bboxes.intersecting(bbox, matches.data());
+        if (node.is_leaf) {
+            result += num_matches;
+            continue;
+        }
+        for (size_t i = 0; i < num_matches; ++i) {
+            NodeId child = node.children[matches[i]];
+            if (bbox.contains(node.child_bboxes[matches[i]])) {
+                result += _nodes[child].count;
+            } else {
+                nodes_to_search.emplace_back(child);
+            }
+        }
+    }
+    return result;
+}
+
+// The queries only read the tree, so they run on the thread pool and the results are concatenated
+// in query order, offsets[i]..offsets[i + 1] being the range of hits of the i-th box
+template <typename T>
+std::pair<std::vector<size_t>, std::vector<std::reference_wrapper<T>>>
+RBushBase<T>::search_many(const std::vector<BBox> &bboxes) const {
+    DEBUG_TIMER("search_many");
+    metrics::OpTimer timer(metrics::Op::SEARCH_MANY);
+    std::vector<std::vector<std::reference_wrapper<T>>> results(bboxes.size());
+    ThreadPool::get_instance().parallel_for(bboxes.size(), [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            results[i] = search(bboxes[i]);
+        }
+    });
+
+    std::vector<size_t> offsets;
+    offsets.reserve(bboxes.size() + 1);
+    offsets.push_back(0);
+    for (const auto &result : results) {
+        offsets.push_back(offsets.back() + result.size());
+    }
+    std::vector<std::reference_wrapper<T>> hits;
+    hits.reserve(offsets.back());
+    for (const auto &result : results) {
+        hits.insert(hits.end(), result.begin(), result.end());
+    }
+    return {std::move(offsets), std::move(hits)};
+}
+
+namespace {
+
+bool join_match(JoinPredicate predicate, const BBox &bbox, const BBox &other_bbox) {
+    switch (predicate) {
+    case JoinPredicate::CONTAINS:
+        return bbox.contains(other_bbox);
+    case JoinPredicate::WITHIN:
+        return other_bbox.contains(bbox);
+    default:
+        return bbox.intersects(other_bbox);
+    }
+}
+
+} // namespace
+
+// Traverses both trees together, only following the pairs of nodes whose bboxes intersect. The
+// pairs found near the roots are joined independently of each other on the thread pool
+template <typename T>
+std::vector<std::pair<std::reference_wrapper<T>, std::reference_wrapper<T>>>
+RBushBase<T>::join(const RBushBase &other, JoinPredicate predicate) const {
+    DEBUG_TIMER("join");
+    metrics::OpTimer timer(metrics::Op::JOIN);
+    std::vector<std::pair<std::reference_wrapper<T>, std::reference_wrapper<T>>> result;
+    // the buffers are paired like leaves outside of the trees
+    std::vector<std::pair<NodeId, NodeId>> tasks;
+    for (NodeId top : {_root, _buffer}) {
+        for (NodeId other_top : {other._root, other._buffer}) {
+            const Node<T> &node = _nodes[top];
+            const Node<T> &other_node = other._nodes[other_top];
+            if (node.num_children() && other_node.num_children() && node.intersects(other_node))
+                tasks.emplace_back(top, other_top);
+        }
+    }
+
+    // descend breadth-first until there are enough pairs to keep every thread busy
+    const size_t num_tasks = 4 * ThreadPool::get_instance().size();
+    std::vector<uint32_t> split_matches;
+    bool descended = !tasks.empty();
+    while (descended && tasks.size() < num_tasks) {
+        descended = false;
+        std::vector<std::pair<NodeId, NodeId>> next_tasks;
+        for (const auto &[node, other_node] : tasks) {
+            if (_nodes[node].is_leaf && other._nodes[other_node].is_leaf) {
+                next_tasks.emplace_back(node, other_node);
+            } else {
+                _join_children(other, node, other_node, next_tasks, split_matches);
+                descended = true;
+            }
+        }
+        tasks = std::move(next_tasks);
+    }
+
+    std::vector<std::vector<std::pair<std::reference_wrapper<T>, std::reference_wrapper<T>>>>
+        task_results(tasks.size());
+    ThreadPool::get_instance().parallel_for(tasks.size(), [&](size_t begin, size_t end) {
+        std::vector<std::pair<NodeId, NodeId>> pairs;
+        std::vector<uint32_t> matches;
+        for (size_t task = begin; task < end; ++task) {
+            pairs.assign(1, tasks[task]);
+            while (!pairs.empty()) {
+                const auto [node_id, other_node_id] = pairs.back();
+                pairs.pop_back();
+                Node<T> &node = _nodes[node_id];
+                Node<T> &other_node = other._nodes[other_node_id];
+                if (!node.is_leaf || !other_node.is_leaf) {
+                    _join_children(other, node_id, other_node_id, pairs, matches);
+                    continue;
+                }
+
+                // both are leaves, pair up their items
+                matches.resize(std::max(matches.size(), other_node.items.size()));
+                for (size_t i = 0; i < node.items.size(); ++i) {
+                    const BBox bbox = node.child_bboxes[i];
+                    if (!bbox.intersects(other_node))
+                        continue;
+                    const size_t count = other_node.child_bboxes.intersecting(bbox, matches.data());
+                    for (size_t j = 0; j < count; ++j) {
+                        if (predicate == JoinPredicate::INTERSECTS ||
+                            join_match(predicate, bbox, other_node.child_bboxes[matches[j]])) {
+                            task_results[task].emplace_back(node.items[i],
+                                                            other_node.items[matches[j]]);
+                        }
+                    }
+                }
+            }
+        }
+    });
+
+    size_t size = 0;
+    for (const auto &task_result : task_results) {
+        size += task_result.size();
+    }
+    result.reserve(size);
+    for (const auto &task_result : task_results) {
+        result.insert(result.end(), task_result.begin(), task_result.end());
+    }
+    return result;
+}
+
+// Adds the pairs of children of both nodes whose bboxes intersect, only the taller node is
+// descended into unless they have the same height so that paired nodes stay at the same level
+template <typename T>
+void RBushBase<T>::_join_children(const RBushBase &other, NodeId node_id, NodeId other_node_id,
+                                  std::vector<std::pair<NodeId, NodeId>> &pairs,
+                                  std::vector<uint32_t> &matches) const {
+    const Node<T> &node = _nodes[node_id];
+    const Node<T> &other_node = other._nodes[other_node_id];
+    const bool descend = !node.is_leaf && node.height >= other_node.height;
+    const bool other_descend = !other_node.is_leaf && other_node.height >= node.height;
+
+    if (!other_descend) {
+        matches.resize(std::max(matches.size(), node.children.size()));
+        const size_t count = node.child_bboxes.intersecting(other_node, matches.data());
+        for (size_t i = 0; i < count; ++i) {
+            pairs.emplace_back(node.children[matches[i]], other_node_id);
+        }
+    } else if (!descend) {
+        matches.resize(std::max(matches.size(), other_node.children.size()));
+        const size_t count = other_node.child_bboxes.intersecting(node, matches.data());
+        for (size_t i = 0; i < count; ++i) {
+            pairs.emplace_back(node_id, other_node.children[matches[i]]);
+        }
+    } else {
+        matches.resize(std::max(matches.size(), other_node.children.size()));
+        for (size_t i = 0; i < node.children.size(); ++i) {
+            const BBox bbox = node.child_bboxes[i];
+            if (!bbox.intersects(other_node))
+                continue;
+            const size_t count = other_node.child_bboxes.intersecting(bbox, matches.data());
+            for (size_t j = 0; j < count; ++j) {
+                pairs.emplace_back(node.children[i], other_node.children[matches[j]]);
+            }
+        }
+    }
+}
+
+// Best-first traversal: nodes and items are visited from the closest to the farthest, so an item
+// popped from the queue is closer than everything not visited yet
+template <typename T>
+std::vector<std::reference_wrapper<T>>
+RBushBase<T>::knn(double x, double y, size_t k, std::optional<double> max_distance,
+                  const std::function<bool(const T &)> &predicate) const {
+    DEBUG_TIMER("knn");
+    metrics::OpTimer timer(metrics::Op::KNN);
+    std::vector<std::reference_wrapper<T>> result;
+    if (k == 0 || (max_distance && *max_distance < 0))
+        return result;
+    const double max_dist_sq =
+        max_distance ? *max_distance * *max_distance : std::numeric_limits<double>::infinity();
+
+    // an item is given by its leaf and its index in the leaf
+    struct Candidate {
+        double dist_sq;
+        NodeId id;
+        uint32_t index;
+        bool is_item;
+
+        bool operator>(const Candidate &other) const { return dist_sq > other.dist_sq; }
+    };
+    std::priority_queue<Candidate, std::vector<Candidate>, std::greater<Candidate>> queue;
+
+    // the buffer is visited like any other leaf once it is the closest candidate
+    const Node<T> &buffer = _nodes[_buffer];
+    const double buffer_dist_sq = buffer.dist_sq(x, y);
+    if (!buffer.items.empty() && buffer_dist_sq <= max_dist_sq)
+        queue.push({buffer_dist_sq, _buffer, 0, false});
+
+    NodeId node_id = _root;
+    while (true) {
+        const Node<T> &node = _nodes[node_id];
+        timer.work.visit(node.num_children(), node.is_leaf);
+        for (uint32_t i = 0; i < node.num_children(); ++i) {
+            const double child_dist_sq = node.child_bboxes[i].dist_sq(x, y);
+            if (child_dist_sq > max_dist_sq)
+                continue;
+            if (node.is_leaf) {
+                queue.push({child_dist_sq, node_id, i, true});
+            } else {
+                queue.push({child_dist_sq, node.children[i], 0, false});
+            }
+        }
+
+        while (!queue.empty() && queue.top().is_item) {
+            T &item = _nodes[queue.top().id].items[queue.top().index];
+            queue.pop();
+            if (!predicate || predicate(item)) {
+                result.emplace_back(item);
+                if (result.size() == k)
+                    return result;
+            }
+        }
+
+        if (queue.empty())
+            break;
+        node_id = queue.top().id;
+        queue.pop();
+    }
+    return result;
+}
+
 template <typename T> std::vector<std::reference_wrapper<T>> RBushBase<T>::all() const {
     DEBUG_TIMER("all");
     std::vector<std::reference_wrapper<T>> result;
-    _all(*_root, result);
+    _all(_nodes[_root], result);
+    _all(_nodes[_buffer], result);
+    return result;
+}
+
+namespace {
+
+// Area covered by at least one of the boxes, summed over the vertical slabs between their x bounds
+double union_area(const BBoxArray &boxes) {
+    std::vector<double> xs;
+    xs.reserve(2 * boxes.size());
+    for (size_t i = 0; i < boxes.size(); ++i) {
+        xs.push_back(boxes[i].min_x);
+        xs.push_back(boxes[i].max_x);
+    }
+    std::sort(xs.begin(), xs.end());
+    xs.erase(std::unique(xs.begin(), xs.end()), xs.end());
+
+    double area = 0;
+    std::vector<std::pair<double, double>> spans;
+    for (size_t k = 0; k + 1 < xs.size(); ++k) {
+        spans.clear();
+        for (size_t i = 0; i < boxes.size(); ++i) {
+            const BBox bbox = boxes[i];
+            if (bbox.min_x <= xs[k] && xs[k + 1] <= bbox.max_x)
+                spans.emplace_back(bbox.min_y, bbox.max_y);
+        }
+        std::sort(spans.begin(), spans.end());
+        double length = 0;
+        double end = -std::numeric_limits<double>::infinity();
+        for (const auto &[min_y, max_y] : spans) {
+            if (max_y > end) {
+                length += max_y - std::max(min_y, end);
+                end = max_y;
+            }
+        }
+        area += (xs[k + 1] - xs[k]) * length;
+    }
+    return area;
+}
+
+} // namespace
+
+// Walks the tree level by level, the overlap of the children of a node being counted at their level
+template <typename T> TreeStats RBushBase<T>::stats() const {
+    TreeStats result;
+    result.size = size();
+    result.buffered = _nodes[_buffer].count;
+    result.height = _nodes[_root].height;
+
+    std::vector<NodeId> level{_root};
+    std::vector<NodeId> next_level;
+    // overlap of the nodes of the level, found while walking their parents
+    double overlap = 0;
+    for (int height = result.height; height > 0; --height) {
+        TreeStats::Level stats;
+        stats.height = height;
+        stats.nodes = level.size();
+        stats.overlap = overlap;
+        overlap = 0;
+        for (NodeId id : level) {
+            const Node<T> &node = _nodes[id];
+            stats.fill += static_cast<double>(node.num_children()) / _max_entries;
+            if (node.num_children() == 0)
+                continue;
+            const double area = node.area();
+            stats.area += area;
+            stats.dead_space += std::max(0.0, area - union_area(node.child_bboxes));
+            if (node.is_leaf)
+                continue;
+            for (size_t i = 0; i < node.children.size(); ++i) {
+                for (size_t j = i + 1; j < node.children.size(); ++j) {
+                    overlap += node.child_bboxes[i].intersection_area(node.child_bboxes[j]);
+                }
+                next_level.push_back(node.children[i]);
+            }
+        }
+        stats.fill /= stats.nodes;
+        result.nodes += stats.nodes;
+        result.overlap += stats.overlap;
+        result.dead_space += stats.dead_space;
+        result.levels.push_back(stats);
+        level.swap(next_level);
+        next_level.clear();
+    }
     return result;
 }
 
 template <typename T>
 void RBushBase<T>::_all(std::reference_wrapper<Node<T>> start_node,
                         std::vector<std::reference_wrapper<T>> &result) const {
-    std::vector<std::reference_wrapper<const Node<T>>> nodes_to_search;
+    std::vector<std::reference_wrapper<Node<T>>> nodes_to_search;
     nodes_to_search.emplace_back(start_node);
     while (!nodes_to_search.empty()) {
-        const Node<T> &node = nodes_to_search.back().get();
+        Node<T> &node = nodes_to_search.back().get();
         nodes_to_search.pop_back();
-        if (node.is_leaf) {
-            for (const auto &child : node.children) {
-                result.emplace_back(*child->data);
-            }
-        } else {
-            for (const auto &child : node.children) {
-                nodes_to_search.emplace_back(std::cref(*child));
-            }
+        result.insert(result.end(), node.items.begin(), node.items.end());
+        for (const auto &child : node.children) {
+            nodes_to_search.emplace_back(_nodes[child]);
         }
     }
 }
 
-template <typename T> py::dict RBushBase<T>::serialize() const {
+template <typename T> py::dict RBushBase<T>::serialize() {
     DEBUG_TIMER("serialize");
+    flush();
     py::dict result;
     result["max_entries"] = _max_entries;
     result["min_entries"] = _min_entries;
-    result["root"] = _serialize_node(*_root);
+    result["root"] = _serialize_node(_nodes[_root]);
     return result;
 }
 
@@ -601,12 +2231,11 @@ template <typename T> py::dict RBushBase<T>::_serialize_node(const Node<T> &node
     data["is_leaf"] = node.is_leaf;
 
     py::list children;
+    for (const auto &item : node.items) {
+        children.append(item);
+    }
     for (const auto &child : node.children) {
-        if (node.is_leaf) {
-            children.append(*child->data);
-        } else {
-            children.append(_serialize_node(*child));
-        }
+        children.append(_serialize_node(_nodes[child]));
     }
     data["children"] = children;
     return data;
@@ -614,53 +2243,367 @@ template <typename T> py::dict RBushBase<T>::_serialize_node(const Node<T> &node
 
 template <typename T> void RBushBase<T>::deserialize(const py::dict &data) {
     DEBUG_TIMER("deserialize");
-    _max_entries = data["max_entries"].cast<size_t>();
-    _min_entries = data["min_entries"].cast<size_t>();
-    _root = _deserialize_node(data["root"]);
+    _begin_change();
+    ++_version;
+    const size_t max_entries = data["max_entries"].cast<size_t>();
+    const size_t min_entries = data["min_entries"].cast<size_t>();
+
+    // build the new tree in a fresh arena, keeping the old tree as it was until it succeeds
+    NodeArena<T> old_nodes = std::move(_nodes);
+    _nodes = NodeArena<T>();
+    NodeId root;
+    NodeId buffer;
+    try {
+        root = _deserialize_node(data["root"]);
+        buffer = _create_leaf();
+    } catch (...) {
+        _nodes = std::move(old_nodes);
+        throw;
+    }
+    _max_entries = max_entries;
+    _min_entries = min_entries;
+    _root = root;
+    _buffer = buffer;
+    _forget_snapshots();
+    _rebuild_index();
 }
 
-template <typename T>
-std::unique_ptr<Node<T>> RBushBase<T>::_deserialize_node(const py::dict &data) {
-    auto node = std::make_unique<Node<T>>();
+template <typename T> NodeId RBushBase<T>::_deserialize_node(const py::dict &data) {
+    NodeId node_id = _nodes.create();
+    Node<T> &node = _nodes[node_id];
 
     py::dict bbox = data["bbox"];
-    node->min_x = bbox["min_x"].cast<double>();
-    node->min_y = bbox["min_y"].cast<double>();
-    node->max_x = bbox["max_x"].cast<double>();
-    node->max_y = bbox["max_y"].cast<double>();
+    node.min_x = bbox["min_x"].cast<double>();
+    node.min_y = bbox["min_y"].cast<double>();
+    node.max_x = bbox["max_x"].cast<double>();
+    node.max_y = bbox["max_y"].cast<double>();
 
-    node->height = data["height"].cast<int>();
-    node->is_leaf = data["is_leaf"].cast<bool>();
+    node.height = data["height"].cast<int>();
+    node.is_leaf = data["is_leaf"].cast<bool>();
+    _set_layout(node);
 
     py::list children = data["children"];
     for (const auto &child : children) {
-        if (node->is_leaf) {
-            auto leaf_node = std::make_unique<Node<T>>(child.cast<T>());
-            BBox bbox = to_bbox(child.cast<T>());
-            leaf_node->min_x = bbox.min_x;
-            leaf_node->min_y = bbox.min_y;
-            leaf_node->max_x = bbox.max_x;
-            leaf_node->max_y = bbox.max_y;
-            node->children.emplace_back(std::move(leaf_node));
+        if (node.is_leaf) {
+            T item = child.cast<T>();
+            node.child_bboxes.push_back(to_bbox(item));
+            node.items.emplace_back(std::move(item));
+            ++node.count;
         } else {
-            node->children.emplace_back(_deserialize_node(child.cast<py::dict>()));
+            const NodeId child_id = _deserialize_node(child.cast<py::dict>());
+            node.children.emplace_back(child_id);
+            node.child_bboxes.push_back(_nodes[child_id]);
+            node.count += _nodes[child_id].count;
+        }
+    }
+    _adopt_children(node_id);
+    return node_id;
+}
+
+// SearchCursor implementation
+
+template <typename T>
+SearchCursor<T>::SearchCursor(const RBushBase<T> &tree, const BBox &bbox, size_t chunk_size)
+    : _tree(&tree), _bbox(bbox), _chunk_size(std::max<size_t>(1, chunk_size)),
+      _version(tree._version) {
+    for (NodeId top : {tree._buffer, tree._root}) {
+        if (bbox.intersects(tree._nodes[top]))
+            _stack.emplace_back(top, false);
+    }
+}
+
+// Same traversal as RBushBase::search, stopping after whole nodes once the chunk is full
+template <typename T> std::vector<std::reference_wrapper<T>> SearchCursor<T>::next() {
+    DEBUG_TIMER("iter_search");
+    metrics::OpTimer timer(metrics::Op::ITER_SEARCH);
+    if (_version != _tree->_version)
+        throw std::runtime_error("tree changed during iteration");
+
+    std::vector<std::reference_wrapper<T>> result;
+    while (!_stack.empty() && result.size() < _chunk_size) {
+        const auto [node_id, all_match] = _stack.back();
+        _stack.pop_back();
+        Node<T> &node = _tree->_nodes[node_id];
+        if (all_match) {
+            result.insert(result.end(), node.items.begin(), node.items.end());
+            for (NodeId child : node.children) {
+                _stack.emplace_back(child, true);
+            }
+            continue;
+        }
+
+        timer.work.visit(node.num_children(), node.is_leaf);
+        _matches.resize(std::max(_matches.size(), node.num_children()));
+        const size_t count = node.child_bboxes.intersecting(_bbox, _matches.data());
+        for (size_t i = 0; i < count; ++i) {
+            if (node.is_leaf) {
+                result.emplace_back(node.items[_matches[i]]);
+            } else {
+                _stack.emplace_back(node.children[_matches[i]],
+                                    _bbox.contains(node.child_bboxes[_matches[i]]));
+            }
         }
     }
-    return node;
+    return result;
 }
 
+template class SearchCursor<py::dict>;
+template class SearchCursor<py::object>;
+template class SearchCursor<int64_t>;
+
 // RBush implementation
 
-BBox RBush::to_bbox(const py::dict &item) const {
-    double min_x = item["min_x"].cast<double>();
-    double min_y = item["min_y"].cast<double>();
-    double max_x = item["max_x"].cast<double>();
-    double max_y = item["max_y"].cast<double>();
-    return BBox(min_x, min_y, max_x, max_y);
+BBox RBush::to_bbox(const py::dict &item) const { return _layout.get(item); }
+
+// IdRBush implementation
+
+void IdRBush::insert(int64_t id, const BBox &bbox) {
+    DEBUG_TIMER("insert");
+    metrics::OpTimer timer(metrics::Op::INSERT);
+    _insert_entry(id, bbox);
+}
+
+void IdRBush::remove(int64_t id, const std::optional<BBox> &bbox) {
+    DEBUG_TIMER("remove");
+    metrics::OpTimer timer(metrics::Op::REMOVE);
+    if (!bbox && !_identity_index)
+        throw std::invalid_argument("the bbox of the id is needed without the identity index");
+    flush();
+    _begin_change();
+    ++_version;
+    std::optional<EntryRef> entry = _find_entry(id, bbox, nullptr);
+    if (!entry)
+        return;
+    std::vector<NodeId> leaves{_detach_entry(*entry)};
+    _condense(leaves);
+}
+
+size_t IdRBush::remove_many(const int64_t *ids, const double *coords, size_t n) {
+    DEBUG_TIMER("remove_many");
+    metrics::OpTimer timer(metrics::Op::REMOVE_MANY);
+    if (!coords && !_identity_index)
+        throw std::invalid_argument("the bboxes of the ids are needed without the identity index");
+    flush();
+    _begin_change();
+    ++_version;
+    std::vector<NodeId> leaves;
+    for (size_t i = 0; i < n; ++i) {
+        std::optional<BBox> bbox;
+        if (coords) {
+            const double *row = coords + 4 * i;
+            bbox = BBox(row[0], row[1], row[2], row[3]);
+        }
+        std::optional<EntryRef> entry = _find_entry(ids[i], bbox, nullptr);
+        if (entry)
+            leaves.emplace_back(_detach_entry(*entry));
+    }
+    _condense(leaves);
+    return leaves.size();
+}
+
+bool IdRBush::update(int64_t id, const BBox &bbox, const std::optional<BBox> &old_bbox,
+                     double slack) {
+    DEBUG_TIMER("update");
+    metrics::OpTimer timer(metrics::Op::UPDATE);
+    if (!old_bbox && !_identity_index)
+        throw std::invalid_argument("the old bbox of the id is needed without the identity index");
+    flush();
+    _begin_change();
+    ++_version;
+    std::optional<EntryRef> entry = _find_entry(id, old_bbox, nullptr);
+    if (!entry)
+        return false;
+    std::vector<NodeId> leaves;
+    _move_entry(*entry, bbox, slack, leaves);
+    _condense(leaves);
+    return true;
+}
+
+size_t IdRBush::update_many(const int64_t *ids, const double *coords, const double *old_coords,
+                            size_t n, double slack) {
+    DEBUG_TIMER("update_many");
+    metrics::OpTimer timer(metrics::Op::UPDATE_MANY);
+    if (!old_coords && !_identity_index)
+        throw std::invalid_argument(
+            "the old bboxes of the ids are needed without the identity index");
+    flush();
+    _begin_change();
+    ++_version;
+    size_t updated = 0;
+    std::vector<NodeId> leaves;
+    for (size_t i = 0; i < n; ++i) {
+        std::optional<BBox> old_bbox;
+        if (old_coords) {
+            const double *row = old_coords + 4 * i;
+            old_bbox = BBox(row[0], row[1], row[2], row[3]);
+        }
+        std::optional<EntryRef> entry = _find_entry(ids[i], old_bbox, nullptr);
+        if (!entry)
+            continue;
+        const double *row = coords + 4 * i;
+        _move_entry(*entry, BBox(row[0], row[1], row[2], row[3]), slack, leaves);
+        ++updated;
+    }
+    _condense(leaves);
+    return updated;
+}
+
+void IdRBush::load_arrays(const double *coords, const int64_t *ids, size_t n) {
+    DEBUG_TIMER("load_arrays");
+    metrics::OpTimer timer(metrics::Op::LOAD);
+    _begin_change();
+    std::vector<Entry<int64_t>> entries;
+    entries.reserve(n);
+    for (size_t i = 0; i < n; ++i) {
+        const double *row = coords + 4 * i;
+        entries.push_back({BBox(row[0], row[1], row[2], row[3]),
+                           ids ? ids[i] : static_cast<int64_t>(i)});
+    }
+    _load(entries);
+}
+
+void IdRBush::save(const std::string &path) {
+    DEBUG_TIMER("save");
+    flush();
+    write_flat(path, _nodes, _root, _max_entries, _min_entries);
+}
+
+void IdRBush::publish(const std::string &name) {
+    DEBUG_TIMER("publish");
+    flush();
+    publish_flat(name, _nodes, _root, _max_entries, _min_entries);
+}
+
+void IdRBush::load_file(const std::string &path) {
+    DEBUG_TIMER("load_file");
+    _begin_change();
+    MappedFile file(path);
+    FlatTree tree(file.data(), file.size());
+
+    // children come after their parent in the file, so building the nodes backwards lets every
+    // node link to the arena ids of its children
+    NodeArena<int64_t> nodes;
+    std::vector<NodeId> node_ids(tree.header().num_nodes);
+    for (uint32_t i = tree.header().num_nodes; i-- > 0;) {
+        const flat::Node &record = tree.nodes()[i];
+        NodeId node_id = nodes.create();
+        Node<int64_t> &node = nodes[node_id];
+        static_cast<BBox &>(node) = record.bbox;
+        node.height = record.height;
+        node.is_leaf = record.is_leaf;
+        _set_layout(node);
+        node.child_bboxes.reserve(record.num_children);
+        for (uint32_t j = record.first_child; j < record.first_child + record.num_children; ++j) {
+            if (record.is_leaf) {
+                const flat::Item &item = tree.items()[j];
+                if (_points && (item.bbox.min_x != item.bbox.max_x ||
+                                item.bbox.min_y != item.bbox.max_y))
+                    throw std::invalid_argument("the file holds items that are not points");
+                node.items.emplace_back(item.id);
+                node.child_bboxes.push_back(item.bbox);
+                ++node.count;
+            } else {
+                node.children.emplace_back(node_ids[j]);
+                node.child_bboxes.push_back(tree.nodes()[j].bbox);
+                node.count += nodes[node_ids[j]].count;
+                nodes[node_ids[j]].parent = node_id;
+            }
+        }
+        node_ids[i] = node_id;
+    }
+
+    ++_version;
+    _buffer = nodes.create();
+    _set_layout(nodes[_buffer]);
+    _nodes = std::move(nodes);
+    _forget_snapshots();
+    _root = node_ids[0];
+    _max_entries = tree.header().max_entries;
+    _min_entries = tree.header().min_entries;
+    _rebuild_index();
+}
+
+BBox IdRBush::to_bbox(const int64_t &) const {
+    throw std::logic_error("the bbox of an IdRBush item must be given along with its id");
+}
+
+// PointRBush implementation
+
+void PointRBush::insert(int64_t id, double x, double y) {
+    DEBUG_TIMER("insert");
+    metrics::OpTimer timer(metrics::Op::INSERT);
+    _insert_entry(id, BBox(x, y, x, y));
+}
+
+void PointRBush::load_points(const double *points, const int64_t *ids, size_t n) {
+    DEBUG_TIMER("load_points");
+    metrics::OpTimer timer(metrics::Op::LOAD);
+    _begin_change();
+    std::vector<Entry<int64_t>> entries;
+    entries.reserve(n);
+    for (size_t i = 0; i < n; ++i) {
+        const double *row = points + 2 * i;
+        entries.push_back({BBox(row[0], row[1], row[0], row[1]),
+                           ids ? ids[i] : static_cast<int64_t>(i)});
+    }
+    _load(entries);
+}
+
+size_t PointRBush::remove_points(const int64_t *ids, const double *points, size_t n) {
+    DEBUG_TIMER("remove_points");
+    metrics::OpTimer timer(metrics::Op::REMOVE_MANY);
+    if (!points && !_identity_index)
+        throw std::invalid_argument("the points of the ids are needed without the identity index");
+    flush();
+    _begin_change();
+    ++_version;
+    std::vector<NodeId> leaves;
+    for (size_t i = 0; i < n; ++i) {
+        std::optional<BBox> bbox;
+        if (points) {
+            const double *row = points + 2 * i;
+            bbox = BBox(row[0], row[1], row[0], row[1]);
+        }
+        std::optional<EntryRef> entry = _find_entry(ids[i], bbox, nullptr);
+        if (entry)
+            leaves.emplace_back(_detach_entry(*entry));
+    }
+    _condense(leaves);
+    return leaves.size();
+}
+
+size_t PointRBush::update_points(const int64_t *ids, const double *points,
+                                 const double *old_points, size_t n, double slack) {
+    DEBUG_TIMER("update_points");
+    metrics::OpTimer timer(metrics::Op::UPDATE_MANY);
+    if (!old_points && !_identity_index)
+        throw std::invalid_argument(
+            "the old points of the ids are needed without the identity index");
+    flush();
+    _begin_change();
+    ++_version;
+    size_t updated = 0;
+    std::vector<NodeId> leaves;
+    for (size_t i = 0; i < n; ++i) {
+        std::optional<BBox> old_bbox;
+        if (old_points) {
+            const double *row = old_points + 2 * i;
+            old_bbox = BBox(row[0], row[1], row[0], row[1]);
+        }
+        std::optional<EntryRef> entry = _find_entry(ids[i], old_bbox, nullptr);
+        if (!entry)
+            continue;
+        const double *row = points + 2 * i;
+        _move_entry(*entry, BBox(row[0], row[1], row[0], row[1]), slack, leaves);
+        ++updated;
+    }
+    _condense(leaves);
+    return updated;
 }
 
 // Explicit template instantiation
 template class RBushBase<py::dict>;
 template class RBushBase<py::object>;
+template class RBushBase<int64_t>;
 
 } // namespace rbush
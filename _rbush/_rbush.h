@@ -2,9 +2,18 @@
 #define _RBUSH_H_
 
 #include <algorithm>
+#include <array>
+#include <cstdint>
 #include <limits>
 #include <memory>
+#include <mutex>
+#include <optional>
 #include <pybind11/pybind11.h>
+#include <set>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 namespace py = pybind11;
@@ -34,27 +43,270 @@ struct BBox {
     double intersection_area(const BBox &other) const;
     bool intersects(const BBox &other) const;
     void extend(const BBox &other);
+    // squared distance from the point to the closest point of the box, 0 if the point is inside
+    double dist_sq(double x, double y) const;
 };
 
-// Node structure for R-tree
+// Bounding boxes of a node's children in structure-of-arrays layout, each coordinate is stored in
+// its own aligned array padded to the SIMD width so that the children can be tested together
+class BBoxArray {
+public:
+    BBoxArray() : _capacity(0), _compact(false), _points(false) {}
+    BBoxArray(BBoxArray &&other) noexcept
+        : _data(std::move(other._data)), _size(std::exchange(other._size, 0)),
+          _capacity(other._capacity), _compact(other._compact), _points(other._points) {
+        other._capacity = 0;
+    }
+    BBoxArray &operator=(BBoxArray &&other) noexcept {
+        _data = std::move(other._data);
+        _size = std::exchange(other._size, 0);
+        _capacity = other._capacity;
+        _compact = other._compact;
+        _points = other._points;
+        other._capacity = 0;
+        return *this;
+    }
+
+    // a compact array stores floats rounded outward, half the size of doubles, so the boxes read
+    // back contain the boxes stored and may only add candidates to the queries. Changing the
+    // precision empties the array
+    void set_compact(bool compact);
+    bool compact() const { return _compact; }
+    // a points array stores the lower corners only, for the leaves of trees whose items are points,
+    // so the boxes read back are the points and the boxes stored must be points as well. Changing
+    // the layout empties the array too
+    void set_points(bool points);
+    bool points() const { return _points; }
+
+    size_t size() const { return _size; }
+    BBox operator[](size_t i) const;
+    void clear() { _size = 0; }
+    void reserve(size_t capacity);
+    // copies the boxes of the other array, in its precision
+    void assign(const BBoxArray &other);
+    void push_back(const BBox &bbox);
+    void set(size_t i, const BBox &bbox);
+    // removes the i-th box, the boxes after it moving down by one
+    void erase(size_t i);
+    // keeps the first size boxes
+    void truncate(size_t size) { _size = std::min<size_t>(_size, size); }
+    size_t intersecting(const BBox &bbox, uint32_t *out) const;
+    // same for the boxes in [begin, end) with the indexes relative to begin, which must be a
+    // multiple of simd::WIDTH
+    size_t intersecting(const BBox &bbox, size_t begin, size_t end, uint32_t *out) const;
+    size_t least_enlargement(const BBox &bbox) const;
+    // index of the box whose enlargement to include the query box adds the least to its overlap
+    // with the other boxes, resolving ties by the least enlargement then the smallest area
+    size_t least_overlap_enlargement(const BBox &bbox) const;
+
+private:
+    struct AlignedDeleter {
+        void operator()(void *data) const;
+    };
+
+    std::unique_ptr<void, AlignedDeleter> _data;
+    uint32_t _size = 0;
+    // the layout shares a word with the capacity so that nodes do not grow
+    uint32_t _capacity : 30;
+    uint32_t _compact : 1;
+    uint32_t _points : 1;
+
+    size_t _num_coords() const { return _points ? 2 : 4; }
+    double *_coords(int i) const {
+        return static_cast<double *>(_data.get()) + static_cast<size_t>(i) * _capacity;
+    }
+    float *_compact_coords(int i) const {
+        return static_cast<float *>(_data.get()) + static_cast<size_t>(i) * _capacity;
+    }
+};
+
+// Where the bbox of a Python item is found, so that it is read in C++ instead of through a call of
+// to_bbox into Python for every item
+class BBoxLayout {
+public:
+    // item.min_x, item.min_y, item.max_x and item.max_y for the given attribute names
+    static BBoxLayout attributes(const py::str &min_x, const py::str &min_y, const py::str &max_x,
+                                 const py::str &max_y);
+    // item[min_x] and so on for the given keys of a mapping or indexes of a sequence
+    static BBoxLayout items(const py::object &min_x, const py::object &min_y,
+                            const py::object &max_x, const py::object &max_y);
+    // native doubles at the given byte offsets of an item supporting the buffer protocol
+    static BBoxLayout offsets(size_t min_x, size_t min_y, size_t max_x, size_t max_y);
+
+    BBox get(const py::handle &item) const;
+
+private:
+    enum class Kind { ATTRIBUTES, ITEMS, OFFSETS };
+
+    Kind _kind;
+    std::array<py::object, 4> _keys;
+    std::array<size_t, 4> _offsets{};
+
+    explicit BBoxLayout(Kind kind) : _kind(kind) {}
+};
+
+// Index of a node inside a NodeArena
+using NodeId = uint32_t;
+
+template <typename T> class NodeArena;
+
+// Identity used by remove when no equals function is given, object identity for Python objects
+template <typename T> inline bool same_item(const T &a, const T &b) { return a == b; }
+template <> inline bool same_item<py::dict>(const py::dict &a, const py::dict &b) {
+    return a.is(b);
+}
+template <> inline bool same_item<py::object>(const py::object &a, const py::object &b) {
+    return a.is(b);
+}
+
+// Key of an item in the identity index, equal for items that same_item considers the same
+template <typename T> inline int64_t identity_key(const T &item) { return item; }
+template <> inline int64_t identity_key<py::dict>(const py::dict &item) {
+    return reinterpret_cast<intptr_t>(item.ptr());
+}
+template <> inline int64_t identity_key<py::object>(const py::object &item) {
+    return reinterpret_cast<intptr_t>(item.ptr());
+}
+
+// Item along with its bbox, as it is carried into a leaf
+template <typename T> struct Entry {
+    BBox bbox;
+    T item;
+};
+
+// Position of an item in the tree, the index being that of the item in its leaf
+struct EntryRef {
+    NodeId leaf;
+    size_t index;
+};
+
+// Node structure for R-tree. A leaf keeps its items itself, their bboxes being those of
+// child_bboxes, so that an item costs no more than its value and its bbox
 template <typename T> struct Node : public BBox {
-    std::vector<std::unique_ptr<Node<T>>> children;
-    std::unique_ptr<T> data;
+    // empty for a leaf
+    std::vector<NodeId> children;
+    // empty for an internal node
+    std::vector<T> items;
+    BBoxArray child_bboxes;
+    // number of items in the subtree
+    uint32_t count;
+    // node holding this one in its children, unused for the root
+    NodeId parent;
     int height;
     bool is_leaf;
+    // generation of the arena the node was created in, the snapshots taken since share it
+    uint64_t generation;
+
+    Node() : BBox(), count(0), parent(0), height(1), is_leaf(true), generation(0) {}
+
+    size_t num_children() const { return is_leaf ? items.size() : children.size(); }
+    // recomputes the bbox and the count from the children, or from the items for a leaf
+    void calc_bbox(const NodeArena<T> &nodes);
+};
+
+// Pool of nodes stored in fixed-size contiguous chunks, node addresses stay stable while the pool
+// grows and the slots of destroyed nodes are reused by later allocations
+template <typename T> class NodeArena {
+public:
+    NodeId create();
+    // creates n nodes with consecutive ids and returns the first, so that they can be filled in by
+    // several threads without the arena changing meanwhile
+    NodeId create_range(size_t n);
+    // creates a node holding the same as the given one
+    NodeId copy(NodeId id);
+    void destroy(NodeId id);
+    // empties the node in place, as if it was just created
+    void reset(NodeId id);
+    void clear();
+    // arena sharing the chunks of this one, to read the nodes as they are now while this one goes
+    // on creating nodes. Neither may destroy or change the nodes the other reads
+    NodeArena share() const;
+
+    // nodes are created in the current generation, which a snapshot closes
+    uint64_t generation() const { return _generation; }
+    void next_generation() { ++_generation; }
+
+    Node<T> &operator[](NodeId id) const { return _chunks[id >> CHUNK_BITS][id & CHUNK_MASK]; }
+
+private:
+    static constexpr int CHUNK_BITS = 10;
+    static constexpr NodeId CHUNK_SIZE = 1 << CHUNK_BITS;
+    static constexpr NodeId CHUNK_MASK = CHUNK_SIZE - 1;
 
-    Node() : BBox(), height(1), is_leaf(true) {}
-    Node(const T &item) : BBox(), data(std::make_unique<T>(item)), height(1), is_leaf(true) {}
-    Node(T &&item) : BBox(), data(std::make_unique<T>(std::move(item))), height(1), is_leaf(true) {}
+    std::vector<std::shared_ptr<Node<T>[]>> _chunks;
+    std::vector<NodeId> _free;
+    NodeId _size = 0;
+    uint64_t _generation = 1;
+};
 
-    BBox dist_bbox(int start, int end) const;
-    void calc_bbox();
+// Generations of the snapshots of a tree that are alive, which the snapshots leave from whatever
+// thread destroys them
+class SnapshotRegistry {
+public:
+    // registers the generation until the returned lease is destroyed
+    static std::shared_ptr<void> lease(const std::shared_ptr<SnapshotRegistry> &registry,
+                                       uint64_t generation);
+    // newest generation registered, 0 if none
+    uint64_t newest() const;
+
+private:
+    mutable std::mutex _mutex;
+    std::set<uint64_t> _generations;
+};
+
+template <typename T> class SearchCursor;
+
+// How the bbox of an item of a tree must relate to the bbox of an item of the other tree to be
+// paired by RBushBase::join
+enum class JoinPredicate { INTERSECTS, CONTAINS, WITHIN };
+
+// How inserts choose where an item goes and handle overflowing nodes. RBUSH picks the subtrees
+// needing the least enlargement and splits on overflow. RSTAR picks the nodes of the level inserted
+// into by the least overlap enlargement and, on the first overflow at every level of an insert,
+// reinserts the children farthest from the center of the node instead of splitting it, which
+// makes inserts slower but leaves less overlap between the nodes
+enum class InsertStrategy { RBUSH, RSTAR };
+
+// Shape of a tree, to tell how well its nodes fit the data
+struct TreeStats {
+    struct Level {
+        // 1 for the leaves, the height of the tree for the root
+        int height = 0;
+        size_t nodes = 0;
+        // mean number of children of the nodes, over the maximum
+        double fill = 0;
+        double area = 0;
+        // area of the intersections of the nodes having the same parent, over all such pairs
+        double overlap = 0;
+        // area of the nodes covered by none of their children
+        double dead_space = 0;
+    };
+
+    size_t size = 0;
+    // items in the insert buffer, not in the tree yet
+    size_t buffered = 0;
+    int height = 0;
+    size_t nodes = 0;
+    double overlap = 0;
+    double dead_space = 0;
+    // from the root down to the leaves
+    std::vector<Level> levels;
 };
 
 // Base class for RBush
 template <typename T> class RBushBase {
+    friend class SearchCursor<T>;
+
 public:
-    explicit RBushBase(size_t max_entries = 9);
+    // the identity index maps every item to its leaf, so that remove finds it without a search.
+    // With an insert buffer, inserted items are kept aside and merged into the tree in bulk once
+    // there are insert_buffer of them. With compact bboxes, the internal nodes keep the bboxes of
+    // their children in floats, the leaves keeping the exact ones of their items. With points, the
+    // leaves keep two coordinates per item, whose bboxes must then be points
+    explicit RBushBase(size_t max_entries = 9, bool identity_index = false,
+                       size_t insert_buffer = 0,
+                       InsertStrategy insert_strategy = InsertStrategy::RBUSH,
+                       bool compact_bboxes = false, bool points = false);
     virtual ~RBushBase() = default;
 
     RBushBase(const RBushBase &) = delete;
@@ -66,41 +318,182 @@ public:
     void insert(const T &item);
     void load(std::vector<T> &items);
     void remove(const T &item, const std::function<bool(const T &, const T &)> &equals = nullptr);
+    size_t remove_many(const std::vector<T> &items,
+                       const std::function<bool(const T &, const T &)> &equals = nullptr);
+    size_t remove_in(const BBox &bbox);
+    // moves an item whose bbox changed to its new bbox, given by to_bbox, the old one being needed
+    // to find it without the identity index. An item still within its leaf grown by slack on every
+    // side stays in it and only the bboxes above it are refitted, the others are reinserted.
+    // Returns whether the item was found
+    bool update(const T &item, const std::optional<BBox> &old_bbox = std::nullopt,
+                double slack = 0);
+    // same for many items, the nodes they leave being condensed once. Returns the number of items
+    // found
+    size_t update_many(const std::vector<T> &items,
+                       const std::optional<std::vector<BBox>> &old_bboxes = std::nullopt,
+                       double slack = 0);
+    // bulk loads again the subtrees whose nodes are the least full and whose children overlap the
+    // most, for up to budget items in all, so that a tree worn by changes can be tidied up a little
+    // at a time. Returns the number of items repacked, 0 once the worst subtree within the budget
+    // would not lose enough nodes
+    size_t optimize(size_t budget);
     std::vector<std::reference_wrapper<T>> search(const BBox &bbox) const;
     bool collides(const BBox &bbox) const;
+    size_t count(const BBox &bbox) const;
+    size_t size() const { return _nodes[_root].count + _nodes[_buffer].count; }
+    // merges the buffered items into the tree
+    void flush();
+    std::pair<std::vector<size_t>, std::vector<std::reference_wrapper<T>>>
+    search_many(const std::vector<BBox> &bboxes) const;
+    std::vector<std::reference_wrapper<T>>
+    knn(double x, double y, size_t k, std::optional<double> max_distance = std::nullopt,
+        const std::function<bool(const T &)> &predicate = nullptr) const;
     std::vector<std::reference_wrapper<T>> all() const;
-    py::dict serialize() const;
+    // pairs of an item of this tree and an item of the other one whose bboxes match the predicate,
+    // in no particular order
+    std::vector<std::pair<std::reference_wrapper<T>, std::reference_wrapper<T>>>
+    join(const RBushBase &other, JoinPredicate predicate = JoinPredicate::INTERSECTS) const;
+    TreeStats stats() const;
+    py::dict serialize();
     void deserialize(const py::dict &data);
+    // makes this tree a read-only snapshot of the other one as it is now. They share their nodes,
+    // the other tree copying the nodes it changes from then on, so that the snapshot can be queried
+    // from any thread while the other tree is changed
+    void snapshot_of(RBushBase &tree);
 
     virtual BBox to_bbox(const T &item) const = 0;
 
-private:
+protected:
+    // entry points for subclasses whose items come with their bbox instead of through to_bbox
+    void _insert_entry(const T &item, const BBox &bbox);
+    // the entries are moved into the tree
+    void _load(std::vector<Entry<T>> &entries);
+    // the bbox may be left out when the identity index is used, i.e. without an equals function
+    std::optional<EntryRef> _find_entry(const T &item, const std::optional<BBox> &bbox,
+                                        const std::function<bool(const T &, const T &)> &equals);
+    // takes the entry out of its leaf and returns the leaf, which must be condensed afterwards
+    NodeId _detach_entry(const EntryRef &entry);
+    // moves the entry to the bbox as update does, adding the leaf it left if any to the leaves to
+    // condense afterwards
+    void _move_entry(const EntryRef &entry, const BBox &bbox, double slack,
+                     std::vector<NodeId> &leaves);
+    void _condense(std::vector<NodeId> &nodes);
+    void _rebuild_index();
+    // called by every change before it touches the nodes, throws std::runtime_error for a snapshot
+    void _begin_change();
+    // whether a snapshot may read the node, which must then be left as is
+    bool _shared(NodeId id) const { return _nodes[id].generation <= _frozen_generation; }
+    // the node if no snapshot shares it, or else a copy of it taking its place in the tree, along
+    // with copies of its ancestors
+    NodeId _writable(NodeId id);
+    // destroys a node taken out of the tree, or keeps it while a snapshot may still read it
+    void _release(NodeId id);
+    // once the arena is emptied or replaced, the tree shares no node with its snapshots
+    void _forget_snapshots();
+    // gives the bboxes of the children of the node the layout of its level, which empties them
+    void _set_layout(Node<T> &node) const;
+
     size_t _max_entries;
     size_t _min_entries;
-    std::unique_ptr<Node<T>> _root;
+    NodeArena<T> _nodes;
+    NodeId _root;
+    // leaf outside of the tree holding the buffered items, searched along with the root
+    NodeId _buffer;
+    size_t _insert_buffer;
+    InsertStrategy _insert_strategy;
+    bool _compact_bboxes;
+    bool _points;
+    // bumped by every modification so that cursors can tell their nodes may be gone
+    uint64_t _version = 0;
+    bool _identity_index;
+    std::unordered_multimap<int64_t, NodeId> _index;
+    // snapshots taken of this tree, the nodes of their generations or older are not changed
+    std::shared_ptr<SnapshotRegistry> _snapshots;
+    uint64_t _frozen_generation = 0;
+    // nodes taken out of the tree while a snapshot may still read them
+    std::vector<NodeId> _retired;
+    // held by a snapshot, keeping the tree it was taken of from reusing its nodes
+    std::shared_ptr<void> _lease;
 
-    void _insert(std::unique_ptr<Node<T>> item_node, int level);
+private:
+    // children taken out of overflowing nodes during an insert with forced reinsertion, waiting to
+    // be put back, the entries into leaves and the nodes along with the height of the nodes to put
+    // them into
+    struct Reinsertion {
+        // bit h is set once a node of height h overflowed
+        uint64_t heights = 0;
+        std::vector<Entry<T>> entries;
+        std::vector<std::pair<NodeId, int>> nodes;
+    };
+
+    NodeId _create_leaf();
+    void _insert(const Entry<T> &entry);
+    void _insert(NodeId node, int level);
+    // puts the entry into a leaf, or else the node into a node of the level
+    void _insert_into(const Entry<T> *entry, NodeId node, int level, Reinsertion *reinsertion);
+    // puts back the children taken out until none is left
+    void _reinsert(Reinsertion &reinsertion);
+    void _take_out_farthest(std::vector<std::reference_wrapper<Node<T>>> &insert_path,
+                            NodeId node_id, int level, Reinsertion &reinsertion);
+    void _merge(std::vector<Entry<T>> &entries);
     Node<T> &_choose_subtree(const BBox &bbox, Node<T> &node, int level,
-                             std::vector<std::reference_wrapper<Node<T>>> &path);
-    void _split(std::vector<std::reference_wrapper<Node<T>>> &insert_path, int level);
+                             std::vector<std::reference_wrapper<Node<T>>> &path,
+                             std::vector<size_t> &path_indexes);
+    void _split(std::vector<std::reference_wrapper<Node<T>>> &insert_path,
+                std::vector<size_t> &path_indexes, NodeId node_id, int level);
     void _adjust_parent_bboxes(const BBox &bbox, std::vector<std::reference_wrapper<Node<T>>> &path,
-                               int level);
-    void _split_root(Node<T> &node, Node<T> &new_node);
-    int _choose_split_index(Node<T> &node, int m, int M);
-    void _choose_split_axis(Node<T> &node, int m, int M);
-    double _all_dist_margin(Node<T> &node, int m, int M, bool compare_min_x);
-    void _condense(std::vector<std::reference_wrapper<Node<T>>> &path);
+                               std::vector<size_t> &path_indexes, int level);
+    void _split_root(NodeId node, NodeId new_node);
+    void _join_children(const RBushBase &other, NodeId node_id, NodeId other_node_id,
+                        std::vector<std::pair<NodeId, NodeId>> &pairs,
+                        std::vector<uint32_t> &matches) const;
+    void _adopt_children(NodeId node_id);
+    // recomputes the bbox of the node from its children, then those of its ancestors for as long
+    // as they change
+    void _refit(NodeId node_id);
+    void _index_item(const T &item, NodeId leaf);
+    void _unindex_item(const T &item, NodeId leaf);
+    // points the index of the items of the leaf, which were in the old leaf, to the leaf
+    void _reindex_items(NodeId leaf, NodeId old_leaf);
+    void _index_subtree(NodeId node_id);
+    void _destroy_subtree(NodeId node_id);
+    // how poorly an internal node holds its items: the share of its children that full ones would
+    // spare, weighted by the overlap of its children relative to its area
+    double _badness(const Node<T> &node) const;
+    // a subtree of at most budget items under the node whose repacking saves enough nodes, adding
+    // the items of the subtrees judged to the work
+    std::optional<NodeId> _worst_subtree(NodeId node_id, size_t budget, size_t &work) const;
+    void _repack(NodeId node_id);
     void _all(std::reference_wrapper<Node<T>>,
               std::vector<std::reference_wrapper<T>> &result) const;
-    std::unique_ptr<Node<T>> _build(std::vector<std::unique_ptr<Node<T>>> &nodes, int left,
-                                    int right, int height);
-    void _multi_select(std::vector<std::unique_ptr<Node<T>>> &nodes, int left, int right, int n,
+    size_t _build_size(int N, int height) const;
+    void _build(std::vector<Entry<T>> &entries, int left, int right, int height, NodeId node_id);
+    void _multi_select(std::vector<Entry<T>> &entries, int left, int right, int n,
                        bool compare_min_x);
-    void _quick_select(std::vector<std::unique_ptr<Node<T>>> &nodes, int k, int left, int right,
+    void _quick_select(std::vector<Entry<T>> &entries, int k, int left, int right,
                        bool compare_min_x) const;
     double _compare_node_min(const BBox &a, const BBox &b, bool compare_min_x) const;
     py::dict _serialize_node(const Node<T> &node) const;
-    std::unique_ptr<Node<T>> _deserialize_node(const py::dict &data);
+    NodeId _deserialize_node(const py::dict &data);
+};
+
+// Search that can be resumed, the hits are produced a chunk at a time instead of all at once
+template <typename T> class SearchCursor {
+public:
+    SearchCursor(const RBushBase<T> &tree, const BBox &bbox, size_t chunk_size);
+
+    // returns the next chunk_size hits or a bit more, or nothing once the search is over, throws
+    // std::runtime_error if the tree was modified since the cursor was created
+    std::vector<std::reference_wrapper<T>> next();
+
+private:
+    const RBushBase<T> *_tree;
+    BBox _bbox;
+    size_t _chunk_size;
+    uint64_t _version;
+    // nodes left to visit, along with whether all of their entries match
+    std::vector<std::pair<NodeId, bool>> _stack;
+    std::vector<uint32_t> _matches;
 };
 
 // Default implementation that takes a Python dictionary as input
@@ -109,18 +502,94 @@ public:
     using RBushBase<py::dict>::RBushBase;
 
     BBox to_bbox(const py::dict &item) const override;
+
+private:
+    // the keys are created once instead of for every item
+    BBoxLayout _layout = BBoxLayout::items(py::str("min_x"), py::str("min_y"), py::str("max_x"),
+                                           py::str("max_y"));
 };
 
 // Python helper class for subclassing
 class PyRBushBase : public RBushBase<py::object> {
 public:
-    using RBushBase<py::object>::RBushBase;
+    explicit PyRBushBase(size_t max_entries = 9, bool identity_index = false,
+                         std::optional<BBoxLayout> bbox_layout = std::nullopt,
+                         size_t insert_buffer = 0,
+                         InsertStrategy insert_strategy = InsertStrategy::RBUSH,
+                         bool compact_bboxes = false)
+        : RBushBase<py::object>(max_entries, identity_index, insert_buffer, insert_strategy,
+                                compact_bboxes),
+          _bbox_layout(std::move(bbox_layout)) {}
 
     typedef RBushBase<py::object> BaseT;
 
+    // the layout given to the constructor takes precedence over a to_bbox defined in Python
     BBox to_bbox(const py::object &item) const override {
+        if (_bbox_layout)
+            return _bbox_layout->get(item);
         PYBIND11_OVERRIDE_PURE(BBox, BaseT, to_bbox, item);
     }
+
+private:
+    std::optional<BBoxLayout> _bbox_layout;
+};
+
+// Tree of integer ids with their bboxes given alongside, without any Python object inside
+class IdRBush : public RBushBase<int64_t> {
+public:
+    using RBushBase<int64_t>::RBushBase;
+
+    void insert(int64_t id, const BBox &bbox);
+    // removes an entry with the given id, its bbox is needed to find it without the identity index
+    void remove(int64_t id, const std::optional<BBox> &bbox);
+    // moves an id to the bbox, its old bbox is needed to find it without the identity index
+    bool update(int64_t id, const BBox &bbox, const std::optional<BBox> &old_bbox, double slack);
+    // coords and old_coords hold the new and the old bboxes of the ids as in load_arrays,
+    // old_coords may be null with the identity index
+    size_t update_many(const int64_t *ids, const double *coords, const double *old_coords,
+                       size_t n, double slack);
+    // coords holds the bboxes of the ids as in load_arrays, it may be null with the identity index
+    size_t remove_many(const int64_t *ids, const double *coords, size_t n);
+    // coords holds n rows of min_x, min_y, max_x, max_y, the ids default to the row indexes
+    void load_arrays(const double *coords, const int64_t *ids, size_t n);
+    // writes the tree to a file in the flat format, which MappedRBush and load_file read
+    void save(const std::string &path);
+    // throws std::invalid_argument for a PointRBush if the items of the file are not all points
+    void load_file(const std::string &path);
+    // writes the tree in the flat format into a POSIX shared memory segment, which SharedRBush
+    // attaches to from any process
+    void publish(const std::string &name);
+
+    BBox to_bbox(const int64_t &item) const override;
+
+    // guards the tree while the bindings run its methods without the GIL
+    std::shared_mutex &mutex() const { return _mutex; }
+
+private:
+    mutable std::shared_mutex _mutex;
+};
+
+// Tree of integer ids at points, whose leaves keep the two coordinates of every point instead of
+// the four of a bbox, so that they take half the memory and searches load half as much from them.
+// The bboxes given to the methods it inherits must be points
+class PointRBush : public IdRBush {
+public:
+    explicit PointRBush(size_t max_entries = 9, bool identity_index = false,
+                        size_t insert_buffer = 0,
+                        InsertStrategy insert_strategy = InsertStrategy::RBUSH,
+                        bool compact_bboxes = false)
+        : IdRBush(max_entries, identity_index, insert_buffer, insert_strategy, compact_bboxes,
+                  true) {}
+
+    void insert(int64_t id, double x, double y);
+    // points holds n rows of x, y, the ids default to the row indexes
+    void load_points(const double *points, const int64_t *ids, size_t n);
+    // points holds the points of the ids as in load_points, it may be null with the identity index
+    size_t remove_points(const int64_t *ids, const double *points, size_t n);
+    // points and old_points hold the new and the old points of the ids as in load_points,
+    // old_points may be null with the identity index
+    size_t update_points(const int64_t *ids, const double *points, const double *old_points,
+                         size_t n, double slack);
 };
 
 } // namespace rbush
@@ -0,0 +1,400 @@
+#include "flat.h"
+#include "debug.h"
+#include "thread_pool.h"
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <queue>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <system_error>
+#include <unistd.h>
+
+namespace rbush {
+
+// FlatTree implementation
+
+FlatTree::FlatTree(const void *data, size_t size) {
+    if (size < sizeof(flat::Header))
+        throw std::invalid_argument("not a flat rbush tree: too small");
+    const char *bytes = static_cast<const char *>(data);
+    _header = reinterpret_cast<const flat::Header *>(bytes);
+    _nodes = reinterpret_cast<const flat::Node *>(bytes + sizeof(flat::Header));
+    _items = reinterpret_cast<const flat::Item *>(_nodes + _header->num_nodes);
+    _validate(size);
+}
+
+void FlatTree::_validate(size_t size) const {
+    const flat::Header &header = *_header;
+    if (std::memcmp(header.magic, flat::MAGIC, sizeof(flat::MAGIC)) != 0)
+        throw std::invalid_argument("not a flat rbush tree: bad magic");
+    if (header.endian_mark != flat::ENDIAN_MARK)
+        throw std::invalid_argument("flat rbush tree written with another byte order");
+    if (header.version != flat::VERSION)
+        throw std::invalid_argument("unsupported flat rbush tree version " +
+                                    std::to_string(header.version));
+    if (header.max_entries < 4 || header.min_entries < 2 ||
+        header.min_entries > header.max_entries / 2)
+        throw std::invalid_argument("corrupted flat rbush tree: bad node capacity");
+    const uint64_t expected_size = sizeof(flat::Header) +
+                                   uint64_t(header.num_nodes) * sizeof(flat::Node) +
+                                   uint64_t(header.num_items) * sizeof(flat::Item);
+    if (header.num_nodes == 0 || size != expected_size)
+        throw std::invalid_argument("corrupted flat rbush tree: bad size");
+
+    // children must be numbered in breadth-first order, which also guarantees the records form a
+    // tree with every node reachable from the root exactly once
+    uint64_t next_node = 1;
+    uint64_t next_item = 0;
+    for (uint32_t i = 0; i < header.num_nodes; ++i) {
+        const flat::Node &node = _nodes[i];
+        bool valid = i < next_node && node.is_leaf <= 1;
+        if (node.is_leaf) {
+            valid = valid && node.height == 1 && node.first_child == next_item;
+            next_item += node.num_children;
+            valid = valid && next_item <= header.num_items;
+        } else {
+            valid = valid && node.num_children > 0 && node.first_child == next_node;
+            next_node += node.num_children;
+            valid = valid && next_node <= header.num_nodes;
+            for (uint32_t j = 0; valid && j < node.num_children; ++j) {
+                valid = _nodes[node.first_child + j].height + 1 == node.height;
+            }
+        }
+        if (!valid)
+            throw std::invalid_argument("corrupted flat rbush tree: bad node " +
+                                        std::to_string(i));
+    }
+    if (next_node != header.num_nodes || next_item != header.num_items)
+        throw std::invalid_argument("corrupted flat rbush tree: unreachable records");
+}
+
+std::vector<int64_t> FlatTree::search(const BBox &bbox) const {
+    DEBUG_TIMER("flat_search");
+    std::vector<int64_t> result;
+    if (!bbox.intersects(_nodes[0].bbox))
+        return result;
+
+    std::vector<uint32_t> nodes_to_search{0};
+    while (!nodes_to_search.empty()) {
+        const flat::Node &node = _nodes[nodes_to_search.back()];
+        nodes_to_search.pop_back();
+        const uint32_t end = node.first_child + node.num_children;
+        for (uint32_t i = node.first_child; i < end; ++i) {
+            if (node.is_leaf) {
+                if (bbox.intersects(_items[i].bbox))
+                    result.emplace_back(_items[i].id);
+            } else if (bbox.intersects(_nodes[i].bbox)) {
+                if (bbox.contains(_nodes[i].bbox)) {
+                    _all(_nodes[i], result);
+                } else {
+                    nodes_to_search.emplace_back(i);
+                }
+            }
+        }
+    }
+    return result;
+}
+
+bool FlatTree::collides(const BBox &bbox) const {
+    DEBUG_TIMER("flat_collides");
+    std::vector<uint32_t> nodes_to_search{0};
+    while (!nodes_to_search.empty()) {
+        const flat::Node &node = _nodes[nodes_to_search.back()];
+        nodes_to_search.pop_back();
+        const uint32_t end = node.first_child + node.num_children;
+        for (uint32_t i = node.first_child; i < end; ++i) {
+            if (node.is_leaf) {
+                if (bbox.intersects(_items[i].bbox))
+                    return true;
+            } else if (bbox.intersects(_nodes[i].bbox)) {
+                if (bbox.contains(_nodes[i].bbox))
+                    return true;
+                nodes_to_search.emplace_back(i);
+            }
+        }
+    }
+    return false;
+}
+
+std::pair<std::vector<int64_t>, std::vector<int64_t>>
+FlatTree::search_many(const std::vector<BBox> &bboxes) const {
+    DEBUG_TIMER("flat_search_many");
+    std::vector<std::vector<int64_t>> results(bboxes.size());
+    ThreadPool::get_instance().parallel_for(bboxes.size(), [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            results[i] = search(bboxes[i]);
+        }
+    });
+
+    std::vector<int64_t> offsets;
+    offsets.reserve(bboxes.size() + 1);
+    offsets.push_back(0);
+    for (const auto &result : results) {
+        offsets.push_back(offsets.back() + result.size());
+    }
+    std::vector<int64_t> hits;
+    hits.reserve(offsets.back());
+    for (const auto &result : results) {
+        hits.insert(hits.end(), result.begin(), result.end());
+    }
+    return {std::move(offsets), std::move(hits)};
+}
+
+// Same best-first traversal as RBushBase::knn
+std::vector<int64_t> FlatTree::knn(double x, double y, size_t k,
+                                   std::optional<double> max_distance,
+                                   const std::function<bool(const int64_t &)> &predicate) const {
+    DEBUG_TIMER("flat_knn");
+    std::vector<int64_t> result;
+    if (k == 0 || (max_distance && *max_distance < 0))
+        return result;
+    const double max_dist_sq =
+        max_distance ? *max_distance * *max_distance : std::numeric_limits<double>::infinity();
+
+    struct Candidate {
+        double dist_sq;
+        uint32_t index;
+        bool is_item;
+
+        bool operator>(const Candidate &other) const { return dist_sq > other.dist_sq; }
+    };
+    std::priority_queue<Candidate, std::vector<Candidate>, std::greater<Candidate>> queue;
+
+    const flat::Node *node = &_nodes[0];
+    while (node) {
+        const uint32_t end = node->first_child + node->num_children;
+        for (uint32_t i = node->first_child; i < end; ++i) {
+            const BBox &bbox = node->is_leaf ? _items[i].bbox : _nodes[i].bbox;
+            const double child_dist_sq = bbox.dist_sq(x, y);
+            if (child_dist_sq <= max_dist_sq)
+                queue.push({child_dist_sq, i, node->is_leaf != 0});
+        }
+
+        while (!queue.empty() && queue.top().is_item) {
+            const int64_t id = _items[queue.top().index].id;
+            queue.pop();
+            if (!predicate || predicate(id)) {
+                result.emplace_back(id);
+                if (result.size() == k)
+                    return result;
+            }
+        }
+
+        if (queue.empty())
+            break;
+        node = &_nodes[queue.top().index];
+        queue.pop();
+    }
+    return result;
+}
+
+std::vector<int64_t> FlatTree::all() const {
+    DEBUG_TIMER("flat_all");
+    std::vector<int64_t> result;
+    result.reserve(_header->num_items);
+    _all(_nodes[0], result);
+    return result;
+}
+
+void FlatTree::_all(const flat::Node &start_node, std::vector<int64_t> &result) const {
+    std::vector<const flat::Node *> nodes_to_search{&start_node};
+    while (!nodes_to_search.empty()) {
+        const flat::Node &node = *nodes_to_search.back();
+        nodes_to_search.pop_back();
+        const uint32_t end = node.first_child + node.num_children;
+        for (uint32_t i = node.first_child; i < end; ++i) {
+            if (node.is_leaf) {
+                result.emplace_back(_items[i].id);
+            } else {
+                nodes_to_search.emplace_back(&_nodes[i]);
+            }
+        }
+    }
+}
+
+// MappedFile implementation
+
+MappedFile::MappedFile(const std::string &path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw std::system_error(errno, std::generic_category(), "cannot open " + path);
+    _map(fd, path);
+}
+
+void MappedFile::_map(int fd, const std::string &name) {
+    struct stat st;
+    if (::fstat(fd, &st) != 0) {
+        int error = errno;
+        ::close(fd);
+        throw std::system_error(error, std::generic_category(), "cannot stat " + name);
+    }
+    _size = st.st_size;
+    if (_size > 0) {
+        void *data = ::mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            int error = errno;
+            ::close(fd);
+            throw std::system_error(error, std::generic_category(), "cannot map " + name);
+        }
+        _data = data;
+    }
+    // the mapping stays valid after the descriptor is closed
+    ::close(fd);
+}
+
+MappedFile::~MappedFile() {
+    if (_data)
+        ::munmap(_data, _size);
+}
+
+// SharedMemory implementation
+
+SharedMemory::SharedMemory(const std::string &name) {
+    int fd = ::shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd < 0)
+        throw std::system_error(errno, std::generic_category(), "cannot open " + name);
+    _map(fd, name);
+}
+
+// Flat format writer
+
+size_t flat_size(const NodeArena<int64_t> &nodes, NodeId root) {
+    size_t num_nodes = 0;
+    std::vector<NodeId> nodes_to_count{root};
+    while (!nodes_to_count.empty()) {
+        const Node<int64_t> &node = nodes[nodes_to_count.back()];
+        nodes_to_count.pop_back();
+        ++num_nodes;
+        nodes_to_count.insert(nodes_to_count.end(), node.children.begin(), node.children.end());
+    }
+    return sizeof(flat::Header) + num_nodes * sizeof(flat::Node) +
+           nodes[root].count * sizeof(flat::Item);
+}
+
+void write_flat(char *data, const NodeArena<int64_t> &nodes, NodeId root, size_t max_entries,
+                size_t min_entries) {
+    flat::Node *flat_nodes = reinterpret_cast<flat::Node *>(data + sizeof(flat::Header));
+    uint32_t num_items = 0;
+    std::vector<NodeId> queue{root};
+    for (size_t i = 0; i < queue.size(); ++i) {
+        const Node<int64_t> &node = nodes[queue[i]];
+        const uint32_t first_child = node.is_leaf ? num_items : queue.size();
+        flat_nodes[i] = {node, first_child, static_cast<uint32_t>(node.num_children()),
+                         static_cast<uint32_t>(node.height), node.is_leaf};
+        if (node.is_leaf) {
+            num_items += node.items.size();
+        } else {
+            queue.insert(queue.end(), node.children.begin(), node.children.end());
+        }
+    }
+    // the items follow the last node, whose position is only known once every node is queued
+    flat::Item *flat_items = reinterpret_cast<flat::Item *>(flat_nodes + queue.size());
+    for (size_t i = 0; i < queue.size(); ++i) {
+        const Node<int64_t> &node = nodes[queue[i]];
+        if (!node.is_leaf)
+            continue;
+        flat::Item *item = flat_items + flat_nodes[i].first_child;
+        for (size_t j = 0; j < node.items.size(); ++j) {
+            *item++ = {node.child_bboxes[j], node.items[j]};
+        }
+    }
+
+    flat::Header header;
+    std::memcpy(header.magic, flat::MAGIC, sizeof(flat::MAGIC));
+    header.version = flat::VERSION;
+    header.endian_mark = flat::ENDIAN_MARK;
+    header.max_entries = max_entries;
+    header.min_entries = min_entries;
+    header.num_nodes = queue.size();
+    header.num_items = num_items;
+    std::atomic_thread_fence(std::memory_order_release);
+    std::memcpy(data, &header, sizeof(header));
+}
+
+// The tree is written to a new file in the same directory, which is then renamed over the path.
+// A MappedRBush of the file replaced keeps reading it, the file being freed once it is unmapped,
+// whereas rewriting it in place would truncate it under the mapping
+void write_flat(const std::string &path, const NodeArena<int64_t> &nodes, NodeId root,
+                size_t max_entries, size_t min_entries) {
+    std::vector<char> data(flat_size(nodes, root));
+    write_flat(data.data(), nodes, root, max_entries, min_entries);
+
+    static std::atomic<uint64_t> num_saves{0};
+    const std::string temp_path =
+        path + ".tmp" + std::to_string(::getpid()) + "." + std::to_string(num_saves++);
+    int fd = ::open(temp_path.c_str(), O_CREAT | O_EXCL | O_WRONLY, 0666);
+    if (fd < 0)
+        throw std::system_error(errno, std::generic_category(), "cannot create " + temp_path);
+    // the file must not be left behind half written
+    const auto fail = [&](const std::string &what) {
+        int error = errno;
+        if (fd >= 0)
+            ::close(fd);
+        ::unlink(temp_path.c_str());
+        throw std::system_error(error, std::generic_category(), what + path);
+    };
+    // a file saved over keeps its permissions
+    struct stat existing;
+    if (::stat(path.c_str(), &existing) == 0 && ::fchmod(fd, existing.st_mode & 07777) != 0)
+        fail("cannot set the permissions of ");
+    for (size_t written = 0; written < data.size();) {
+        const ssize_t result = ::write(fd, data.data() + written, data.size() - written);
+        if (result == 0)
+            errno = EIO;
+        if (result == 0 || (result < 0 && errno != EINTR))
+            fail("cannot write ");
+        written += std::max<ssize_t>(result, 0);
+    }
+    // the data must be on disk before the rename, which a crash could otherwise leave pointing
+    // to an empty or truncated file
+    if (::fsync(fd) != 0)
+        fail("cannot write ");
+    const int closed = ::close(fd);
+    fd = -1;
+    if (closed != 0)
+        fail("cannot write ");
+    if (::rename(temp_path.c_str(), path.c_str()) != 0)
+        fail("cannot replace ");
+}
+
+// The segment is written through a mapping of its own, so the tree is never copied in between.
+// Only the user publishing it may attach to it, as it holds every id and bbox of the tree
+void publish_flat(const std::string &name, const NodeArena<int64_t> &nodes, NodeId root,
+                  size_t max_entries, size_t min_entries) {
+    const size_t size = flat_size(nodes, root);
+    // POSIX shared memory has no rename to swap a new segment in, so a publisher creating a
+    // segment under the name between the unlink and the create of this one has it replaced in turn
+    int fd = -1;
+    while (fd < 0) {
+        if (::shm_unlink(name.c_str()) != 0 && errno != ENOENT)
+            throw std::system_error(errno, std::generic_category(), "cannot unlink " + name);
+        fd = ::shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        if (fd < 0 && errno != EEXIST)
+            throw std::system_error(errno, std::generic_category(), "cannot create " + name);
+    }
+    // a segment left half made would be attached to by mistake
+    const auto fail = [&](const std::string &what) {
+        int error = errno;
+        ::close(fd);
+        ::shm_unlink(name.c_str());
+        throw std::system_error(error, std::generic_category(), what + name);
+    };
+    if (::ftruncate(fd, size) != 0)
+        fail("cannot resize ");
+    void *data = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED)
+        fail("cannot map ");
+    ::close(fd);
+    write_flat(static_cast<char *>(data), nodes, root, max_entries, min_entries);
+    ::munmap(data, size);
+}
+
+void unlink_shared(const std::string &name) {
+    if (::shm_unlink(name.c_str()) != 0)
+        throw std::system_error(errno, std::generic_category(), "cannot unlink " + name);
+}
+
+} // namespace rbush
@@ -0,0 +1,149 @@
+#ifndef FLAT_H_
+#define FLAT_H_
+
+#include "_rbush.h"
+#include <functional>
+#include <string>
+
+namespace rbush {
+namespace flat {
+
+// The flat format is a Header followed by num_nodes Node records in breadth-first order starting
+// with the root, then num_items Item records, all in native byte order. The children of a node are
+// consecutive records, the next Node records for an internal node and Item records for a leaf.
+
+constexpr char MAGIC[8] = {'R', 'B', 'U', 'S', 'H', 'I', 'D', 'X'};
+constexpr uint32_t VERSION = 1;
+constexpr uint32_t ENDIAN_MARK = 0x01020304;
+
+struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t endian_mark;
+    uint32_t max_entries;
+    uint32_t min_entries;
+    uint32_t num_nodes;
+    uint32_t num_items;
+};
+
+struct Node {
+    BBox bbox;
+    uint32_t first_child;
+    uint32_t num_children;
+    uint32_t height;
+    uint32_t is_leaf;
+};
+
+struct Item {
+    BBox bbox;
+    int64_t id;
+};
+
+static_assert(sizeof(Header) == 32, "flat header must not be padded");
+static_assert(sizeof(Node) == 48, "flat node must not be padded");
+static_assert(sizeof(Item) == 40, "flat item must not be padded");
+
+} // namespace flat
+
+// Read-only tree over memory holding the flat format, which must outlive it
+class FlatTree {
+public:
+    // throws std::invalid_argument unless data holds a well-formed tree
+    FlatTree(const void *data, size_t size);
+
+    const flat::Header &header() const { return *_header; }
+    const flat::Node *nodes() const { return _nodes; }
+    const flat::Item *items() const { return _items; }
+    size_t size() const { return _header->num_items; }
+
+    std::vector<int64_t> search(const BBox &bbox) const;
+    bool collides(const BBox &bbox) const;
+    std::pair<std::vector<int64_t>, std::vector<int64_t>>
+    search_many(const std::vector<BBox> &bboxes) const;
+    std::vector<int64_t> knn(double x, double y, size_t k,
+                             std::optional<double> max_distance = std::nullopt,
+                             const std::function<bool(const int64_t &)> &predicate = nullptr) const;
+    std::vector<int64_t> all() const;
+
+private:
+    const flat::Header *_header;
+    const flat::Node *_nodes;
+    const flat::Item *_items;
+
+    void _validate(size_t size) const;
+    void _all(const flat::Node &node, std::vector<int64_t> &result) const;
+};
+
+// Read-only memory mapping of a whole file
+class MappedFile {
+public:
+    explicit MappedFile(const std::string &path);
+    ~MappedFile();
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    const void *data() const { return _data; }
+    size_t size() const { return _size; }
+
+protected:
+    MappedFile() = default;
+    // maps the whole of the file open as fd, then closes fd
+    void _map(int fd, const std::string &name);
+
+private:
+    void *_data = nullptr;
+    size_t _size = 0;
+};
+
+// Read-only memory mapping of a whole POSIX shared memory segment
+class SharedMemory : public MappedFile {
+public:
+    explicit SharedMemory(const std::string &name);
+};
+
+// Tree saved by IdRBush::save and queried straight from the mapped pages of the file, so opening
+// it costs nothing more than validating the records
+class MappedRBush : private MappedFile, public FlatTree {
+public:
+    explicit MappedRBush(const std::string &path)
+        : MappedFile(path), FlatTree(MappedFile::data(), MappedFile::size()) {}
+
+    using FlatTree::size;
+};
+
+// Tree published by IdRBush::publish and queried straight from the shared memory segment, so that
+// the processes attaching to it all read the same pages, none of which they ever write to
+class SharedRBush : private SharedMemory, public FlatTree {
+public:
+    explicit SharedRBush(const std::string &name)
+        : SharedMemory(name), FlatTree(SharedMemory::data(), SharedMemory::size()) {}
+
+    using FlatTree::size;
+};
+
+// Size in bytes of the tree rooted at root in the flat format
+size_t flat_size(const NodeArena<int64_t> &nodes, NodeId root);
+
+// Writes the tree rooted at root in the flat format into data, which must hold flat_size bytes.
+// The header is written last, so that the records are complete once it is there
+void write_flat(char *data, const NodeArena<int64_t> &nodes, NodeId root, size_t max_entries,
+                size_t min_entries);
+
+// Writes the tree rooted at root in the flat format
+void write_flat(const std::string &path, const NodeArena<int64_t> &nodes, NodeId root,
+                size_t max_entries, size_t min_entries);
+
+// Writes the tree rooted at root in the flat format into a new POSIX shared memory segment, taking
+// the name from any segment having it. The processes attached to that one keep it until they
+// detach, as it is only freed then. Of several processes publishing under the same name at once,
+// the last one to create its segment keeps the name
+void publish_flat(const std::string &name, const NodeArena<int64_t> &nodes, NodeId root,
+                  size_t max_entries, size_t min_entries);
+
+// Removes the name of a shared memory segment, which is freed once no process maps it anymore
+void unlink_shared(const std::string &name);
+
+} // namespace rbush
+
+#endif // FLAT_H_
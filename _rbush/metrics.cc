@@ -0,0 +1,211 @@
+#include "metrics.h"
+#include <algorithm>
+#include <cmath>
+#include <mutex>
+
+namespace rbush {
+namespace metrics {
+
+namespace {
+
+// Counters of the calls of an operation made by one thread
+struct Counters {
+    std::atomic<uint64_t> calls{0};
+    std::atomic<uint64_t> total_ns{0};
+    std::atomic<uint64_t> nodes_visited{0};
+    std::atomic<uint64_t> leaves_scanned{0};
+    std::atomic<uint64_t> entries_tested{0};
+    std::array<std::atomic<uint64_t>, NUM_BUCKETS> buckets{};
+};
+
+using ThreadCounters = std::array<Counters, NUM_OPS>;
+
+// only the owning thread writes its counters, so they are added to without a locked instruction,
+// the atomics only let other threads read them meanwhile
+void add(std::atomic<uint64_t> &counter, uint64_t value) {
+    counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+void add(OpMetrics &metrics, const OpMetrics &other, bool subtract = false) {
+    const auto op = [subtract](uint64_t &a, uint64_t b) { a = subtract ? a - b : a + b; };
+    op(metrics.calls, other.calls);
+    op(metrics.total_ns, other.total_ns);
+    op(metrics.work.nodes_visited, other.work.nodes_visited);
+    op(metrics.work.leaves_scanned, other.work.leaves_scanned);
+    op(metrics.work.entries_tested, other.work.entries_tested);
+    for (size_t i = 0; i < NUM_BUCKETS; ++i) {
+        op(metrics.buckets[i], other.buckets[i]);
+    }
+}
+
+void add(OpMetrics &metrics, const Counters &counters) {
+    const auto load = [](const std::atomic<uint64_t> &counter) {
+        return counter.load(std::memory_order_relaxed);
+    };
+    metrics.calls += load(counters.calls);
+    metrics.total_ns += load(counters.total_ns);
+    metrics.work.nodes_visited += load(counters.nodes_visited);
+    metrics.work.leaves_scanned += load(counters.leaves_scanned);
+    metrics.work.entries_tested += load(counters.entries_tested);
+    for (size_t i = 0; i < NUM_BUCKETS; ++i) {
+        metrics.buckets[i] += load(counters.buckets[i]);
+    }
+}
+
+// The counters of the threads alive, along with the totals of the threads gone. A reset keeps the
+// totals at that time aside rather than clearing the counters, which only their thread writes to
+struct Registry {
+    std::mutex mutex;
+    std::vector<const ThreadCounters *> threads;
+    std::array<OpMetrics, NUM_OPS> exited;
+    std::array<OpMetrics, NUM_OPS> baseline;
+
+    std::array<OpMetrics, NUM_OPS> totals() const {
+        std::array<OpMetrics, NUM_OPS> result = exited;
+        for (const ThreadCounters *counters : threads) {
+            for (size_t op = 0; op < NUM_OPS; ++op) {
+                add(result[op], (*counters)[op]);
+            }
+        }
+        return result;
+    }
+};
+
+// never destroyed, as threads may exit after the static objects are destroyed
+Registry &registry() {
+    static Registry *instance = new Registry();
+    return *instance;
+}
+
+struct ThreadSlot {
+    ThreadCounters counters;
+
+    ThreadSlot() {
+        Registry &r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        r.threads.push_back(&counters);
+    }
+
+    ~ThreadSlot() {
+        Registry &r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        for (size_t op = 0; op < NUM_OPS; ++op) {
+            add(r.exited[op], counters[op]);
+        }
+        r.threads.erase(std::find(r.threads.begin(), r.threads.end(), &counters));
+    }
+};
+
+ThreadCounters &thread_counters() {
+    thread_local ThreadSlot slot;
+    return slot.counters;
+}
+
+std::atomic<bool> is_enabled{true};
+
+} // namespace
+
+const char *op_name(Op op) {
+    switch (op) {
+    case Op::INSERT:
+        return "insert";
+    case Op::LOAD:
+        return "load";
+    case Op::FLUSH:
+        return "flush";
+    case Op::REMOVE:
+        return "remove";
+    case Op::REMOVE_MANY:
+        return "remove_many";
+    case Op::REMOVE_IN:
+        return "remove_in";
+    case Op::UPDATE:
+        return "update";
+    case Op::UPDATE_MANY:
+        return "update_many";
+    case Op::OPTIMIZE:
+        return "optimize";
+    case Op::SEARCH:
+        return "search";
+    case Op::ITER_SEARCH:
+        return "iter_search";
+    case Op::SEARCH_MANY:
+        return "search_many";
+    case Op::COLLIDES:
+        return "collides";
+    case Op::COUNT:
+        return "count";
+    case Op::KNN:
+        return "knn";
+    default:
+        return "join";
+    }
+}
+
+size_t bucket(uint64_t ns) {
+    if (ns < 4)
+        return ns;
+    // the exponent then the 2 bits after the leading one
+    const int exponent = 63 - __builtin_clzll(ns);
+    return 4 * (exponent - 1) + ((ns >> (exponent - 2)) & 3);
+}
+
+uint64_t bucket_min(size_t bucket) {
+    if (bucket < 4)
+        return bucket;
+    return (4 + bucket % 4) << (bucket / 4 - 1);
+}
+
+uint64_t OpMetrics::percentile(double fraction) const {
+    // the buckets rather than calls, which a snapshot may read before the call is fully recorded
+    uint64_t num_calls = 0;
+    for (uint64_t count : buckets) {
+        num_calls += count;
+    }
+    if (num_calls == 0)
+        return 0;
+    const uint64_t rank = std::max<uint64_t>(1, std::ceil(fraction * num_calls));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < NUM_BUCKETS; ++i) {
+        seen += buckets[i];
+        if (seen >= rank) {
+            // the middle of the bucket
+            const uint64_t width = i < 4 ? 1 : uint64_t(1) << (i / 4 - 1);
+            return bucket_min(i) + width / 2;
+        }
+    }
+    return bucket_min(NUM_BUCKETS - 1);
+}
+
+void set_enabled(bool enabled) { is_enabled.store(enabled, std::memory_order_relaxed); }
+
+bool enabled() { return is_enabled.load(std::memory_order_relaxed); }
+
+std::array<OpMetrics, NUM_OPS> snapshot() {
+    Registry &r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    std::array<OpMetrics, NUM_OPS> result = r.totals();
+    for (size_t op = 0; op < NUM_OPS; ++op) {
+        add(result[op], r.baseline[op], true);
+    }
+    return result;
+}
+
+void reset() {
+    Registry &r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    r.baseline = r.totals();
+}
+
+void record(Op op, uint64_t ns, const Work &work) {
+    Counters &counters = thread_counters()[static_cast<size_t>(op)];
+    add(counters.calls, 1);
+    add(counters.total_ns, ns);
+    add(counters.nodes_visited, work.nodes_visited);
+    add(counters.leaves_scanned, work.leaves_scanned);
+    add(counters.entries_tested, work.entries_tested);
+    add(counters.buckets[bucket(ns)], 1);
+}
+
+} // namespace metrics
+} // namespace rbush
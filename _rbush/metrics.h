@@ -0,0 +1,107 @@
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace rbush {
+namespace metrics {
+
+// Operations of the trees whose calls are measured
+enum class Op {
+    INSERT,
+    LOAD,
+    FLUSH,
+    REMOVE,
+    REMOVE_MANY,
+    REMOVE_IN,
+    UPDATE,
+    UPDATE_MANY,
+    OPTIMIZE,
+    SEARCH,
+    ITER_SEARCH,
+    SEARCH_MANY,
+    COLLIDES,
+    COUNT,
+    KNN,
+    JOIN,
+};
+constexpr size_t NUM_OPS = static_cast<size_t>(Op::JOIN) + 1;
+
+const char *op_name(Op op);
+
+// Latencies are counted in buckets of a quarter of a power of two of nanoseconds, so percentiles
+// are known within 25%
+constexpr size_t NUM_BUCKETS = 256;
+size_t bucket(uint64_t ns);
+// smallest latency falling into the bucket
+uint64_t bucket_min(size_t bucket);
+
+// Work of a query, nodes visited being the nodes whose children were tested against the query
+struct Work {
+    uint64_t nodes_visited = 0;
+    uint64_t leaves_scanned = 0;
+    uint64_t entries_tested = 0;
+
+    void visit(size_t num_entries, bool is_leaf) {
+        ++nodes_visited;
+        leaves_scanned += is_leaf;
+        entries_tested += num_entries;
+    }
+};
+
+// Totals of an operation since the last reset, summed over all threads
+struct OpMetrics {
+    uint64_t calls = 0;
+    uint64_t total_ns = 0;
+    Work work;
+    std::array<uint64_t, NUM_BUCKETS> buckets{};
+
+    // approximate latency below which the given fraction of the calls are
+    uint64_t percentile(double fraction) const;
+};
+
+// The calls are counted unless disabled, enabling or disabling does not reset them
+void set_enabled(bool enabled);
+bool enabled();
+std::array<OpMetrics, NUM_OPS> snapshot();
+void reset();
+
+void record(Op op, uint64_t ns, const Work &work);
+
+// Measures a call from its construction to its destruction, the work of the call being added to
+// work meanwhile. Every thread counts its own calls, so that measuring takes no lock
+class OpTimer {
+public:
+    explicit OpTimer(Op op) : _op(op), _enabled(enabled()) {
+        if (_enabled)
+            _start = std::chrono::steady_clock::now();
+    }
+
+    ~OpTimer() {
+        if (!_enabled)
+            return;
+        const auto end = std::chrono::steady_clock::now();
+        const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end - _start).count();
+        record(_op, static_cast<uint64_t>(ns), work);
+    }
+
+    OpTimer(const OpTimer &) = delete;
+    OpTimer &operator=(const OpTimer &) = delete;
+
+    Work work;
+
+private:
+    Op _op;
+    bool _enabled;
+    std::chrono::steady_clock::time_point _start;
+};
+
+} // namespace metrics
+} // namespace rbush
+
+#endif // METRICS_H_
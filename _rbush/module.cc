@@ -1,15 +1,556 @@
 #include <pybind11/functional.h>
+#include <pybind11/numpy.h>
 #include <pybind11/pybind11.h>
 #include <pybind11/stl.h>
 
 #include "_rbush.h"
 #include "debug.h"
+#include "flat.h"
+#include "metrics.h"
+#include "packed.h"
+#include "thread_pool.h"
+#include <mutex>
+#include <shared_mutex>
+#include <system_error>
 
 namespace py = pybind11;
 
+namespace {
+
+// Reads the query boxes from a (N, 4) float64 buffer such as a NumPy array, or a sequence of BBox
+std::vector<rbush::BBox> to_bbox_vector(const py::object &bboxes) {
+    std::vector<rbush::BBox> result;
+    if (py::isinstance<py::buffer>(bboxes)) {
+        py::buffer_info info = py::reinterpret_borrow<py::buffer>(bboxes).request();
+        if (info.format != py::format_descriptor<double>::format() || info.ndim != 2 ||
+            info.shape[1] != 4) {
+            throw py::value_error("bboxes must be a (N, 4) float64 array");
+        }
+        const char *data = static_cast<const char *>(info.ptr);
+        result.reserve(info.shape[0]);
+        for (py::ssize_t i = 0; i < info.shape[0]; ++i) {
+            const char *row = data + i * info.strides[0];
+            auto coord = [&](py::ssize_t j) {
+                return *reinterpret_cast<const double *>(row + j * info.strides[1]);
+            };
+            result.emplace_back(coord(0), coord(1), coord(2), coord(3));
+        }
+    } else {
+        for (const auto &bbox : bboxes) {
+            result.push_back(bbox.cast<rbush::BBox>());
+        }
+    }
+    return result;
+}
+
+// RBush and RBushBase take no lock of their own, so the GIL is kept while the queries run on the
+// thread pool, which keeps the other Python threads from changing the tree meanwhile
+template <typename Tree> auto search_many(const Tree &tree, const py::object &bboxes) {
+    return tree.search_many(to_bbox_vector(bboxes));
+}
+
+rbush::JoinPredicate to_join_predicate(const std::string &predicate) {
+    if (predicate == "intersects")
+        return rbush::JoinPredicate::INTERSECTS;
+    if (predicate == "contains")
+        return rbush::JoinPredicate::CONTAINS;
+    if (predicate == "within")
+        return rbush::JoinPredicate::WITHIN;
+    throw py::value_error("predicate must be 'intersects', 'contains' or 'within'");
+}
+
+// Keeps the GIL like search_many, which keeps both trees from being changed meanwhile
+template <typename Tree>
+auto join(const Tree &tree, const Tree &other, const std::string &predicate) {
+    return tree.join(other, to_join_predicate(predicate));
+}
+
+rbush::InsertStrategy to_insert_strategy(const std::string &insert_strategy) {
+    if (insert_strategy == "rbush")
+        return rbush::InsertStrategy::RBUSH;
+    if (insert_strategy == "rstar")
+        return rbush::InsertStrategy::RSTAR;
+    throw py::value_error("insert_strategy must be 'rbush' or 'rstar'");
+}
+
+// Constructor of a tree taking the given arguments followed by the name of its insert strategy and
+// whether its bboxes are compact
+template <typename Tree, typename... Args> auto init_tree() {
+    return py::init([](Args... args, const std::string &insert_strategy, bool compact_bboxes) {
+        return new Tree(std::move(args)..., to_insert_strategy(insert_strategy), compact_bboxes);
+    });
+}
+
+// Read-only tree sharing the nodes of the given one as they are now, of the Snapshot class for
+// trees bound along with a trampoline
+template <typename Tree, typename Snapshot = Tree> std::unique_ptr<Tree> snapshot(Tree &tree) {
+    std::unique_ptr<Tree> result = std::make_unique<Snapshot>();
+    result->snapshot_of(tree);
+    return result;
+}
+
+py::dict to_dict(const rbush::TreeStats &stats) {
+    py::list levels;
+    for (const rbush::TreeStats::Level &level : stats.levels) {
+        levels.append(py::dict(py::arg("height") = level.height, py::arg("nodes") = level.nodes,
+                               py::arg("fill") = level.fill, py::arg("area") = level.area,
+                               py::arg("overlap") = level.overlap,
+                               py::arg("dead_space") = level.dead_space));
+    }
+    return py::dict(py::arg("size") = stats.size, py::arg("buffered") = stats.buffered,
+                    py::arg("height") = stats.height, py::arg("nodes") = stats.nodes,
+                    py::arg("overlap") = stats.overlap, py::arg("dead_space") = stats.dead_space,
+                    py::arg("levels") = levels);
+}
+
+// Walks the tree with the GIL kept, like search_many
+template <typename Tree> py::dict stats(const Tree &tree) { return to_dict(tree.stats()); }
+
+// Metrics of every operation, summed over the threads
+py::dict get_metrics() {
+    namespace metrics = rbush::metrics;
+    const auto snapshot = metrics::snapshot();
+    py::dict result;
+    for (size_t i = 0; i < metrics::NUM_OPS; ++i) {
+        const metrics::OpMetrics &op = snapshot[i];
+        result[metrics::op_name(static_cast<metrics::Op>(i))] = py::dict(
+            py::arg("calls") = op.calls, py::arg("total_ns") = op.total_ns,
+            py::arg("p50_ns") = op.percentile(0.5), py::arg("p99_ns") = op.percentile(0.99),
+            py::arg("nodes_visited") = op.work.nodes_visited,
+            py::arg("leaves_scanned") = op.work.leaves_scanned,
+            py::arg("entries_tested") = op.work.entries_tested);
+    }
+    return result;
+}
+
+template <typename Tree, typename T>
+rbush::SearchCursor<T> iter_search(const Tree &tree, const rbush::BBox &bbox, size_t chunk_size) {
+    return rbush::SearchCursor<T>(tree, bbox, chunk_size);
+}
+
+// Python iterator over the chunks of hits of a cursor, each chunk being a list
+template <typename T> void bind_search_iterator(py::module_ &m, const char *name) {
+    py::class_<rbush::SearchCursor<T>>(m, name)
+        .def("__iter__", [](py::object self) { return self; })
+        .def("__next__", [](rbush::SearchCursor<T> &cursor) {
+            auto chunk = cursor.next();
+            if (chunk.empty())
+                throw py::stop_iteration();
+            return chunk;
+        });
+}
+
+template <typename T>
+using ContiguousArray = py::array_t<T, py::array::c_style | py::array::forcecast>;
+
+// Hands the ids over to NumPy without copying them
+py::array_t<int64_t> to_array(std::vector<int64_t> &&ids) {
+    auto *owner = new std::vector<int64_t>(std::move(ids));
+    py::capsule capsule(owner, [](void *p) { delete static_cast<std::vector<int64_t> *>(p); });
+    return py::array_t<int64_t>(owner->size(), owner->data(), capsule);
+}
+
+// For trees that are never modified, which need no lock around the call
+template <typename F> auto without_gil(F &&f) {
+    py::gil_scoped_release release;
+    return f();
+}
+
+// Hands the pairs of ids over to NumPy as a (N, 2) array without copying them
+py::array_t<int64_t> to_pair_array(std::vector<int64_t> &&pairs) {
+    auto *owner = new std::vector<int64_t>(std::move(pairs));
+    py::capsule capsule(owner, [](void *p) { delete static_cast<std::vector<int64_t> *>(p); });
+    const py::ssize_t num_pairs = owner->size() / 2;
+    return py::array_t<int64_t>({num_pairs, py::ssize_t(2)}, owner->data(), capsule);
+}
+
+namespace id_rbush {
+
+// IdRBush methods run without the GIL, the mutex of the tree lets readers run concurrently while
+// keeping writers exclusive, so the ids have to be copied out before it is released. Those taking
+// the tree as a template argument are shared with PointRBush
+
+template <typename F> auto with_read_lock(const rbush::IdRBush &tree, F &&f) {
+    py::gil_scoped_release release;
+    std::shared_lock<std::shared_mutex> lock(tree.mutex());
+    return f();
+}
+
+template <typename F> auto with_write_lock(rbush::IdRBush &tree, F &&f) {
+    py::gil_scoped_release release;
+    std::unique_lock<std::shared_mutex> lock(tree.mutex());
+    return f();
+}
+
+std::vector<int64_t> to_ids(const std::vector<std::reference_wrapper<int64_t>> &items) {
+    return std::vector<int64_t>(items.begin(), items.end());
+}
+
+template <typename Tree> void clear(Tree &tree) {
+    with_write_lock(tree, [&] { tree.clear(); });
+}
+
+template <typename Tree> void flush(Tree &tree) {
+    with_write_lock(tree, [&] { tree.flush(); });
+}
+
+void insert(rbush::IdRBush &tree, int64_t id, const rbush::BBox &bbox) {
+    with_write_lock(tree, [&] { tree.insert(id, bbox); });
+}
+
+void remove(rbush::IdRBush &tree, int64_t id, const std::optional<rbush::BBox> &bbox) {
+    with_write_lock(tree, [&] { tree.remove(id, bbox); });
+}
+
+size_t remove_many(rbush::IdRBush &tree, const ContiguousArray<int64_t> &ids,
+                   const std::optional<ContiguousArray<double>> &coords) {
+    if (ids.ndim() != 1) {
+        throw py::value_error("ids must be a (N,) array");
+    }
+    if (coords && (coords->ndim() != 2 || coords->shape(0) != ids.shape(0) ||
+                   coords->shape(1) != 4)) {
+        throw py::value_error("coords must be a (N, 4) array with one row per id");
+    }
+    const int64_t *ids_data = ids.data();
+    const double *coords_data = coords ? coords->data() : nullptr;
+    const size_t n = ids.shape(0);
+    return with_write_lock(tree, [&] { return tree.remove_many(ids_data, coords_data, n); });
+}
+
+template <typename Tree> size_t remove_in(Tree &tree, const rbush::BBox &bbox) {
+    return with_write_lock(tree, [&] { return tree.remove_in(bbox); });
+}
+
+template <typename Tree> size_t optimize(Tree &tree, size_t budget) {
+    return with_write_lock(tree, [&] { return tree.optimize(budget); });
+}
+
+bool update(rbush::IdRBush &tree, int64_t id, const rbush::BBox &bbox,
+            const std::optional<rbush::BBox> &old_bbox, double slack) {
+    return with_write_lock(tree, [&] { return tree.update(id, bbox, old_bbox, slack); });
+}
+
+size_t update_many(rbush::IdRBush &tree, const ContiguousArray<int64_t> &ids,
+                   const ContiguousArray<double> &coords,
+                   const std::optional<ContiguousArray<double>> &old_coords, double slack) {
+    if (ids.ndim() != 1) {
+        throw py::value_error("ids must be a (N,) array");
+    }
+    if (coords.ndim() != 2 || coords.shape(0) != ids.shape(0) || coords.shape(1) != 4) {
+        throw py::value_error("coords must be a (N, 4) array with one row per id");
+    }
+    if (old_coords && (old_coords->ndim() != 2 || old_coords->shape(0) != ids.shape(0) ||
+                       old_coords->shape(1) != 4)) {
+        throw py::value_error("old_coords must be a (N, 4) array with one row per id");
+    }
+    const int64_t *ids_data = ids.data();
+    const double *coords_data = coords.data();
+    const double *old_coords_data = old_coords ? old_coords->data() : nullptr;
+    const size_t n = ids.shape(0);
+    return with_write_lock(
+        tree, [&] { return tree.update_many(ids_data, coords_data, old_coords_data, n, slack); });
+}
+
+// Loads the rows of coords straight from the array memory, which is only copied if it is not a
+// C-contiguous float64 array already
+void load_arrays(rbush::IdRBush &tree, const ContiguousArray<double> &coords,
+                 const std::optional<ContiguousArray<int64_t>> &ids) {
+    if (coords.ndim() != 2 || coords.shape(1) != 4) {
+        throw py::value_error("coords must be a (N, 4) array");
+    }
+    if (ids && (ids->ndim() != 1 || ids->shape(0) != coords.shape(0))) {
+        throw py::value_error("ids must be a (N,) array with one id per row of coords");
+    }
+    const double *coords_data = coords.data();
+    const int64_t *ids_data = ids ? ids->data() : nullptr;
+    const size_t n = coords.shape(0);
+    with_write_lock(tree, [&] { tree.load_arrays(coords_data, ids_data, n); });
+}
+
+template <typename Tree> py::array_t<int64_t> search(const Tree &tree, const rbush::BBox &bbox) {
+    return to_array(with_read_lock(tree, [&] { return to_ids(tree.search(bbox)); }));
+}
+
+template <typename Tree> bool collides(const Tree &tree, const rbush::BBox &bbox) {
+    return with_read_lock(tree, [&] { return tree.collides(bbox); });
+}
+
+template <typename Tree> size_t count(const Tree &tree, const rbush::BBox &bbox) {
+    return with_read_lock(tree, [&] { return tree.count(bbox); });
+}
+
+template <typename Tree> size_t size(const Tree &tree) {
+    return with_read_lock(tree, [&] { return tree.size(); });
+}
+
+template <typename Tree> py::tuple search_many(const Tree &tree, const py::object &bboxes) {
+    std::vector<rbush::BBox> queries = to_bbox_vector(bboxes);
+    std::vector<int64_t> offsets;
+    std::vector<int64_t> hits;
+    with_read_lock(tree, [&] {
+        auto result = tree.search_many(queries);
+        offsets.assign(result.first.begin(), result.first.end());
+        hits = to_ids(result.second);
+    });
+    return py::make_tuple(to_array(std::move(offsets)), to_array(std::move(hits)));
+}
+
+// a Python predicate takes the GIL back itself while it is called
+template <typename Tree>
+py::array_t<int64_t> knn(const Tree &tree, double x, double y, size_t k,
+                         std::optional<double> max_distance,
+                         const std::function<bool(const int64_t &)> &predicate) {
+    return to_array(with_read_lock(
+        tree, [&] { return to_ids(tree.knn(x, y, k, max_distance, predicate)); }));
+}
+
+template <typename Tree> py::array_t<int64_t> all(const Tree &tree) {
+    return to_array(with_read_lock(tree, [&] { return to_ids(tree.all()); }));
+}
+
+// the cursor is only used under the lock of its tree as well
+struct SearchIterator {
+    const rbush::IdRBush *tree;
+    rbush::SearchCursor<int64_t> cursor;
+};
+
+template <typename Tree>
+SearchIterator iter_search(const Tree &tree, const rbush::BBox &bbox, size_t chunk_size) {
+    return with_read_lock(tree, [&] {
+        return SearchIterator{&tree, rbush::SearchCursor<int64_t>(tree, bbox, chunk_size)};
+    });
+}
+
+py::array_t<int64_t> next_chunk(SearchIterator &iterator) {
+    std::vector<int64_t> ids =
+        with_read_lock(*iterator.tree, [&] { return to_ids(iterator.cursor.next()); });
+    if (ids.empty())
+        throw py::stop_iteration();
+    return to_array(std::move(ids));
+}
+
+template <typename Tree> py::dict stats(const Tree &tree) {
+    return to_dict(with_read_lock(tree, [&] { return tree.stats(); }));
+}
+
+template <typename Tree> void save(Tree &tree, const std::string &path) {
+    // saving merges the buffered ids into the tree first
+    with_write_lock(tree, [&] { tree.save(path); });
+}
+
+// publishing merges the buffered ids into the tree first, like saving
+template <typename Tree> void publish(Tree &tree, const std::string &name) {
+    with_write_lock(tree, [&] { tree.publish(name); });
+}
+
+template <typename Tree> void load_file(Tree &tree, const std::string &path) {
+    with_write_lock(tree, [&] { tree.load_file(path); });
+}
+
+// The snapshot has a lock of its own, so querying it never waits for the writers of the tree
+template <typename Tree> std::unique_ptr<Tree> snapshot(Tree &tree) {
+    auto result = std::make_unique<Tree>();
+    with_write_lock(tree, [&] { result->snapshot_of(tree); });
+    return result;
+}
+
+// Both trees are read locked, in the order of their addresses so that joins running the other
+// way round can't deadlock with writers waiting on the trees
+template <typename Tree>
+py::array_t<int64_t> join(const Tree &tree, const Tree &other, const std::string &predicate) {
+    const rbush::JoinPredicate join_predicate = to_join_predicate(predicate);
+    std::vector<int64_t> pairs;
+    {
+        py::gil_scoped_release release;
+        const rbush::IdRBush &first = std::less<>()(&tree, &other) ? tree : other;
+        const rbush::IdRBush &second = &first == &tree ? other : tree;
+        std::shared_lock<std::shared_mutex> lock(first.mutex());
+        std::shared_lock<std::shared_mutex> other_lock;
+        if (&second != &first)
+            other_lock = std::shared_lock<std::shared_mutex>(second.mutex());
+
+        auto result = tree.join(other, join_predicate);
+        pairs.reserve(2 * result.size());
+        for (const auto &[id, other_id] : result) {
+            pairs.push_back(id);
+            pairs.push_back(other_id);
+        }
+    }
+    return to_pair_array(std::move(pairs));
+}
+
+} // namespace id_rbush
+
+namespace point_rbush {
+
+// PointRBush locks like IdRBush, with the points given as x, y instead of bboxes
+
+using id_rbush::with_write_lock;
+
+void insert(rbush::PointRBush &tree, int64_t id, double x, double y) {
+    with_write_lock(tree, [&] { tree.insert(id, x, y); });
+}
+
+void remove(rbush::PointRBush &tree, int64_t id, std::optional<double> x,
+            std::optional<double> y) {
+    if (x.has_value() != y.has_value()) {
+        throw py::value_error("x and y must be given together");
+    }
+    std::optional<rbush::BBox> bbox;
+    if (x) {
+        bbox = rbush::BBox(*x, *y, *x, *y);
+    }
+    with_write_lock(tree, [&] { tree.remove(id, bbox); });
+}
+
+size_t remove_many(rbush::PointRBush &tree, const ContiguousArray<int64_t> &ids,
+                   const std::optional<ContiguousArray<double>> &points) {
+    if (ids.ndim() != 1) {
+        throw py::value_error("ids must be a (N,) array");
+    }
+    if (points && (points->ndim() != 2 || points->shape(0) != ids.shape(0) ||
+                   points->shape(1) != 2)) {
+        throw py::value_error("points must be a (N, 2) array with one row per id");
+    }
+    const int64_t *ids_data = ids.data();
+    const double *points_data = points ? points->data() : nullptr;
+    const size_t n = ids.shape(0);
+    return with_write_lock(tree, [&] { return tree.remove_points(ids_data, points_data, n); });
+}
+
+bool update(rbush::PointRBush &tree, int64_t id, double x, double y, std::optional<double> old_x,
+            std::optional<double> old_y, double slack) {
+    if (old_x.has_value() != old_y.has_value()) {
+        throw py::value_error("old_x and old_y must be given together");
+    }
+    std::optional<rbush::BBox> old_bbox;
+    if (old_x) {
+        old_bbox = rbush::BBox(*old_x, *old_y, *old_x, *old_y);
+    }
+    const rbush::BBox bbox(x, y, x, y);
+    return with_write_lock(tree, [&] { return tree.update(id, bbox, old_bbox, slack); });
+}
+
+size_t update_many(rbush::PointRBush &tree, const ContiguousArray<int64_t> &ids,
+                   const ContiguousArray<double> &points,
+                   const std::optional<ContiguousArray<double>> &old_points, double slack) {
+    if (ids.ndim() != 1) {
+        throw py::value_error("ids must be a (N,) array");
+    }
+    if (points.ndim() != 2 || points.shape(0) != ids.shape(0) || points.shape(1) != 2) {
+        throw py::value_error("points must be a (N, 2) array with one row per id");
+    }
+    if (old_points && (old_points->ndim() != 2 || old_points->shape(0) != ids.shape(0) ||
+                       old_points->shape(1) != 2)) {
+        throw py::value_error("old_points must be a (N, 2) array with one row per id");
+    }
+    const int64_t *ids_data = ids.data();
+    const double *points_data = points.data();
+    const double *old_points_data = old_points ? old_points->data() : nullptr;
+    const size_t n = ids.shape(0);
+    return with_write_lock(tree, [&] {
+        return tree.update_points(ids_data, points_data, old_points_data, n, slack);
+    });
+}
+
+void load_arrays(rbush::PointRBush &tree, const ContiguousArray<double> &points,
+                 const std::optional<ContiguousArray<int64_t>> &ids) {
+    if (points.ndim() != 2 || points.shape(1) != 2) {
+        throw py::value_error("points must be a (N, 2) array");
+    }
+    if (ids && (ids->ndim() != 1 || ids->shape(0) != points.shape(0))) {
+        throw py::value_error("ids must be a (N,) array with one id per row of points");
+    }
+    const double *points_data = points.data();
+    const int64_t *ids_data = ids ? ids->data() : nullptr;
+    const size_t n = points.shape(0);
+    with_write_lock(tree, [&] { tree.load_points(points_data, ids_data, n); });
+}
+
+} // namespace point_rbush
+
+namespace mapped_rbush {
+
+// MappedRBush and SharedRBush are never modified, so their methods only need to run without the GIL
+
+template <typename Tree> py::array_t<int64_t> search(const Tree &tree, const rbush::BBox &bbox) {
+    return to_array(without_gil([&] { return tree.search(bbox); }));
+}
+
+template <typename Tree> py::tuple search_many(const Tree &tree, const py::object &bboxes) {
+    std::vector<rbush::BBox> queries = to_bbox_vector(bboxes);
+    auto result = without_gil([&] { return tree.search_many(queries); });
+    return py::make_tuple(to_array(std::move(result.first)), to_array(std::move(result.second)));
+}
+
+template <typename Tree>
+py::array_t<int64_t> knn(const Tree &tree, double x, double y, size_t k,
+                         std::optional<double> max_distance,
+                         const std::function<bool(const int64_t &)> &predicate) {
+    return to_array(without_gil([&] { return tree.knn(x, y, k, max_distance, predicate); }));
+}
+
+template <typename Tree> py::array_t<int64_t> all(const Tree &tree) {
+    return to_array(without_gil([&] { return tree.all(); }));
+}
+
+} // namespace mapped_rbush
+
+namespace static_rbush {
+
+// StaticRBush is never modified either, the GIL is only needed again to look the items up
+
+py::list to_items(const rbush::StaticRBush &tree, const std::vector<uint32_t> &indexes) {
+    py::list result(indexes.size());
+    for (size_t i = 0; i < indexes.size(); ++i) {
+        result[i] = tree.item(indexes[i]);
+    }
+    return result;
+}
+
+py::list search(const rbush::StaticRBush &tree, const rbush::BBox &bbox) {
+    return to_items(tree, without_gil([&] { return tree.search(bbox); }));
+}
+
+py::tuple search_many(const rbush::StaticRBush &tree, const py::object &bboxes) {
+    std::vector<rbush::BBox> queries = to_bbox_vector(bboxes);
+    auto result = without_gil([&] { return tree.search_many(queries); });
+    return py::make_tuple(result.first, to_items(tree, result.second));
+}
+
+py::list knn(const rbush::StaticRBush &tree, double x, double y, size_t k,
+             std::optional<double> max_distance,
+             const std::function<bool(const py::object &)> &predicate) {
+    std::function<bool(uint32_t)> item_predicate;
+    if (predicate) {
+        item_predicate = [&](uint32_t index) {
+            py::gil_scoped_acquire acquire;
+            return predicate(tree.item(index));
+        };
+    }
+    return to_items(tree,
+                    without_gil([&] { return tree.knn(x, y, k, max_distance, item_predicate); }));
+}
+
+py::list all(const rbush::StaticRBush &tree) { return to_items(tree, tree.all()); }
+
+} // namespace static_rbush
+
+} // namespace
+
 PYBIND11_MODULE(_rbush, m) {
     m.doc() = "Internal module for py-rbush";
 
+    // failures of file operations are raised as OSError
+    py::register_exception_translator([](std::exception_ptr error) {
+        try {
+            if (error)
+                std::rethrow_exception(error);
+        } catch (const std::system_error &e) {
+            PyErr_SetString(PyExc_OSError, e.what());
+        }
+    });
+
     py::class_<rbush::BBox>(m, "BBox")
         .def(py::init<>())
         .def(py::init<double, double, double, double>())
@@ -24,34 +565,217 @@ PYBIND11_MODULE(_rbush, m) {
         .def("intersection_area", &rbush::BBox::intersection_area)
         .def("extend", &rbush::BBox::extend);
 
+    py::class_<rbush::BBoxLayout>(m, "BBoxLayout")
+        .def_static("attributes", &rbush::BBoxLayout::attributes, py::arg("min_x") = "min_x",
+                    py::arg("min_y") = "min_y", py::arg("max_x") = "max_x",
+                    py::arg("max_y") = "max_y")
+        .def_static("keys", &rbush::BBoxLayout::items, py::arg("min_x") = "min_x",
+                    py::arg("min_y") = "min_y", py::arg("max_x") = "max_x",
+                    py::arg("max_y") = "max_y")
+        .def_static(
+            "indices",
+            [](py::ssize_t min_x, py::ssize_t min_y, py::ssize_t max_x, py::ssize_t max_y) {
+                return rbush::BBoxLayout::items(py::int_(min_x), py::int_(min_y), py::int_(max_x),
+                                                py::int_(max_y));
+            },
+            py::arg("min_x") = 0, py::arg("min_y") = 1, py::arg("max_x") = 2, py::arg("max_y") = 3)
+        .def_static("struct", &rbush::BBoxLayout::offsets, py::arg("min_x") = 0,
+                    py::arg("min_y") = 8, py::arg("max_x") = 16, py::arg("max_y") = 24);
+
+    bind_search_iterator<py::object>(m, "RBushBaseSearchIterator");
+    bind_search_iterator<py::dict>(m, "RBushSearchIterator");
+    py::class_<id_rbush::SearchIterator>(m, "IdRBushSearchIterator")
+        .def("__iter__", [](py::object self) { return self; })
+        .def("__next__", &id_rbush::next_chunk);
+
     py::class_<rbush::RBushBase<py::object>, rbush::PyRBushBase>(m, "RBushBase")
-        .def(py::init<int>(), py::arg("max_entries") = 9)
+        .def(init_tree<rbush::PyRBushBase, int, bool, std::optional<rbush::BBoxLayout>, size_t>(),
+             py::arg("max_entries") = 9, py::arg("identity_index") = false,
+             py::arg("bbox_layout") = py::none(), py::arg("insert_buffer") = 0,
+             py::arg("insert_strategy") = "rbush", py::arg("compact_bboxes") = false)
         .def("clear", &rbush::RBushBase<py::object>::clear)
+        .def("flush", &rbush::RBushBase<py::object>::flush)
         .def("insert", &rbush::RBushBase<py::object>::insert, py::arg("item"))
         .def("load", &rbush::RBushBase<py::object>::load, py::arg("items"))
         .def("remove", &rbush::RBushBase<py::object>::remove, py::arg("item"),
              py::arg("equals") = nullptr)
+        .def("remove_many", &rbush::RBushBase<py::object>::remove_many, py::arg("items"),
+             py::arg("equals") = nullptr)
+        .def("remove_in", &rbush::RBushBase<py::object>::remove_in, py::arg("bbox"))
+        .def("update", &rbush::RBushBase<py::object>::update, py::arg("item"),
+             py::arg("old_bbox") = py::none(), py::arg("slack") = 0.0)
+        .def("update_many", &rbush::RBushBase<py::object>::update_many, py::arg("items"),
+             py::arg("old_bboxes") = py::none(), py::arg("slack") = 0.0)
+        .def("optimize", &rbush::RBushBase<py::object>::optimize, py::arg("budget"))
         .def("search", &rbush::RBushBase<py::object>::search, py::arg("bbox"))
         .def("collides", &rbush::RBushBase<py::object>::collides, py::arg("bbox"))
+        .def("count", &rbush::RBushBase<py::object>::count, py::arg("bbox"))
+        .def("knn", &rbush::RBushBase<py::object>::knn, py::arg("x"), py::arg("y"), py::arg("k"),
+             py::arg("max_distance") = py::none(), py::arg("predicate") = nullptr)
+        .def("search_many", &search_many<rbush::RBushBase<py::object>>, py::arg("bboxes"))
+        .def("iter_search", &iter_search<rbush::RBushBase<py::object>, py::object>,
+             py::arg("bbox"), py::arg("chunk_size") = 1024, py::keep_alive<0, 1>())
         .def("all", &rbush::RBushBase<py::object>::all)
+        .def("join", &join<rbush::RBushBase<py::object>>, py::arg("other"),
+             py::arg("predicate") = "intersects")
+        .def("stats", &stats<rbush::RBushBase<py::object>>)
         .def("serialize", &rbush::RBushBase<py::object>::serialize)
         .def("deserialize", &rbush::RBushBase<py::object>::deserialize, py::arg("data"))
+        .def("snapshot", &snapshot<rbush::RBushBase<py::object>, rbush::PyRBushBase>)
+        .def("__len__", &rbush::RBushBase<py::object>::size)
         .def("to_bbox", &rbush::RBushBase<py::object>::to_bbox, py::arg("item"));
 
     py::class_<rbush::RBush>(m, "RBush")
-        .def(py::init<int>(), py::arg("max_entries") = 9)
+        .def(init_tree<rbush::RBush, int, bool, size_t>(), py::arg("max_entries") = 9,
+             py::arg("identity_index") = false, py::arg("insert_buffer") = 0,
+             py::arg("insert_strategy") = "rbush", py::arg("compact_bboxes") = false)
         .def("clear", &rbush::RBushBase<py::dict>::clear)
+        .def("flush", &rbush::RBushBase<py::dict>::flush)
         .def("insert", &rbush::RBushBase<py::dict>::insert, py::arg("item"))
         .def("load", &rbush::RBushBase<py::dict>::load, py::arg("items"))
         .def("remove", &rbush::RBushBase<py::dict>::remove, py::arg("item"),
              py::arg("equals") = nullptr)
+        .def("remove_many", &rbush::RBushBase<py::dict>::remove_many, py::arg("items"),
+             py::arg("equals") = nullptr)
+        .def("remove_in", &rbush::RBushBase<py::dict>::remove_in, py::arg("bbox"))
+        .def("update", &rbush::RBushBase<py::dict>::update, py::arg("item"),
+             py::arg("old_bbox") = py::none(), py::arg("slack") = 0.0)
+        .def("update_many", &rbush::RBushBase<py::dict>::update_many, py::arg("items"),
+             py::arg("old_bboxes") = py::none(), py::arg("slack") = 0.0)
+        .def("optimize", &rbush::RBushBase<py::dict>::optimize, py::arg("budget"))
         .def("search", &rbush::RBushBase<py::dict>::search, py::arg("bbox"))
         .def("collides", &rbush::RBushBase<py::dict>::collides, py::arg("bbox"))
+        .def("count", &rbush::RBushBase<py::dict>::count, py::arg("bbox"))
+        .def("knn", &rbush::RBushBase<py::dict>::knn, py::arg("x"), py::arg("y"), py::arg("k"),
+             py::arg("max_distance") = py::none(), py::arg("predicate") = nullptr)
+        .def("search_many", &search_many<rbush::RBush>, py::arg("bboxes"))
+        .def("iter_search", &iter_search<rbush::RBush, py::dict>, py::arg("bbox"),
+             py::arg("chunk_size") = 1024, py::keep_alive<0, 1>())
         .def("all", &rbush::RBushBase<py::dict>::all)
+        .def("join", &join<rbush::RBush>, py::arg("other"), py::arg("predicate") = "intersects")
+        .def("stats", &stats<rbush::RBush>)
         .def("serialize", &rbush::RBushBase<py::dict>::serialize)
         .def("deserialize", &rbush::RBushBase<py::dict>::deserialize, py::arg("data"))
+        .def("snapshot", &snapshot<rbush::RBush>)
+        .def("__len__", &rbush::RBushBase<py::dict>::size)
         .def("to_bbox", &rbush::RBush::to_bbox, py::arg("item"));
 
+    py::class_<rbush::IdRBush>(m, "IdRBush")
+        .def(init_tree<rbush::IdRBush, int, bool, size_t>(), py::arg("max_entries") = 9,
+             py::arg("identity_index") = false, py::arg("insert_buffer") = 0,
+             py::arg("insert_strategy") = "rbush", py::arg("compact_bboxes") = false)
+        .def("clear", &id_rbush::clear<rbush::IdRBush>)
+        .def("flush", &id_rbush::flush<rbush::IdRBush>)
+        .def("insert", &id_rbush::insert, py::arg("id"), py::arg("bbox"))
+        .def("load_arrays", &id_rbush::load_arrays, py::arg("coords"), py::arg("ids") = py::none())
+        .def("remove", &id_rbush::remove, py::arg("id"), py::arg("bbox") = py::none())
+        .def("remove_many", &id_rbush::remove_many, py::arg("ids"), py::arg("coords") = py::none())
+        .def("remove_in", &id_rbush::remove_in<rbush::IdRBush>, py::arg("bbox"))
+        .def("update", &id_rbush::update, py::arg("id"), py::arg("bbox"),
+             py::arg("old_bbox") = py::none(), py::arg("slack") = 0.0)
+        .def("update_many", &id_rbush::update_many, py::arg("ids"), py::arg("coords"),
+             py::arg("old_coords") = py::none(), py::arg("slack") = 0.0)
+        .def("optimize", &id_rbush::optimize<rbush::IdRBush>, py::arg("budget"))
+        .def("search", &id_rbush::search<rbush::IdRBush>, py::arg("bbox"))
+        .def("collides", &id_rbush::collides<rbush::IdRBush>, py::arg("bbox"))
+        .def("count", &id_rbush::count<rbush::IdRBush>, py::arg("bbox"))
+        .def("knn", &id_rbush::knn<rbush::IdRBush>, py::arg("x"), py::arg("y"), py::arg("k"),
+             py::arg("max_distance") = py::none(), py::arg("predicate") = nullptr)
+        .def("search_many", &id_rbush::search_many<rbush::IdRBush>, py::arg("bboxes"))
+        .def("iter_search", &id_rbush::iter_search<rbush::IdRBush>, py::arg("bbox"),
+             py::arg("chunk_size") = 1024, py::keep_alive<0, 1>())
+        .def("all", &id_rbush::all<rbush::IdRBush>)
+        .def("join", &id_rbush::join<rbush::IdRBush>, py::arg("other"),
+             py::arg("predicate") = "intersects")
+        .def("stats", &id_rbush::stats<rbush::IdRBush>)
+        .def("save", &id_rbush::save<rbush::IdRBush>, py::arg("path"))
+        .def("load_file", &id_rbush::load_file<rbush::IdRBush>, py::arg("path"))
+        .def("publish", &id_rbush::publish<rbush::IdRBush>, py::arg("name"))
+        .def("snapshot", &id_rbush::snapshot<rbush::IdRBush>)
+        .def("__len__", &id_rbush::size<rbush::IdRBush>);
+
+    py::class_<rbush::PointRBush>(m, "PointRBush")
+        .def(init_tree<rbush::PointRBush, int, bool, size_t>(), py::arg("max_entries") = 9,
+             py::arg("identity_index") = false, py::arg("insert_buffer") = 0,
+             py::arg("insert_strategy") = "rbush", py::arg("compact_bboxes") = false)
+        .def("clear", &id_rbush::clear<rbush::PointRBush>)
+        .def("flush", &id_rbush::flush<rbush::PointRBush>)
+        .def("insert", &point_rbush::insert, py::arg("id"), py::arg("x"), py::arg("y"))
+        .def("load_arrays", &point_rbush::load_arrays, py::arg("points"),
+             py::arg("ids") = py::none())
+        .def("remove", &point_rbush::remove, py::arg("id"), py::arg("x") = py::none(),
+             py::arg("y") = py::none())
+        .def("remove_many", &point_rbush::remove_many, py::arg("ids"),
+             py::arg("points") = py::none())
+        .def("remove_in", &id_rbush::remove_in<rbush::PointRBush>, py::arg("bbox"))
+        .def("update", &point_rbush::update, py::arg("id"), py::arg("x"), py::arg("y"),
+             py::arg("old_x") = py::none(), py::arg("old_y") = py::none(), py::arg("slack") = 0.0)
+        .def("update_many", &point_rbush::update_many, py::arg("ids"), py::arg("points"),
+             py::arg("old_points") = py::none(), py::arg("slack") = 0.0)
+        .def("optimize", &id_rbush::optimize<rbush::PointRBush>, py::arg("budget"))
+        .def("search", &id_rbush::search<rbush::PointRBush>, py::arg("bbox"))
+        .def("collides", &id_rbush::collides<rbush::PointRBush>, py::arg("bbox"))
+        .def("count", &id_rbush::count<rbush::PointRBush>, py::arg("bbox"))
+        .def("knn", &id_rbush::knn<rbush::PointRBush>, py::arg("x"), py::arg("y"), py::arg("k"),
+             py::arg("max_distance") = py::none(), py::arg("predicate") = nullptr)
+        .def("search_many", &id_rbush::search_many<rbush::PointRBush>, py::arg("bboxes"))
+        .def("iter_search", &id_rbush::iter_search<rbush::PointRBush>, py::arg("bbox"),
+             py::arg("chunk_size") = 1024, py::keep_alive<0, 1>())
+        .def("all", &id_rbush::all<rbush::PointRBush>)
+        .def("join", &id_rbush::join<rbush::PointRBush>, py::arg("other"),
+             py::arg("predicate") = "intersects")
+        .def("stats", &id_rbush::stats<rbush::PointRBush>)
+        .def("save", &id_rbush::save<rbush::PointRBush>, py::arg("path"))
+        .def("load_file", &id_rbush::load_file<rbush::PointRBush>, py::arg("path"))
+        .def("publish", &id_rbush::publish<rbush::PointRBush>, py::arg("name"))
+        .def("snapshot", &id_rbush::snapshot<rbush::PointRBush>)
+        .def("__len__", &id_rbush::size<rbush::PointRBush>);
+
+    py::class_<rbush::MappedRBush>(m, "MappedRBush")
+        .def(py::init<const std::string &>(), py::arg("path"))
+        .def("search", &mapped_rbush::search<rbush::MappedRBush>, py::arg("bbox"))
+        .def("collides", &rbush::FlatTree::collides, py::arg("bbox"),
+             py::call_guard<py::gil_scoped_release>())
+        .def("search_many", &mapped_rbush::search_many<rbush::MappedRBush>, py::arg("bboxes"))
+        .def("knn", &mapped_rbush::knn<rbush::MappedRBush>, py::arg("x"), py::arg("y"),
+             py::arg("k"), py::arg("max_distance") = py::none(), py::arg("predicate") = nullptr)
+        .def("all", &mapped_rbush::all<rbush::MappedRBush>)
+        .def("__len__", &rbush::FlatTree::size);
+
+    py::class_<rbush::SharedRBush>(m, "SharedRBush")
+        .def(py::init<const std::string &>(), py::arg("name"))
+        .def("search", &mapped_rbush::search<rbush::SharedRBush>, py::arg("bbox"))
+        .def("collides", &rbush::FlatTree::collides, py::arg("bbox"),
+             py::call_guard<py::gil_scoped_release>())
+        .def("search_many", &mapped_rbush::search_many<rbush::SharedRBush>, py::arg("bboxes"))
+        .def("knn", &mapped_rbush::knn<rbush::SharedRBush>, py::arg("x"), py::arg("y"),
+             py::arg("k"), py::arg("max_distance") = py::none(), py::arg("predicate") = nullptr)
+        .def("all", &mapped_rbush::all<rbush::SharedRBush>)
+        .def("__len__", &rbush::FlatTree::size)
+        .def_static("unlink", &rbush::unlink_shared, py::arg("name"));
+
+    py::class_<rbush::StaticRBush>(m, "StaticRBush")
+        .def(py::init<std::vector<py::object>, size_t, std::optional<rbush::BBoxLayout>>(),
+             py::arg("items"), py::arg("max_entries") = 16, py::arg("bbox_layout") = py::none())
+        .def("search", &static_rbush::search, py::arg("bbox"))
+        .def("collides", &rbush::StaticRBush::collides, py::arg("bbox"),
+             py::call_guard<py::gil_scoped_release>())
+        .def("search_many", &static_rbush::search_many, py::arg("bboxes"))
+        .def("knn", &static_rbush::knn, py::arg("x"), py::arg("y"), py::arg("k"),
+             py::arg("max_distance") = py::none(), py::arg("predicate") = nullptr)
+        .def("all", &static_rbush::all)
+        .def("__len__", &rbush::StaticRBush::size);
+
+    m.def(
+        "set_num_threads",
+        [](size_t num_threads) { rbush::ThreadPool::get_instance().resize(num_threads); },
+        py::arg("num_threads"), py::call_guard<py::gil_scoped_release>());
+    m.def("get_num_threads", []() { return rbush::ThreadPool::get_instance().size(); });
+
+    m.def("get_metrics", &get_metrics);
+    m.def("reset_metrics", &rbush::metrics::reset);
+    m.def("set_metrics_enabled", &rbush::metrics::set_enabled, py::arg("enabled"));
+
 #ifdef RBUSH_DEBUG
     m.def(
         "get_avg_time",
@@ -0,0 +1,297 @@
+#include "packed.h"
+#include "debug.h"
+#include "simd.h"
+#include "thread_pool.h"
+#include <queue>
+#include <stdexcept>
+
+namespace rbush {
+
+namespace {
+
+// Position of the point (x, y) of a 65536 x 65536 grid along the Hilbert curve, using the
+// branchless algorithm of http://threadlocalmutex.com/?p=126
+uint32_t hilbert(uint32_t x, uint32_t y) {
+    uint32_t a = x ^ y;
+    uint32_t b = 0xFFFF ^ a;
+    uint32_t c = 0xFFFF ^ (x | y);
+    uint32_t d = x & (y ^ 0xFFFF);
+
+    uint32_t A = a | (b >> 1);
+    uint32_t B = (a >> 1) ^ a;
+    uint32_t C = ((c >> 1) ^ (b & (d >> 1))) ^ c;
+    uint32_t D = ((a & (c >> 1)) ^ (d >> 1)) ^ d;
+
+    a = A;
+    b = B;
+    c = C;
+    d = D;
+    A = (a & (a >> 2)) ^ (b & (b >> 2));
+    B = (a & (b >> 2)) ^ (b & ((a ^ b) >> 2));
+    C ^= (a & (c >> 2)) ^ (b & (d >> 2));
+    D ^= (b & (c >> 2)) ^ ((a ^ b) & (d >> 2));
+
+    a = A;
+    b = B;
+    c = C;
+    d = D;
+    A = (a & (a >> 4)) ^ (b & (b >> 4));
+    B = (a & (b >> 4)) ^ (b & ((a ^ b) >> 4));
+    C ^= (a & (c >> 4)) ^ (b & (d >> 4));
+    D ^= (b & (c >> 4)) ^ ((a ^ b) & (d >> 4));
+
+    a = A;
+    b = B;
+    c = C;
+    d = D;
+    C ^= (a & (c >> 8)) ^ (b & (d >> 8));
+    D ^= (b & (c >> 8)) ^ ((a ^ b) & (d >> 8));
+
+    a = C ^ (C >> 1);
+    b = D ^ (D >> 1);
+
+    uint32_t i0 = x ^ y;
+    uint32_t i1 = b | (0xFFFF ^ (i0 | a));
+
+    i0 = (i0 | (i0 << 8)) & 0x00FF00FF;
+    i0 = (i0 | (i0 << 4)) & 0x0F0F0F0F;
+    i0 = (i0 | (i0 << 2)) & 0x33333333;
+    i0 = (i0 | (i0 << 1)) & 0x55555555;
+
+    i1 = (i1 | (i1 << 8)) & 0x00FF00FF;
+    i1 = (i1 | (i1 << 4)) & 0x0F0F0F0F;
+    i1 = (i1 | (i1 << 2)) & 0x33333333;
+    i1 = (i1 | (i1 << 1)) & 0x55555555;
+
+    return (i1 << 1) | i0;
+}
+
+// Grid cell of the center of bbox along one axis of extent [min, max]
+uint32_t grid_cell(double min, double max, double bbox_min, double bbox_max) {
+    if (!(max > min))
+        return 0;
+    const double cell = 0xFFFF * ((bbox_min + bbox_max) / 2 - min) / (max - min);
+    // also maps NaN to the first cell
+    return cell > 0 ? static_cast<uint32_t>(std::min(cell, 65535.0)) : 0;
+}
+
+} // namespace
+
+// PackedIndex implementation
+
+PackedIndex::PackedIndex(const std::vector<BBox> &bboxes, size_t node_size)
+    : _node_size((std::max<size_t>(node_size, 2) + simd::WIDTH - 1) / simd::WIDTH * simd::WIDTH) {
+    DEBUG_TIMER("packed_build");
+    if (bboxes.size() > std::numeric_limits<uint32_t>::max())
+        throw std::invalid_argument("too many items for a static index");
+    if (bboxes.empty())
+        return;
+
+    BBox extent;
+    for (const BBox &bbox : bboxes) {
+        extent.extend(bbox);
+    }
+
+    // sort by Hilbert value then by index, both packed into one key
+    std::vector<uint64_t> keys(bboxes.size());
+    for (size_t i = 0; i < bboxes.size(); ++i) {
+        const BBox &bbox = bboxes[i];
+        const uint32_t x = grid_cell(extent.min_x, extent.max_x, bbox.min_x, bbox.max_x);
+        const uint32_t y = grid_cell(extent.min_y, extent.max_y, bbox.min_y, bbox.max_y);
+        keys[i] = static_cast<uint64_t>(hilbert(x, y)) << 32 | i;
+    }
+    std::sort(keys.begin(), keys.end());
+
+    _order.reserve(keys.size());
+    BBoxArray entries;
+    entries.reserve(keys.size());
+    for (uint64_t key : keys) {
+        _order.emplace_back(static_cast<uint32_t>(key));
+        entries.push_back(bboxes[_order.back()]);
+    }
+    _levels.emplace_back(std::move(entries));
+
+    // every node but the last of a level is full
+    while (_levels.back().size() > 1) {
+        const BBoxArray &children = _levels.back();
+        BBoxArray nodes;
+        nodes.reserve((children.size() + _node_size - 1) / _node_size);
+        for (size_t begin = 0; begin < children.size(); begin += _node_size) {
+            const size_t end = std::min(begin + _node_size, children.size());
+            BBox bbox;
+            for (size_t i = begin; i < end; ++i) {
+                bbox.extend(children[i]);
+            }
+            nodes.push_back(bbox);
+        }
+        _levels.emplace_back(std::move(nodes));
+    }
+}
+
+std::vector<uint32_t> PackedIndex::search(const BBox &bbox) const {
+    DEBUG_TIMER("packed_search");
+    std::vector<uint32_t> result;
+    if (_levels.empty() || !bbox.intersects(_levels.back()[0]))
+        return result;
+
+    std::vector<uint32_t> hits(_node_size);
+    std::vector<std::pair<size_t, size_t>> nodes_to_search{{_levels.size() - 1, 0}};
+    while (!nodes_to_search.empty()) {
+        const auto [level, index] = nodes_to_search.back();
+        nodes_to_search.pop_back();
+        if (level == 0) {
+            // only reached when the root is the single entry
+            result.emplace_back(_order[index]);
+            continue;
+        }
+
+        const BBoxArray &children = _levels[level - 1];
+        const size_t begin = index * _node_size;
+        const size_t end = std::min(begin + _node_size, children.size());
+        const size_t num_hits = children.intersecting(bbox, begin, end, hits.data());
+        for (size_t i = 0; i < num_hits; ++i) {
+            const size_t child = begin + hits[i];
+            if (level == 1) {
+                result.emplace_back(_order[child]);
+            } else if (bbox.contains(children[child])) {
+                _all(level - 1, child, result);
+            } else {
+                nodes_to_search.emplace_back(level - 1, child);
+            }
+        }
+    }
+    return result;
+}
+
+bool PackedIndex::collides(const BBox &bbox) const {
+    DEBUG_TIMER("packed_collides");
+    if (_levels.empty() || !bbox.intersects(_levels.back()[0]))
+        return false;
+
+    std::vector<uint32_t> hits(_node_size);
+    std::vector<std::pair<size_t, size_t>> nodes_to_search{{_levels.size() - 1, 0}};
+    while (!nodes_to_search.empty()) {
+        const auto [level, index] = nodes_to_search.back();
+        nodes_to_search.pop_back();
+        if (level == 0)
+            return true;
+
+        const BBoxArray &children = _levels[level - 1];
+        const size_t begin = index * _node_size;
+        const size_t end = std::min(begin + _node_size, children.size());
+        const size_t num_hits = children.intersecting(bbox, begin, end, hits.data());
+        if (level == 1 && num_hits > 0)
+            return true;
+        for (size_t i = 0; i < num_hits; ++i) {
+            const size_t child = begin + hits[i];
+            if (bbox.contains(children[child]))
+                return true;
+            nodes_to_search.emplace_back(level - 1, child);
+        }
+    }
+    return false;
+}
+
+std::pair<std::vector<size_t>, std::vector<uint32_t>>
+PackedIndex::search_many(const std::vector<BBox> &bboxes) const {
+    DEBUG_TIMER("packed_search_many");
+    std::vector<std::vector<uint32_t>> results(bboxes.size());
+    ThreadPool::get_instance().parallel_for(bboxes.size(), [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            results[i] = search(bboxes[i]);
+        }
+    });
+
+    std::vector<size_t> offsets;
+    offsets.reserve(bboxes.size() + 1);
+    offsets.push_back(0);
+    for (const auto &result : results) {
+        offsets.push_back(offsets.back() + result.size());
+    }
+    std::vector<uint32_t> hits;
+    hits.reserve(offsets.back());
+    for (const auto &result : results) {
+        hits.insert(hits.end(), result.begin(), result.end());
+    }
+    return {std::move(offsets), std::move(hits)};
+}
+
+// Same best-first traversal as RBushBase::knn, with the entries of the first level as items
+std::vector<uint32_t> PackedIndex::knn(double x, double y, size_t k,
+                                       std::optional<double> max_distance,
+                                       const std::function<bool(uint32_t)> &predicate) const {
+    DEBUG_TIMER("packed_knn");
+    std::vector<uint32_t> result;
+    if (_levels.empty() || k == 0 || (max_distance && *max_distance < 0))
+        return result;
+    const double max_dist_sq =
+        max_distance ? *max_distance * *max_distance : std::numeric_limits<double>::infinity();
+
+    struct Candidate {
+        double dist_sq;
+        size_t level;
+        size_t index;
+
+        bool operator>(const Candidate &other) const { return dist_sq > other.dist_sq; }
+    };
+    std::priority_queue<Candidate, std::vector<Candidate>, std::greater<Candidate>> queue;
+
+    const double root_dist_sq = _levels.back()[0].dist_sq(x, y);
+    if (root_dist_sq <= max_dist_sq)
+        queue.push({root_dist_sq, _levels.size() - 1, 0});
+    while (!queue.empty()) {
+        const Candidate candidate = queue.top();
+        queue.pop();
+        if (candidate.level == 0) {
+            const uint32_t item = _order[candidate.index];
+            if (!predicate || predicate(item)) {
+                result.emplace_back(item);
+                if (result.size() == k)
+                    break;
+            }
+            continue;
+        }
+
+        const BBoxArray &children = _levels[candidate.level - 1];
+        const size_t begin = candidate.index * _node_size;
+        const size_t end = std::min(begin + _node_size, children.size());
+        for (size_t i = begin; i < end; ++i) {
+            const double child_dist_sq = children[i].dist_sq(x, y);
+            if (child_dist_sq <= max_dist_sq)
+                queue.push({child_dist_sq, candidate.level - 1, i});
+        }
+    }
+    return result;
+}
+
+// The entries under a node are consecutive, node_size^level of them from index * node_size^level
+void PackedIndex::_all(size_t level, size_t index, std::vector<uint32_t> &result) const {
+    size_t span = 1;
+    for (size_t i = 0; i < level; ++i) {
+        span *= _node_size;
+    }
+    const size_t begin = index * span;
+    const size_t end = std::min(begin + span, _order.size());
+    result.insert(result.end(), _order.begin() + begin, _order.begin() + end);
+}
+
+// StaticRBush implementation
+
+StaticRBush::StaticRBush(std::vector<py::object> items, size_t max_entries,
+                         const std::optional<BBoxLayout> &bbox_layout)
+    : PackedIndex(_bboxes(items, bbox_layout), max_entries), _items(std::move(items)) {}
+
+std::vector<BBox> StaticRBush::_bboxes(const std::vector<py::object> &items,
+                                       const std::optional<BBoxLayout> &bbox_layout) {
+    // the items are dicts like those of RBush unless told otherwise
+    const BBoxLayout layout = bbox_layout.value_or(BBoxLayout::items(
+        py::str("min_x"), py::str("min_y"), py::str("max_x"), py::str("max_y")));
+    std::vector<BBox> bboxes;
+    bboxes.reserve(items.size());
+    for (const py::object &item : items) {
+        bboxes.emplace_back(layout.get(item));
+    }
+    return bboxes;
+}
+
+} // namespace rbush
@@ -0,0 +1,58 @@
+#ifndef PACKED_H_
+#define PACKED_H_
+
+#include "_rbush.h"
+#include <functional>
+
+namespace rbush {
+
+// Immutable R-tree whose entries are sorted along the Hilbert curve and packed into full nodes.
+// Each level is a single BBoxArray, from the entries up to the root, and the children of the j-th
+// node of a level are the boxes from j * node_size on of the level below, so the tree is walked
+// with index arithmetic instead of pointers
+class PackedIndex {
+public:
+    // node_size is rounded up to a multiple of simd::WIDTH so that every node starts aligned
+    explicit PackedIndex(const std::vector<BBox> &bboxes, size_t node_size = 16);
+
+    size_t size() const { return _order.size(); }
+    size_t node_size() const { return _node_size; }
+
+    // the results are indexes of the bboxes given to the constructor
+    std::vector<uint32_t> search(const BBox &bbox) const;
+    bool collides(const BBox &bbox) const;
+    std::pair<std::vector<size_t>, std::vector<uint32_t>>
+    search_many(const std::vector<BBox> &bboxes) const;
+    std::vector<uint32_t> knn(double x, double y, size_t k,
+                              std::optional<double> max_distance = std::nullopt,
+                              const std::function<bool(uint32_t)> &predicate = nullptr) const;
+    std::vector<uint32_t> all() const { return _order; }
+
+private:
+    size_t _node_size;
+    // the i-th entry of the first level is the _order[i]-th bbox given to the constructor
+    std::vector<uint32_t> _order;
+    std::vector<BBoxArray> _levels;
+
+    void _all(size_t level, size_t index, std::vector<uint32_t> &result) const;
+};
+
+// PackedIndex of Python items, built from the same items as RBushBase.load with their bboxes read
+// through a BBoxLayout
+class StaticRBush : public PackedIndex {
+public:
+    StaticRBush(std::vector<py::object> items, size_t max_entries,
+                const std::optional<BBoxLayout> &bbox_layout);
+
+    const py::object &item(uint32_t index) const { return _items[index]; }
+
+private:
+    std::vector<py::object> _items;
+
+    static std::vector<BBox> _bboxes(const std::vector<py::object> &items,
+                                     const std::optional<BBoxLayout> &bbox_layout);
+};
+
+} // namespace rbush
+
+#endif // PACKED_H_
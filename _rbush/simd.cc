@@ -0,0 +1,353 @@
+#include "simd.h"
+#include <algorithm>
+#include <limits>
+
+#if !defined(RBUSH_NO_SIMD) && defined(__GNUC__) && defined(__x86_64__)
+#define RBUSH_SIMD_X86
+#include <immintrin.h>
+#endif
+
+namespace rbush {
+namespace simd {
+
+namespace {
+
+template <typename Coord>
+using IntersectingFn = size_t (*)(const Coord *, const Coord *, const Coord *, const Coord *,
+                                  size_t, double, double, double, double, uint32_t *);
+using PointsWithinFn = size_t (*)(const double *, const double *, size_t, double, double, double,
+                                  double, uint32_t *);
+template <typename Coord>
+using LeastEnlargementFn = size_t (*)(const Coord *, const Coord *, const Coord *, const Coord *,
+                                      size_t, double, double, double, double);
+
+// Picks the best candidate the same way a sequential scan would, so every kernel chooses the same
+// box as the scalar implementation
+struct EnlargementSelector {
+    double min_area = std::numeric_limits<double>::infinity();
+    double min_enlargement = std::numeric_limits<double>::infinity();
+    size_t index = 0;
+
+    void update(size_t i, double area, double enlargement) {
+        if (enlargement < min_enlargement) {
+            min_area = std::min(min_area, area);
+            min_enlargement = enlargement;
+            index = i;
+        } else if (enlargement == min_enlargement && area < min_area) {
+            min_area = area;
+            index = i;
+        }
+    }
+};
+
+#ifndef RBUSH_SIMD_X86
+
+// Scalar implementation
+
+template <typename Coord>
+size_t intersecting_scalar(const Coord *min_x, const Coord *min_y, const Coord *max_x,
+                           const Coord *max_y, size_t n, double query_min_x, double query_min_y,
+                           double query_max_x, double query_max_y, uint32_t *out) {
+    size_t count = 0;
+    for (size_t i = 0; i < n; ++i) {
+        if (query_min_x <= max_x[i] && query_min_y <= max_y[i] && query_max_x >= min_x[i] &&
+            query_max_y >= min_y[i]) {
+            out[count++] = i;
+        }
+    }
+    return count;
+}
+
+size_t points_within_scalar(const double *x, const double *y, size_t n, double query_min_x,
+                            double query_min_y, double query_max_x, double query_max_y,
+                            uint32_t *out) {
+    size_t count = 0;
+    for (size_t i = 0; i < n; ++i) {
+        if (query_min_x <= x[i] && query_min_y <= y[i] && query_max_x >= x[i] &&
+            query_max_y >= y[i]) {
+            out[count++] = i;
+        }
+    }
+    return count;
+}
+
+template <typename Coord>
+size_t least_enlargement_scalar(const Coord *min_x, const Coord *min_y, const Coord *max_x,
+                                const Coord *max_y, size_t n, double query_min_x,
+                                double query_min_y, double query_max_x, double query_max_y) {
+    EnlargementSelector selector;
+    for (size_t i = 0; i < n; ++i) {
+        const double c_min_x = min_x[i];
+        const double c_min_y = min_y[i];
+        const double c_max_x = max_x[i];
+        const double c_max_y = max_y[i];
+        double area = (c_max_x - c_min_x) * (c_max_y - c_min_y);
+        double enlarged_area = (std::max(query_max_x, c_max_x) - std::min(query_min_x, c_min_x)) *
+                               (std::max(query_max_y, c_max_y) - std::min(query_min_y, c_min_y));
+        selector.update(i, area, enlarged_area - area);
+    }
+    return selector.index;
+}
+
+#else
+
+// writes the indexes of the set bits of mask, offset by base
+inline size_t append_mask(unsigned mask, size_t base, uint32_t *out) {
+    size_t count = 0;
+    while (mask) {
+        out[count++] = base + __builtin_ctz(mask);
+        mask &= mask - 1;
+    }
+    return count;
+}
+
+// SSE2 implementation, always available on x86-64
+
+inline __m128d load2(const double *p) { return _mm_load_pd(p); }
+inline __m128d load2(const float *p) {
+    return _mm_cvtps_pd(_mm_castsi128_ps(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(p))));
+}
+
+template <typename Coord>
+size_t intersecting_sse2(const Coord *min_x, const Coord *min_y, const Coord *max_x,
+                         const Coord *max_y, size_t n, double query_min_x, double query_min_y,
+                         double query_max_x, double query_max_y, uint32_t *out) {
+    const __m128d q_min_x = _mm_set1_pd(query_min_x);
+    const __m128d q_min_y = _mm_set1_pd(query_min_y);
+    const __m128d q_max_x = _mm_set1_pd(query_max_x);
+    const __m128d q_max_y = _mm_set1_pd(query_max_y);
+    size_t count = 0;
+    for (size_t i = 0; i < n; i += 2) {
+        __m128d hit = _mm_and_pd(_mm_cmple_pd(q_min_x, load2(max_x + i)),
+                                 _mm_cmple_pd(q_min_y, load2(max_y + i)));
+        hit = _mm_and_pd(hit, _mm_cmpge_pd(q_max_x, load2(min_x + i)));
+        hit = _mm_and_pd(hit, _mm_cmpge_pd(q_max_y, load2(min_y + i)));
+        unsigned mask = _mm_movemask_pd(hit);
+        if (n - i < 2)
+            mask &= (1u << (n - i)) - 1;
+        count += append_mask(mask, i, out + count);
+    }
+    return count;
+}
+
+// the two loads of a point are compared against both sides of the query instead of the four loads
+// of a box
+size_t points_within_sse2(const double *x, const double *y, size_t n, double query_min_x,
+                          double query_min_y, double query_max_x, double query_max_y,
+                          uint32_t *out) {
+    const __m128d q_min_x = _mm_set1_pd(query_min_x);
+    const __m128d q_min_y = _mm_set1_pd(query_min_y);
+    const __m128d q_max_x = _mm_set1_pd(query_max_x);
+    const __m128d q_max_y = _mm_set1_pd(query_max_y);
+    size_t count = 0;
+    for (size_t i = 0; i < n; i += 2) {
+        const __m128d p_x = _mm_load_pd(x + i);
+        const __m128d p_y = _mm_load_pd(y + i);
+        __m128d hit = _mm_and_pd(_mm_cmple_pd(q_min_x, p_x), _mm_cmple_pd(q_min_y, p_y));
+        hit = _mm_and_pd(hit, _mm_cmpge_pd(q_max_x, p_x));
+        hit = _mm_and_pd(hit, _mm_cmpge_pd(q_max_y, p_y));
+        unsigned mask = _mm_movemask_pd(hit);
+        if (n - i < 2)
+            mask &= (1u << (n - i)) - 1;
+        count += append_mask(mask, i, out + count);
+    }
+    return count;
+}
+
+template <typename Coord>
+size_t least_enlargement_sse2(const Coord *min_x, const Coord *min_y, const Coord *max_x,
+                              const Coord *max_y, size_t n, double query_min_x,
+                              double query_min_y, double query_max_x, double query_max_y) {
+    EnlargementSelector selector;
+    alignas(16) double areas[2];
+    alignas(16) double enlargements[2];
+    const __m128d q_min_x = _mm_set1_pd(query_min_x);
+    const __m128d q_min_y = _mm_set1_pd(query_min_y);
+    const __m128d q_max_x = _mm_set1_pd(query_max_x);
+    const __m128d q_max_y = _mm_set1_pd(query_max_y);
+    for (size_t i = 0; i < n; i += 2) {
+        const __m128d c_min_x = load2(min_x + i);
+        const __m128d c_min_y = load2(min_y + i);
+        const __m128d c_max_x = load2(max_x + i);
+        const __m128d c_max_y = load2(max_y + i);
+        const __m128d area =
+            _mm_mul_pd(_mm_sub_pd(c_max_x, c_min_x), _mm_sub_pd(c_max_y, c_min_y));
+        // operand order matches std::max/std::min of the scalar version, including for NaN
+        const __m128d enlarged_area =
+            _mm_mul_pd(_mm_sub_pd(_mm_max_pd(c_max_x, q_max_x), _mm_min_pd(c_min_x, q_min_x)),
+                       _mm_sub_pd(_mm_max_pd(c_max_y, q_max_y), _mm_min_pd(c_min_y, q_min_y)));
+        _mm_store_pd(areas, area);
+        _mm_store_pd(enlargements, _mm_sub_pd(enlarged_area, area));
+        for (size_t j = 0; j < 2 && i + j < n; ++j) {
+            selector.update(i + j, areas[j], enlargements[j]);
+        }
+    }
+    return selector.index;
+}
+
+// AVX2 implementation, selected at runtime when the CPU supports it
+
+__attribute__((target("avx2"))) inline __m256d load4(const double *p) {
+    return _mm256_load_pd(p);
+}
+__attribute__((target("avx2"))) inline __m256d load4(const float *p) {
+    return _mm256_cvtps_pd(_mm_load_ps(p));
+}
+
+template <typename Coord>
+__attribute__((target("avx2"))) size_t
+intersecting_avx2(const Coord *min_x, const Coord *min_y, const Coord *max_x, const Coord *max_y,
+                  size_t n, double query_min_x, double query_min_y, double query_max_x,
+                  double query_max_y, uint32_t *out) {
+    const __m256d q_min_x = _mm256_set1_pd(query_min_x);
+    const __m256d q_min_y = _mm256_set1_pd(query_min_y);
+    const __m256d q_max_x = _mm256_set1_pd(query_max_x);
+    const __m256d q_max_y = _mm256_set1_pd(query_max_y);
+    size_t count = 0;
+    for (size_t i = 0; i < n; i += 4) {
+        __m256d hit = _mm256_and_pd(_mm256_cmp_pd(q_min_x, load4(max_x + i), _CMP_LE_OQ),
+                                    _mm256_cmp_pd(q_min_y, load4(max_y + i), _CMP_LE_OQ));
+        hit = _mm256_and_pd(hit, _mm256_cmp_pd(q_max_x, load4(min_x + i), _CMP_GE_OQ));
+        hit = _mm256_and_pd(hit, _mm256_cmp_pd(q_max_y, load4(min_y + i), _CMP_GE_OQ));
+        unsigned mask = _mm256_movemask_pd(hit);
+        if (n - i < 4)
+            mask &= (1u << (n - i)) - 1;
+        count += append_mask(mask, i, out + count);
+    }
+    return count;
+}
+
+__attribute__((target("avx2"))) size_t points_within_avx2(const double *x, const double *y,
+                                                          size_t n, double query_min_x,
+                                                          double query_min_y, double query_max_x,
+                                                          double query_max_y, uint32_t *out) {
+    const __m256d q_min_x = _mm256_set1_pd(query_min_x);
+    const __m256d q_min_y = _mm256_set1_pd(query_min_y);
+    const __m256d q_max_x = _mm256_set1_pd(query_max_x);
+    const __m256d q_max_y = _mm256_set1_pd(query_max_y);
+    size_t count = 0;
+    for (size_t i = 0; i < n; i += 4) {
+        const __m256d p_x = _mm256_load_pd(x + i);
+        const __m256d p_y = _mm256_load_pd(y + i);
+        __m256d hit = _mm256_and_pd(_mm256_cmp_pd(q_min_x, p_x, _CMP_LE_OQ),
+                                    _mm256_cmp_pd(q_min_y, p_y, _CMP_LE_OQ));
+        hit = _mm256_and_pd(hit, _mm256_cmp_pd(q_max_x, p_x, _CMP_GE_OQ));
+        hit = _mm256_and_pd(hit, _mm256_cmp_pd(q_max_y, p_y, _CMP_GE_OQ));
+        unsigned mask = _mm256_movemask_pd(hit);
+        if (n - i < 4)
+            mask &= (1u << (n - i)) - 1;
+        count += append_mask(mask, i, out + count);
+    }
+    return count;
+}
+
+template <typename Coord>
+__attribute__((target("avx2"))) size_t
+least_enlargement_avx2(const Coord *min_x, const Coord *min_y, const Coord *max_x,
+                       const Coord *max_y, size_t n, double query_min_x, double query_min_y,
+                       double query_max_x, double query_max_y) {
+    EnlargementSelector selector;
+    alignas(32) double areas[4];
+    alignas(32) double enlargements[4];
+    const __m256d q_min_x = _mm256_set1_pd(query_min_x);
+    const __m256d q_min_y = _mm256_set1_pd(query_min_y);
+    const __m256d q_max_x = _mm256_set1_pd(query_max_x);
+    const __m256d q_max_y = _mm256_set1_pd(query_max_y);
+    for (size_t i = 0; i < n; i += 4) {
+        const __m256d c_min_x = load4(min_x + i);
+        const __m256d c_min_y = load4(min_y + i);
+        const __m256d c_max_x = load4(max_x + i);
+        const __m256d c_max_y = load4(max_y + i);
+        const __m256d area =
+            _mm256_mul_pd(_mm256_sub_pd(c_max_x, c_min_x), _mm256_sub_pd(c_max_y, c_min_y));
+        // operand order matches std::max/std::min of the scalar version, including for NaN
+        const __m256d enlarged_area = _mm256_mul_pd(
+            _mm256_sub_pd(_mm256_max_pd(c_max_x, q_max_x), _mm256_min_pd(c_min_x, q_min_x)),
+            _mm256_sub_pd(_mm256_max_pd(c_max_y, q_max_y), _mm256_min_pd(c_min_y, q_min_y)));
+        _mm256_store_pd(areas, area);
+        _mm256_store_pd(enlargements, _mm256_sub_pd(enlarged_area, area));
+        for (size_t j = 0; j < 4 && i + j < n; ++j) {
+            selector.update(i + j, areas[j], enlargements[j]);
+        }
+    }
+    return selector.index;
+}
+
+#endif // RBUSH_SIMD_X86
+
+template <typename Coord> IntersectingFn<Coord> select_intersecting() {
+#ifdef RBUSH_SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return intersecting_avx2<Coord>;
+    return intersecting_sse2<Coord>;
+#else
+    return intersecting_scalar<Coord>;
+#endif
+}
+
+PointsWithinFn select_points_within() {
+#ifdef RBUSH_SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return points_within_avx2;
+    return points_within_sse2;
+#else
+    return points_within_scalar;
+#endif
+}
+
+template <typename Coord> LeastEnlargementFn<Coord> select_least_enlargement() {
+#ifdef RBUSH_SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return least_enlargement_avx2<Coord>;
+    return least_enlargement_sse2<Coord>;
+#else
+    return least_enlargement_scalar<Coord>;
+#endif
+}
+
+const IntersectingFn<double> intersecting_impl = select_intersecting<double>();
+const IntersectingFn<float> intersecting_float_impl = select_intersecting<float>();
+const PointsWithinFn points_within_impl = select_points_within();
+const LeastEnlargementFn<double> least_enlargement_impl = select_least_enlargement<double>();
+const LeastEnlargementFn<float> least_enlargement_float_impl = select_least_enlargement<float>();
+
+} // namespace
+
+size_t intersecting(const double *min_x, const double *min_y, const double *max_x,
+                    const double *max_y, size_t n, double query_min_x, double query_min_y,
+                    double query_max_x, double query_max_y, uint32_t *out) {
+    return intersecting_impl(min_x, min_y, max_x, max_y, n, query_min_x, query_min_y, query_max_x,
+                             query_max_y, out);
+}
+
+size_t intersecting(const float *min_x, const float *min_y, const float *max_x, const float *max_y,
+                    size_t n, double query_min_x, double query_min_y, double query_max_x,
+                    double query_max_y, uint32_t *out) {
+    return intersecting_float_impl(min_x, min_y, max_x, max_y, n, query_min_x, query_min_y,
+                                   query_max_x, query_max_y, out);
+}
+
+size_t points_within(const double *x, const double *y, size_t n, double query_min_x,
+                     double query_min_y, double query_max_x, double query_max_y, uint32_t *out) {
+    return points_within_impl(x, y, n, query_min_x, query_min_y, query_max_x, query_max_y, out);
+}
+
+size_t least_enlargement(const double *min_x, const double *min_y, const double *max_x,
+                         const double *max_y, size_t n, double query_min_x, double query_min_y,
+                         double query_max_x, double query_max_y) {
+    return least_enlargement_impl(min_x, min_y, max_x, max_y, n, query_min_x, query_min_y,
+                                  query_max_x, query_max_y);
+}
+
+size_t least_enlargement(const float *min_x, const float *min_y, const float *max_x,
+                         const float *max_y, size_t n, double query_min_x, double query_min_y,
+                         double query_max_x, double query_max_y) {
+    return least_enlargement_float_impl(min_x, min_y, max_x, max_y, n, query_min_x, query_min_y,
+                                        query_max_x, query_max_y);
+}
+
+} // namespace simd
+} // namespace rbush
@@ -0,0 +1,41 @@
+#ifndef SIMD_H_
+#define SIMD_H_
+
+#include <cstddef>
+#include <cstdint>
+
+namespace rbush {
+namespace simd {
+
+// Number of coordinates processed at once by the widest kernel, the coordinate arrays passed to the
+// kernels must be aligned to that many coordinates and readable up to n rounded up to a multiple of
+// it. Every kernel also takes float coordinates, which are compared as the doubles they convert to
+constexpr size_t WIDTH = 4;
+
+// Writes the indexes of the boxes intersecting the query box to out in ascending order and
+// returns how many were written
+size_t intersecting(const double *min_x, const double *min_y, const double *max_x,
+                    const double *max_y, size_t n, double query_min_x, double query_min_y,
+                    double query_max_x, double query_max_y, uint32_t *out);
+size_t intersecting(const float *min_x, const float *min_y, const float *max_x, const float *max_y,
+                    size_t n, double query_min_x, double query_min_y, double query_max_x,
+                    double query_max_y, uint32_t *out);
+
+// Writes the indexes of the points within the query box to out in ascending order and returns how
+// many were written
+size_t points_within(const double *x, const double *y, size_t n, double query_min_x,
+                     double query_min_y, double query_max_x, double query_max_y, uint32_t *out);
+
+// Returns the index of the first box that needs the least enlargement to include the query box,
+// resolving ties by the smallest area, or 0 if no enlargement compares less than infinity
+size_t least_enlargement(const double *min_x, const double *min_y, const double *max_x,
+                         const double *max_y, size_t n, double query_min_x, double query_min_y,
+                         double query_max_x, double query_max_y);
+size_t least_enlargement(const float *min_x, const float *min_y, const float *max_x,
+                         const float *max_y, size_t n, double query_min_x, double query_min_y,
+                         double query_max_x, double query_max_y);
+
+} // namespace simd
+} // namespace rbush
+
+#endif // SIMD_H_
@@ -0,0 +1,132 @@
+#include "thread_pool.h"
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <memory>
+
+namespace rbush {
+
+// ThreadPool implementation
+
+ThreadPool::ThreadPool(size_t num_threads) { _start_workers(num_threads); }
+
+ThreadPool::~ThreadPool() { _stop_workers(); }
+
+ThreadPool &ThreadPool::get_instance() {
+    static ThreadPool instance;
+    return instance;
+}
+
+// parallel_for keeps working meanwhile since its caller runs the chunks left in the queue
+void ThreadPool::resize(size_t num_threads) {
+    std::lock_guard<std::mutex> lock(_resize_mutex);
+    _stop_workers();
+    _start_workers(num_threads);
+}
+
+void ThreadPool::_start_workers(size_t num_threads) {
+    if (num_threads == 0)
+        num_threads = std::max(1u, std::thread::hardware_concurrency());
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stop = false;
+    }
+    // the thread calling parallel_for works as well, so one less worker is enough
+    for (size_t i = 1; i < num_threads; ++i) {
+        _threads.emplace_back(&ThreadPool::_worker, this);
+    }
+    _size = num_threads;
+}
+
+void ThreadPool::_stop_workers() {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stop = true;
+    }
+    _condition.notify_all();
+    for (auto &thread : _threads) {
+        thread.join();
+    }
+    _threads.clear();
+}
+
+void ThreadPool::parallel_for(size_t n, const std::function<void(size_t, size_t)> &fn) {
+    if (n == 0)
+        return;
+    // a few chunks per thread keeps the threads busy when the chunks take uneven time
+    const size_t num_chunks = std::min(n, size() * 4);
+    if (num_chunks == 1) {
+        fn(0, n);
+        return;
+    }
+
+    struct State {
+        std::atomic<size_t> remaining;
+        std::exception_ptr error;
+        std::mutex mutex;
+        std::condition_variable done;
+    };
+    auto state = std::make_shared<State>();
+    state->remaining = num_chunks;
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        for (size_t chunk = 0; chunk < num_chunks; ++chunk) {
+            const size_t begin = n * chunk / num_chunks;
+            const size_t end = n * (chunk + 1) / num_chunks;
+            _tasks.emplace_back([state, &fn, begin, end] {
+                try {
+                    fn(begin, end);
+                } catch (...) {
+                    std::lock_guard<std::mutex> lock(state->mutex);
+                    if (!state->error)
+                        state->error = std::current_exception();
+                }
+                if (--state->remaining == 0) {
+                    std::lock_guard<std::mutex> lock(state->mutex);
+                    state->done.notify_all();
+                }
+            });
+        }
+    }
+    _condition.notify_all();
+
+    while (state->remaining > 0 && _run_pending_task()) {
+    }
+    {
+        std::unique_lock<std::mutex> lock(state->mutex);
+        state->done.wait(lock, [&state] { return state->remaining == 0; });
+    }
+    if (state->error)
+        std::rethrow_exception(state->error);
+}
+
+void ThreadPool::_worker() {
+    while (true) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _condition.wait(lock, [this] { return _stop || !_tasks.empty(); });
+            if (_stop && _tasks.empty())
+                return;
+            task = std::move(_tasks.front());
+            _tasks.pop_front();
+        }
+        task();
+    }
+}
+
+bool ThreadPool::_run_pending_task() {
+    std::function<void()> task;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_tasks.empty())
+            return false;
+        task = std::move(_tasks.front());
+        _tasks.pop_front();
+    }
+    task();
+    return true;
+}
+
+} // namespace rbush
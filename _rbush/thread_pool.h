@@ -0,0 +1,51 @@
+#ifndef THREAD_POOL_H_
+#define THREAD_POOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace rbush {
+
+// Fixed set of worker threads running the chunks of parallel loops
+class ThreadPool {
+public:
+    explicit ThreadPool(size_t num_threads = 0);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    static ThreadPool &get_instance();
+
+    size_t size() const { return _size; }
+    // Replaces the workers once they finish the queued chunks, 0 threads meaning one per core
+    void resize(size_t num_threads);
+
+    // Calls fn(begin, end) on consecutive chunks of [0, n) in parallel and returns once all of them
+    // are done, the calling thread runs chunks too so parallel loops can be nested
+    void parallel_for(size_t n, const std::function<void(size_t, size_t)> &fn);
+
+private:
+    std::vector<std::thread> _threads;
+    std::atomic<size_t> _size{1};
+    std::deque<std::function<void()>> _tasks;
+    std::mutex _mutex;
+    std::mutex _resize_mutex;
+    std::condition_variable _condition;
+    bool _stop = false;
+
+    void _start_workers(size_t num_threads);
+    void _stop_workers();
+    void _worker();
+    bool _run_pending_task();
+};
+
+} // namespace rbush
+
+#endif // THREAD_POOL_H_
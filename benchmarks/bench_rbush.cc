@@ -0,0 +1,502 @@
+// Benchmark of the tree itself, driving IdRBush from C++ so that the time of the bindings is left
+// out. Every dataset is run for every max_entries, and each measure is printed as a JSON object on
+// its own line: the dataset, max_entries, the operation, the number of operations, the best time
+// per operation over the repeats, the tree nodes visited per operation by queries and a result
+// (hits, size...) that must not change between commits. benchmarks/compare.py diffs two such
+// outputs.
+//
+// Usage: bench_rbush [--items N] [--queries N] [--repeat N] [--seed N]
+//                    [--max-entries 4,9,16,32] [--datasets uniform,clustered,...]
+
+#include <pybind11/embed.h>
+
+#include "_rbush.h"
+#include "flat.h"
+#include "metrics.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <limits>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace py = pybind11;
+
+namespace {
+
+using rbush::BBox;
+using rbush::IdRBush;
+using rbush::InsertStrategy;
+using rbush::PointRBush;
+using rbush::SharedRBush;
+
+// Side of the square space holding the data, as in performance.py
+constexpr double WORLD = 100;
+constexpr double PI = 3.14159265358979323846;
+
+struct Options {
+    size_t items = 100'000;
+    size_t queries = 1000;
+    size_t repeat = 3;
+    uint64_t seed = 42;
+    std::vector<size_t> max_entries{4, 9, 16, 32};
+    std::vector<std::string> datasets{"uniform", "clustered", "skewed", "lines", "points"};
+};
+
+std::vector<std::string> split(const std::string &list) {
+    std::vector<std::string> result;
+    std::stringstream stream(list);
+    std::string value;
+    while (std::getline(stream, value, ',')) {
+        result.emplace_back(value);
+    }
+    return result;
+}
+
+Options parse_options(int argc, char **argv) {
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        if (i + 1 == argc)
+            throw std::invalid_argument("missing value for " + arg);
+        const std::string value = argv[++i];
+        if (arg == "--items") {
+            options.items = std::stoul(value);
+        } else if (arg == "--queries") {
+            options.queries = std::stoul(value);
+        } else if (arg == "--repeat") {
+            options.repeat = std::max<size_t>(std::stoul(value), 1);
+        } else if (arg == "--seed") {
+            options.seed = std::stoull(value);
+        } else if (arg == "--max-entries") {
+            options.max_entries.clear();
+            for (const std::string &max_entries : split(value)) {
+                options.max_entries.emplace_back(std::stoul(max_entries));
+            }
+        } else if (arg == "--datasets") {
+            options.datasets = split(value);
+        } else {
+            throw std::invalid_argument("unknown option " + arg);
+        }
+    }
+    if (options.items == 0)
+        throw std::invalid_argument("--items must be positive");
+    return options;
+}
+
+// Datasets, as rows of min_x, min_y, max_x, max_y like IdRBush::load_arrays takes
+
+using Coords = std::vector<double>;
+
+void push_bbox(Coords &coords, double min_x, double min_y, double max_x, double max_y) {
+    coords.insert(coords.end(), {min_x, min_y, max_x, max_y});
+}
+
+// random boxes of up to 1 x 1 spread over the whole space
+Coords uniform(size_t n, std::mt19937_64 &rng) {
+    std::uniform_real_distribution<double> position(0, WORLD - 1);
+    std::uniform_real_distribution<double> size(0, 1);
+    Coords coords;
+    for (size_t i = 0; i < n; ++i) {
+        const double x = position(rng);
+        const double y = position(rng);
+        push_bbox(coords, x, y, x + size(rng), y + size(rng));
+    }
+    return coords;
+}
+
+// small boxes around the centers of a hundred Gaussian blobs, like buildings in towns
+Coords clustered(size_t n, std::mt19937_64 &rng) {
+    std::uniform_real_distribution<double> center(0, WORLD);
+    std::vector<std::pair<double, double>> centers(100);
+    for (auto &[x, y] : centers) {
+        x = center(rng);
+        y = center(rng);
+    }
+    std::uniform_int_distribution<size_t> blob(0, centers.size() - 1);
+    std::normal_distribution<double> offset(0, 1.5);
+    std::uniform_real_distribution<double> size(0, 0.2);
+    Coords coords;
+    for (size_t i = 0; i < n; ++i) {
+        const auto [center_x, center_y] = centers[blob(rng)];
+        const double x = center_x + offset(rng);
+        const double y = center_y + offset(rng);
+        push_bbox(coords, x, y, x + size(rng), y + size(rng));
+    }
+    return coords;
+}
+
+// boxes crowded in a corner of the space, with sizes spanning several orders of magnitude
+Coords skewed(size_t n, std::mt19937_64 &rng) {
+    std::uniform_real_distribution<double> uniform(0, 1);
+    std::lognormal_distribution<double> size(-4, 1.5);
+    Coords coords;
+    for (size_t i = 0; i < n; ++i) {
+        const double x = WORLD * std::pow(uniform(rng), 4);
+        const double y = WORLD * std::pow(uniform(rng), 4);
+        push_bbox(coords, x, y, x + std::min(size(rng), 10.0), y + std::min(size(rng), 10.0));
+    }
+    return coords;
+}
+
+// bboxes of the segments of random walks, long and thin like those of roads
+Coords lines(size_t n, std::mt19937_64 &rng) {
+    std::uniform_real_distribution<double> position(0, WORLD);
+    std::uniform_real_distribution<double> heading(0, 2 * PI);
+    std::normal_distribution<double> turn(0, 0.3);
+    std::uniform_real_distribution<double> length(0.05, 0.5);
+    Coords coords;
+    double x = 0, y = 0, angle = 0;
+    for (size_t i = 0; i < n; ++i) {
+        // a new road every 100 segments
+        if (i % 100 == 0) {
+            x = position(rng);
+            y = position(rng);
+            angle = heading(rng);
+        }
+        angle += turn(rng);
+        const double step = length(rng);
+        const double next_x = std::clamp(x + step * std::cos(angle), 0.0, WORLD);
+        const double next_y = std::clamp(y + step * std::sin(angle), 0.0, WORLD);
+        push_bbox(coords, std::min(x, next_x), std::min(y, next_y), std::max(x, next_x),
+                  std::max(y, next_y));
+        x = next_x;
+        y = next_y;
+    }
+    return coords;
+}
+
+Coords points(size_t n, std::mt19937_64 &rng) {
+    std::uniform_real_distribution<double> position(0, WORLD);
+    Coords coords;
+    for (size_t i = 0; i < n; ++i) {
+        const double x = position(rng);
+        const double y = position(rng);
+        push_bbox(coords, x, y, x, y);
+    }
+    return coords;
+}
+
+Coords make_dataset(const std::string &name, size_t n, std::mt19937_64 &rng) {
+    if (name == "uniform")
+        return uniform(n, rng);
+    if (name == "clustered")
+        return clustered(n, rng);
+    if (name == "skewed")
+        return skewed(n, rng);
+    if (name == "lines")
+        return lines(n, rng);
+    if (name == "points")
+        return points(n, rng);
+    throw std::invalid_argument("unknown dataset " + name);
+}
+
+BBox row(const Coords &coords, size_t i) {
+    return BBox(coords[4 * i], coords[4 * i + 1], coords[4 * i + 2], coords[4 * i + 3]);
+}
+
+// Square queries covering the given fraction of the space, centered on items so that they follow
+// the distribution of the data
+std::vector<BBox> make_queries(const Coords &coords, size_t n, double selectivity,
+                               std::mt19937_64 &rng) {
+    const double half_side = WORLD * std::sqrt(selectivity) / 2;
+    std::uniform_int_distribution<size_t> item(0, coords.size() / 4 - 1);
+    std::vector<BBox> queries;
+    queries.reserve(n);
+    for (size_t i = 0; i < n; ++i) {
+        const BBox bbox = row(coords, item(rng));
+        const double x = (bbox.min_x + bbox.max_x) / 2;
+        const double y = (bbox.min_y + bbox.max_y) / 2;
+        queries.emplace_back(x - half_side, y - half_side, x + half_side, y + half_side);
+    }
+    return queries;
+}
+
+// Measures
+
+struct Measure {
+    std::string op;
+    size_t ops;
+    double best_ns = std::numeric_limits<double>::infinity();
+    double nodes_per_op = 0;
+    size_t result = 0;
+};
+
+// nodes whose children were tested by all the queries so far
+uint64_t nodes_visited() {
+    uint64_t nodes = 0;
+    for (const rbush::metrics::OpMetrics &op : rbush::metrics::snapshot()) {
+        nodes += op.work.nodes_visited;
+    }
+    return nodes;
+}
+
+class Bench {
+public:
+    Bench(std::string dataset, size_t max_entries)
+        : _dataset(std::move(dataset)), _max_entries(max_entries) {}
+
+    // runs fn, which performs ops operations and returns its result, keeping the best time
+    void run(const std::string &op, size_t ops, const std::function<size_t()> &fn) {
+        auto it = std::find_if(_measures.begin(), _measures.end(),
+                               [&](const Measure &measure) { return measure.op == op; });
+        if (it == _measures.end()) {
+            _measures.push_back({op, ops});
+            it = _measures.end() - 1;
+        }
+        const uint64_t nodes_before = nodes_visited();
+        const auto start = std::chrono::steady_clock::now();
+        it->result = fn();
+        const auto end = std::chrono::steady_clock::now();
+        const double ns = std::chrono::duration<double, std::nano>(end - start).count();
+        it->best_ns = std::min(it->best_ns, ns / std::max<size_t>(ops, 1));
+        it->nodes_per_op =
+            static_cast<double>(nodes_visited() - nodes_before) / std::max<size_t>(ops, 1);
+    }
+
+    void print(size_t items) const {
+        for (const Measure &measure : _measures) {
+            std::printf("{\"dataset\": \"%s\", \"max_entries\": %zu, \"items\": %zu, "
+                        "\"op\": \"%s\", \"ops\": %zu, \"ns_per_op\": %.1f, "
+                        "\"nodes_per_op\": %.1f, \"result\": %zu}\n",
+                        _dataset.c_str(), _max_entries, items, measure.op.c_str(), measure.ops,
+                        measure.best_ns, measure.nodes_per_op, measure.result);
+        }
+        std::fflush(stdout);
+    }
+
+private:
+    std::string _dataset;
+    size_t _max_entries;
+    std::vector<Measure> _measures;
+};
+
+// selectivity of the searches, as a fraction of the space covered by a query
+const std::vector<std::pair<std::string, double>> SELECTIVITIES{
+    {"0.01%", 0.0001}, {"1%", 0.01}, {"10%", 0.1}};
+
+void run_dataset(const Options &options, const std::string &name, size_t max_entries) {
+    std::mt19937_64 rng(options.seed);
+    const Coords coords = make_dataset(name, options.items, rng);
+    const size_t n = coords.size() / 4;
+    std::vector<std::vector<BBox>> queries;
+    for (const auto &selectivity : SELECTIVITIES) {
+        queries.emplace_back(make_queries(coords, options.queries, selectivity.second, rng));
+    }
+    // every tenth item is moved a little, like a vehicle between two updates, then removed
+    std::vector<int64_t> removed_ids;
+    std::vector<double> removed_coords;
+    Coords moved_coords;
+    std::uniform_real_distribution<double> step(-0.05, 0.05);
+    for (size_t i = 0; i < n; i += 10) {
+        removed_ids.emplace_back(static_cast<int64_t>(i));
+        removed_coords.insert(removed_coords.end(), coords.begin() + 4 * i,
+                              coords.begin() + 4 * i + 4);
+        const double dx = step(rng);
+        const double dy = step(rng);
+        push_bbox(moved_coords, coords[4 * i] + dx, coords[4 * i + 1] + dy,
+                  coords[4 * i + 2] + dx, coords[4 * i + 3] + dy);
+    }
+    const std::string path = "bench_rbush_" + name + ".bin";
+    const std::string shared_name = "/bench_rbush_" + name;
+
+    Bench bench(name, max_entries);
+    for (size_t r = 0; r < options.repeat; ++r) {
+        IdRBush inserted(max_entries);
+        bench.run("insert", n, [&] {
+            for (size_t i = 0; i < n; ++i) {
+                inserted.insert(static_cast<int64_t>(i), row(coords, i));
+            }
+            return inserted.size();
+        });
+
+        // the R* strategy, to be compared with the default one on the queries below
+        IdRBush inserted_rstar(max_entries, false, 0, InsertStrategy::RSTAR);
+        bench.run("insert rstar", n, [&] {
+            for (size_t i = 0; i < n; ++i) {
+                inserted_rstar.insert(static_cast<int64_t>(i), row(coords, i));
+            }
+            return inserted_rstar.size();
+        });
+
+        IdRBush buffered(max_entries, false, 1024);
+        bench.run("insert buffered", n, [&] {
+            for (size_t i = 0; i < n; ++i) {
+                buffered.insert(static_cast<int64_t>(i), row(coords, i));
+            }
+            buffered.flush();
+            return buffered.size();
+        });
+
+        IdRBush tree(max_entries);
+        bench.run("load", n, [&] {
+            tree.load_arrays(coords.data(), nullptr, n);
+            return tree.size();
+        });
+
+        for (size_t q = 0; q < SELECTIVITIES.size(); ++q) {
+            bench.run("search " + SELECTIVITIES[q].first, queries[q].size(), [&] {
+                size_t hits = 0;
+                for (const BBox &bbox : queries[q]) {
+                    hits += tree.search(bbox).size();
+                }
+                return hits;
+            });
+        }
+        // the same tree with the bboxes of the children of its internal nodes in floats
+        IdRBush compact(max_entries, false, 0, InsertStrategy::RBUSH, true);
+        bench.run("load compact", n, [&] {
+            compact.load_arrays(coords.data(), nullptr, n);
+            return compact.size();
+        });
+        for (size_t q = 0; q < SELECTIVITIES.size(); ++q) {
+            bench.run("search compact " + SELECTIVITIES[q].first, queries[q].size(), [&] {
+                size_t hits = 0;
+                for (const BBox &bbox : queries[q]) {
+                    hits += compact.search(bbox).size();
+                }
+                return hits;
+            });
+        }
+        if (name == "points") {
+            // the same points in a tree keeping two coordinates per item in its leaves
+            std::vector<double> xy;
+            xy.reserve(2 * n);
+            for (size_t i = 0; i < n; ++i) {
+                xy.push_back(coords[4 * i]);
+                xy.push_back(coords[4 * i + 1]);
+            }
+            PointRBush point_tree(max_entries);
+            bench.run("load point", n, [&] {
+                point_tree.load_points(xy.data(), nullptr, n);
+                return point_tree.size();
+            });
+            for (size_t q = 0; q < SELECTIVITIES.size(); ++q) {
+                bench.run("search point " + SELECTIVITIES[q].first, queries[q].size(), [&] {
+                    size_t hits = 0;
+                    for (const BBox &bbox : queries[q]) {
+                        hits += point_tree.search(bbox).size();
+                    }
+                    return hits;
+                });
+            }
+        }
+        bench.run("search inserted 1%", queries[1].size(), [&] {
+            size_t hits = 0;
+            for (const BBox &bbox : queries[1]) {
+                hits += inserted.search(bbox).size();
+            }
+            return hits;
+        });
+        bench.run("search inserted rstar 1%", queries[1].size(), [&] {
+            size_t hits = 0;
+            for (const BBox &bbox : queries[1]) {
+                hits += inserted_rstar.search(bbox).size();
+            }
+            return hits;
+        });
+        bench.run("collides 0.01%", queries[0].size(), [&] {
+            size_t collisions = 0;
+            for (const BBox &bbox : queries[0]) {
+                collisions += tree.collides(bbox);
+            }
+            return collisions;
+        });
+
+        {
+            // serialize builds Python objects, so it needs the GIL
+            py::gil_scoped_acquire gil;
+            bench.run("serialize", 1, [&] {
+                tree.serialize();
+                return tree.size();
+            });
+        }
+        bench.run("save", 1, [&] {
+            tree.save(path);
+            return tree.size();
+        });
+        bench.run("publish", 1, [&] {
+            tree.publish(shared_name);
+            return tree.size();
+        });
+        {
+            // the segment stays mapped once its name is removed
+            const SharedRBush shared(shared_name);
+            rbush::unlink_shared(shared_name);
+            bench.run("search shared 1%", queries[1].size(), [&] {
+                size_t hits = 0;
+                for (const BBox &bbox : queries[1]) {
+                    hits += shared.search(bbox).size();
+                }
+                return hits;
+            });
+        }
+
+        // moved there and back, so that the items are where the removes expect them
+        bench.run("update", removed_ids.size(), [&] {
+            for (size_t i = 0; i < removed_ids.size(); ++i) {
+                tree.update(removed_ids[i], row(moved_coords, i), row(removed_coords, i), 0);
+            }
+            return tree.size();
+        });
+        bench.run("update_many", removed_ids.size(), [&] {
+            return tree.update_many(removed_ids.data(), removed_coords.data(),
+                                    moved_coords.data(), removed_ids.size(), 0);
+        });
+
+        bench.run("remove", removed_ids.size(), [&] {
+            for (size_t i = 0; i < removed_ids.size(); ++i) {
+                tree.remove(removed_ids[i], row(removed_coords, i));
+            }
+            return tree.size();
+        });
+        bench.run("remove_many", removed_ids.size(), [&] {
+            return inserted.remove_many(removed_ids.data(), removed_coords.data(),
+                                        removed_ids.size());
+        });
+
+        // the tree built one item at a time and worn by the removes, repacked a slice per call
+        bench.run("optimize", inserted.size(), [&] {
+            size_t repacked = 0;
+            while (const size_t items = inserted.optimize(10000)) {
+                repacked += items;
+            }
+            return repacked;
+        });
+        bench.run("search optimized 1%", queries[1].size(), [&] {
+            size_t hits = 0;
+            for (const BBox &bbox : queries[1]) {
+                hits += inserted.search(bbox).size();
+            }
+            return hits;
+        });
+    }
+    std::remove(path.c_str());
+    bench.print(n);
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    try {
+        const Options options = parse_options(argc, argv);
+        py::scoped_interpreter interpreter;
+        // the tree runs without the GIL as it does behind the bindings
+        py::gil_scoped_release no_gil;
+        for (const std::string &dataset : options.datasets) {
+            for (size_t max_entries : options.max_entries) {
+                run_dataset(options, dataset, max_entries);
+            }
+        }
+    } catch (const std::exception &e) {
+        std::fprintf(stderr, "bench_rbush: %s\n", e.what());
+        return 1;
+    }
+    return 0;
+}
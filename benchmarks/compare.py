@@ -0,0 +1,47 @@
+"""Compares two outputs of bench_rbush, e.g. of the base and the head of a branch.
+
+Usage: python benchmarks/compare.py old.jsonl new.jsonl
+"""
+
+from __future__ import annotations
+
+import json
+import sys
+
+
+def read_results(path: str) -> dict[tuple, dict]:
+    with open(path) as f:
+        results = (json.loads(line) for line in f if line.strip())
+        return {(r["dataset"], r["max_entries"], r["items"], r["op"]): r for r in results}
+
+
+def main() -> int:
+    if len(sys.argv) != 3:
+        print(__doc__.strip().splitlines()[-1], file=sys.stderr)
+        return 2
+    old = read_results(sys.argv[1])
+    new = read_results(sys.argv[2])
+
+    mismatches = 0
+    print(
+        f"{'dataset':<10} {'M':>3} {'op':<26} {'old ns/op':>12} {'new ns/op':>12} {'ratio':>7} "
+        f"{'old nodes':>10} {'new nodes':>10}"
+    )
+    for key in [key for key in old if key in new]:
+        dataset, max_entries, _, op = key
+        before, after = old[key], new[key]
+        ratio = after["ns_per_op"] / before["ns_per_op"] if before["ns_per_op"] else float("nan")
+        # the results only depend on the data, so a change means a behavior change
+        flag = "  result changed!" if before["result"] != after["result"] else ""
+        mismatches += bool(flag)
+        # nodes visited per operation, only measured for queries and by later versions
+        nodes = [r.get("nodes_per_op", 0) for r in (before, after)]
+        print(
+            f"{dataset:<10} {max_entries:>3} {op:<26} {before['ns_per_op']:>12.1f} "
+            f"{after['ns_per_op']:>12.1f} {ratio:>7.2f} {nodes[0]:>10.1f} {nodes[1]:>10.1f}{flag}"
+        )
+    return 1 if mismatches else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
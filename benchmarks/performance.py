@@ -1,12 +1,27 @@
 from __future__ import annotations
 
 import math
+import multiprocessing
 import random
+import resource
+import sys
 import time
 from functools import wraps
 
 from rbush import BBox
+from rbush import BBoxLayout
+from rbush import IdRBush
+from rbush import PointRBush
 from rbush import RBush
+from rbush import RBushBase
+from rbush import StaticRBush
+from rbush import get_num_threads
+from rbush import set_num_threads
+
+try:
+    import numpy as np
+except ImportError:
+    np = None
 
 try:
     import rbush.debug as dbg
@@ -20,6 +35,7 @@ NUM_ITEMS = 1_000_000
 MAX_FILL = 16
 SEARCH_COUNT = 1000
 REMOVE_COUNT = 1000
+INSERT_BUFFER = 10_000
 
 
 def benchmark(description: str, cpp_lookup_method: str):
@@ -47,6 +63,54 @@ def benchmark(description: str, cpp_lookup_method: str):
 
 
 # Helper functions
+def peak_rss() -> int:
+    rss = resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+    # ru_maxrss is reported in bytes on macOS and in kilobytes on Linux
+    return rss if sys.platform == "darwin" else rss * 1024
+
+
+def current_rss() -> int:
+    # read from /proc where there is one, the peak is the closest elsewhere
+    try:
+        with open("/proc/self/statm") as statm:
+            return int(statm.read().split()[1]) * resource.getpagesize()
+    except OSError:
+        return peak_rss()
+
+
+def print_memory_per_entry(description: str, rss_before: int, num_items: int) -> None:
+    print(f"{description}: {(peak_rss() - rss_before) / num_items:.1f} bytes per entry")
+    print()
+
+
+def loaded_memory(tree_type: type, coords: np.ndarray) -> int:
+    rss_before = current_rss()
+    tree = tree_type(MAX_FILL)
+    tree.load_arrays(coords)
+    return current_rss() - rss_before
+
+
+def print_loaded_memory_per_entry(tree_type: type, coords: np.ndarray) -> None:
+    # measured in a new process, which can't reuse the memory freed by the other benchmarks, and
+    # from the memory in use after the load, which leaves out what the load only needs meanwhile
+    with multiprocessing.get_context("spawn").Pool(1) as pool:
+        memory = pool.apply(loaded_memory, (tree_type, coords))
+    print(
+        f"Memory of a {tree_type.__name__} of {len(coords)} items bulk loaded: "
+        f"{memory / len(coords):.1f} bytes per entry"
+    )
+    print()
+
+
+def print_tree_stats(description: str, tree: RBush) -> None:
+    stats = tree.stats()
+    print(
+        f"{description}: height {stats['height']}, {stats['nodes']} nodes, "
+        f"overlap {stats['overlap']:.1f}, dead space {stats['dead_space']:.1f}"
+    )
+    print()
+
+
 def rand_dict(size: float) -> dict[str, float]:
     x = random.random() * (100 - size)
     y = random.random() * (100 - size)
@@ -72,12 +136,31 @@ def insert_data(tree: RBush) -> None:
         tree.insert(item)
 
 
+@benchmark(f"Insert {NUM_ITEMS} items one by one through a buffer of {INSERT_BUFFER}", "insert")
+def insert_data_buffered(tree: RBush) -> None:
+    for item in DATA:
+        tree.insert(item)
+    tree.flush()
+
+
 @benchmark(f"Search {SEARCH_COUNT} items with 10% overlap", "search")
 def search_bbox100(tree: RBush) -> None:
     for box in BBOX_100:
         tree.search(box)
 
 
+@benchmark(f"First 100 hits of {SEARCH_COUNT} searches with 10% overlap", "iter_search")
+def iter_search_bbox100(tree: RBush) -> None:
+    for box in BBOX_100:
+        next(tree.iter_search(box, chunk_size=100))
+
+
+@benchmark(f"Count {SEARCH_COUNT} items with 10% overlap", "count")
+def count_bbox100(tree: RBush) -> None:
+    for box in BBOX_100:
+        tree.count(box)
+
+
 @benchmark(f"Search {SEARCH_COUNT} items with 1% overlap", "search")
 def search_bbox10(tree: RBush) -> None:
     for box in BBOX_10:
@@ -90,17 +173,59 @@ def search_bbox1(tree: RBush) -> None:
         tree.search(box)
 
 
+@benchmark(f"Search {SEARCH_COUNT} items with 1% overlap in one batch", "search_many")
+def search_many_bbox10(tree: RBush) -> None:
+    tree.search_many(BBOX_10)
+
+
+@benchmark(f"Join with a tree of {SEARCH_COUNT} items with 0.01% overlap", "join")
+def join_zones(tree: RBush) -> None:
+    zones = RBush(MAX_FILL)
+    zones.load(ZONES)
+    tree.join(zones)
+
+
 @benchmark(f"Remove {REMOVE_COUNT} items one by one", "remove")
 def remove_data(tree: RBush) -> None:
     for i in range(REMOVE_COUNT):
         tree.remove(DATA[i])
 
 
+@benchmark(f"Remove {REMOVE_COUNT} more items in one batch", "remove_many")
+def remove_many_data(tree: RBush) -> None:
+    tree.remove_many(DATA[REMOVE_COUNT : 2 * REMOVE_COUNT])
+
+
 @benchmark(f"Bulk insert {NUM_ITEMS} items more items", "load")
 def bulk_insert_data2(tree: RBush) -> None:
     tree.load(DATA2)
 
 
+@benchmark(f"Bulk load {NUM_ITEMS} items into an empty tree", "load")
+def bulk_load_data(tree: RBush) -> None:
+    tree.load(DATA)
+
+
+@benchmark(f"Bulk load {NUM_ITEMS} tuples into an empty tree with a bbox layout", "load")
+def bulk_load_tuples(tree: RBushBase) -> None:
+    tree.load(TUPLES)
+
+
+@benchmark(f"Bulk load {NUM_ITEMS} items into an empty tree from an array", "load_arrays")
+def bulk_load_arrays(tree: IdRBush) -> None:
+    tree.load_arrays(COORDS)
+
+
+@benchmark(f"Bulk load {NUM_ITEMS} items from an array on 1 thread", "load_arrays")
+def bulk_load_arrays_one_thread(tree: IdRBush) -> None:
+    num_threads = get_num_threads()
+    set_num_threads(1)
+    try:
+        tree.load_arrays(COORDS)
+    finally:
+        set_num_threads(num_threads)
+
+
 @benchmark(f"Search {SEARCH_COUNT} items with 1% overlap again", "search")
 def search_bbox10_again(tree: RBush) -> None:
     for box in BBOX_10:
@@ -113,6 +238,29 @@ def search_bbox1_again(tree: RBush) -> None:
         tree.search(box)
 
 
+@benchmark(f"Build a static tree of {NUM_ITEMS} items", "packed_build")
+def build_static(items: list[dict[str, float]]) -> StaticRBush:
+    return StaticRBush(items, MAX_FILL)
+
+
+@benchmark(f"Search {SEARCH_COUNT} items with 10% overlap in a static tree", "packed_search")
+def static_search_bbox100(tree: StaticRBush) -> None:
+    for box in BBOX_100:
+        tree.search(box)
+
+
+@benchmark(f"Search {SEARCH_COUNT} items with 1% overlap in a static tree", "packed_search")
+def static_search_bbox10(tree: StaticRBush) -> None:
+    for box in BBOX_10:
+        tree.search(box)
+
+
+@benchmark(f"Search {SEARCH_COUNT} items with 0.01% overlap in a static tree", "packed_search")
+def static_search_bbox1(tree: StaticRBush) -> None:
+    for box in BBOX_1:
+        tree.search(box)
+
+
 def main():
     print(f"Number of items: {NUM_ITEMS}")
     print(f"Max fill: {MAX_FILL}")
@@ -120,14 +268,41 @@ def main():
 
     tree = RBush(MAX_FILL)
 
+    rss_before = peak_rss()
     insert_data(tree)
+    print_memory_per_entry(
+        f"Memory of {NUM_ITEMS} items inserted one by one", rss_before, NUM_ITEMS
+    )
+    print_tree_stats(f"Tree of {NUM_ITEMS} items inserted one by one", tree)
     search_bbox100(tree)
+    iter_search_bbox100(tree)
+    count_bbox100(tree)
     search_bbox10(tree)
     search_bbox1(tree)
+    search_many_bbox10(tree)
+    join_zones(tree)
     remove_data(tree)
+    remove_many_data(tree)
+    rss_before = peak_rss()
     bulk_insert_data2(tree)
+    print_memory_per_entry(f"Memory of {NUM_ITEMS} items bulk inserted", rss_before, NUM_ITEMS)
+    print_tree_stats(f"Tree after bulk inserting {NUM_ITEMS} more items", tree)
     search_bbox10_again(tree)
     search_bbox1_again(tree)
+    rss_before = peak_rss()
+    static_tree = build_static(DATA)
+    print_memory_per_entry(f"Memory of a static tree of {NUM_ITEMS} items", rss_before, NUM_ITEMS)
+    static_search_bbox100(static_tree)
+    static_search_bbox10(static_tree)
+    static_search_bbox1(static_tree)
+    insert_data_buffered(RBush(MAX_FILL, insert_buffer=INSERT_BUFFER))
+    bulk_load_data(RBush(MAX_FILL))
+    bulk_load_tuples(RBushBase(MAX_FILL, bbox_layout=BBoxLayout.indices()))
+    if np is not None:
+        bulk_load_arrays(IdRBush(MAX_FILL))
+        bulk_load_arrays_one_thread(IdRBush(MAX_FILL))
+        print_loaded_memory_per_entry(IdRBush, COORDS)
+        print_loaded_memory_per_entry(PointRBush, POINTS)
 
 
 if __name__ == "__main__":
@@ -135,5 +310,12 @@ if __name__ == "__main__":
     DATA2 = gen_data(NUM_ITEMS, 1)
     BBOX_100 = list(map(to_bbox, gen_data(SEARCH_COUNT, 100 * math.sqrt(0.1))))
     BBOX_10 = list(map(to_bbox, gen_data(SEARCH_COUNT, 10)))
-    BBOX_1 = list(map(to_bbox, gen_data(SEARCH_COUNT, 1)))
+    ZONES = gen_data(SEARCH_COUNT, 1)
+    BBOX_1 = list(map(to_bbox, ZONES))
+    TUPLES = [(d["min_x"], d["min_y"], d["max_x"], d["max_y"]) for d in DATA]
+    if np is not None:
+        COORDS = np.array(
+            [(d["min_x"], d["min_y"], d["max_x"], d["max_y"]) for d in DATA], dtype=np.float64
+        )
+        POINTS = np.ascontiguousarray(COORDS[:, :2])
     main()
@@ -12,13 +12,33 @@ def build(setup_kwargs: dict):
     copmile_args = ["-O2", "-Wall", "-Wextra", "-Werror"]
     if os.environ.get("RBUSH_DEBUG"):
         copmile_args.extend(["-g", "-DRBUSH_DEBUG"])
+    if os.environ.get("RBUSH_NO_SIMD"):
+        copmile_args.append("-DRBUSH_NO_SIMD")
 
     ext_modules = [
         Pybind11Extension(
             "_rbush",
-            sources=["_rbush/module.cc", "_rbush/_rbush.cc"],
-            depends=["_rbush/_rbush.h", "_rbush/debug.h"],
+            sources=[
+                "_rbush/module.cc",
+                "_rbush/_rbush.cc",
+                "_rbush/flat.cc",
+                "_rbush/metrics.cc",
+                "_rbush/packed.cc",
+                "_rbush/simd.cc",
+                "_rbush/thread_pool.cc",
+            ],
+            depends=[
+                "_rbush/_rbush.h",
+                "_rbush/debug.h",
+                "_rbush/flat.h",
+                "_rbush/metrics.h",
+                "_rbush/packed.h",
+                "_rbush/simd.h",
+                "_rbush/thread_pool.h",
+            ],
             extra_compile_args=copmile_args,
+            # shm_open is only in libc from glibc 2.34 on
+            libraries=["rt"] if sys.platform.startswith("linux") else [],
             language="c++",
             cxx_std=17,
         ),
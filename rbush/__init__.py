@@ -1,5 +1,31 @@
 from _rbush import BBox
+from _rbush import BBoxLayout
+from _rbush import IdRBush
+from _rbush import MappedRBush
+from _rbush import PointRBush
 from _rbush import RBush
 from _rbush import RBushBase
+from _rbush import SharedRBush
+from _rbush import StaticRBush
+from _rbush import get_metrics
+from _rbush import get_num_threads
+from _rbush import reset_metrics
+from _rbush import set_metrics_enabled
+from _rbush import set_num_threads
 
-__all__ = ["RBush", "RBushBase", "BBox"]
+__all__ = [
+    "RBush",
+    "RBushBase",
+    "IdRBush",
+    "PointRBush",
+    "MappedRBush",
+    "SharedRBush",
+    "StaticRBush",
+    "BBox",
+    "BBoxLayout",
+    "get_num_threads",
+    "set_num_threads",
+    "get_metrics",
+    "reset_metrics",
+    "set_metrics_enabled",
+]
@@ -1,6 +1,11 @@
 from __future__ import annotations
 
+import array
 import math
+import os
+import threading
+
+import pytest
 
 import rbush
 
@@ -183,6 +188,51 @@ def test_to_bbox_can_be_overridden_for_custom_data():
     )
 
 
+def test_bbox_layout_reads_the_bbox_of_each_kind_of_item():
+    class Item:
+        def __init__(self, bbox: tuple[float, float, float, float]) -> None:
+            self.x0, self.y0, self.x1, self.y1 = bbox
+
+    coords = [default_dict_key(item) for item in DATA]
+    layouts_and_items = [
+        (rbush.BBoxLayout.attributes("x0", "y0", "x1", "y1"), [Item(c) for c in coords]),
+        (rbush.BBoxLayout.keys(), DATA),
+        (rbush.BBoxLayout.keys(3, 2, 1, 0), [dict(enumerate(reversed(c))) for c in coords]),
+        (rbush.BBoxLayout.indices(), [c + ("payload",) for c in coords]),
+        (rbush.BBoxLayout.indices(-4, -3, -2, -1), [list(("payload",) + c) for c in coords]),
+        (
+            rbush.BBoxLayout.struct(8, 16, 24, 32),
+            [array.array("d", (-1,) + c).tobytes() for c in coords],
+        ),
+    ]
+    expected = rbush.RBush(4)
+    expected.load(DATA)
+    bbox = rbush.BBox(40, 20, 80, 70)
+
+    for layout, items in layouts_and_items:
+        tree = rbush.RBushBase(4, bbox_layout=layout)
+        tree.load(items)
+        assert tree.to_bbox(items[1]).min_x == 10
+        assert len(tree.search(bbox)) == len(expected.search(bbox))
+        assert tree.serialize()["root"]["bbox"] == expected.serialize()["root"]["bbox"]
+        tree.remove(items[0])
+        assert len(tree) == len(DATA) - 1
+
+
+def test_bbox_layout_takes_precedence_over_to_bbox():
+    class MyRBush(rbush.RBushBase):
+        def to_bbox(self, item: dict) -> rbush.BBox:
+            raise AssertionError("to_bbox should not be called")
+
+    tree = MyRBush(4, bbox_layout=rbush.BBoxLayout.keys())
+    tree.load(DATA)
+    assert len(tree) == len(DATA)
+    with pytest.raises(KeyError):
+        tree.insert({"min_x": 0})
+    with pytest.raises(ValueError):
+        rbush.RBushBase(bbox_layout=rbush.BBoxLayout.struct()).insert(b"too short")
+
+
 def test_load_sanity():
     tree = rbush.RBush(4)
     tree.load(DATA)
@@ -306,6 +356,143 @@ def test_collides_returns_false_if_nothing_found():
     assert not result
 
 
+def test_count_matches_the_number_of_search_results():
+    tree = rbush.RBush(4)
+    tree.load(DATA)
+
+    assert tree.count(rbush.BBox(40, 20, 80, 70)) == 12
+    assert tree.count(rbush.BBox(200, 200, 210, 210)) == 0
+    assert tree.count(rbush.BBox(-10, -10, 110, 110)) == len(DATA)
+    for i in range(0, 100, 7):
+        bbox = rbush.BBox(i, 100 - i, i + 30, 130 - i)
+        assert tree.count(bbox) == len(tree.search(bbox))
+
+
+def test_len_tracks_inserts_loads_and_removes():
+    tree = rbush.RBush(4)
+    assert len(tree) == 0
+    tree.load(DATA)
+    assert len(tree) == len(DATA)
+    tree.insert(tuple_to_dict((13, 13, 13, 13)))
+    tree.load(some_data(3))
+    assert len(tree) == len(DATA) + 4
+    for item in DATA[:10]:
+        tree.remove(item)
+    assert len(tree) == len(DATA) - 6
+    assert tree.count(rbush.BBox(-10, -10, 110, 110)) == len(tree)
+    tree.clear()
+    assert len(tree) == 0
+
+
+def test_search_many_returns_the_results_of_each_bbox_in_csr_form():
+    tree = rbush.RBush(4)
+    tree.load(DATA)
+    bboxes = [
+        rbush.BBox(40, 20, 80, 70),
+        rbush.BBox(200, 200, 210, 210),
+        rbush.BBox(0, 0, 100, 100),
+    ]
+    offsets, hits = tree.search_many(bboxes)
+
+    assert offsets == [0, 12, 12, 12 + len(DATA)]
+    for i, bbox in enumerate(bboxes):
+        assert_sorted_equal(hits[offsets[i] : offsets[i + 1]], tree.search(bbox))
+
+
+def test_search_many_accepts_a_float64_array_of_bboxes():
+    tree = rbush.RBush(4)
+    tree.load(DATA)
+    coords = array.array("d", [40, 20, 80, 70, 200, 200, 210, 210])
+    offsets, hits = tree.search_many(memoryview(coords).cast("B").cast("d", [2, 4]))
+
+    assert offsets == [0, 12, 12]
+    assert_sorted_equal(hits, tree.search(rbush.BBox(40, 20, 80, 70)))
+    assert tree.search_many([]) == ([0], [])
+
+
+def test_search_many_can_run_while_another_thread_modifies_the_tree():
+    tree = rbush.RBush(4)
+    tree.load(DATA)
+    moving = [tuple_to_dict((x, y, x + 5, y + 5)) for x in range(0, 100, 7) for y in (3, 53)]
+    zones = [tuple_to_dict((x, y, x + 30, y + 30)) for x in range(0, 100, 20) for y in (0, 40, 70)]
+    bboxes = [rbush.BBox(*default_dict_key(zone)) for zone in zones]
+    expected = [{id(item) for item in DATA if bbox_intersects(item, zone)} for zone in zones]
+    stop = threading.Event()
+
+    def modify() -> None:
+        while not stop.is_set():
+            for item in moving:
+                tree.insert(item)
+            for item in moving:
+                tree.remove(item)
+
+    thread = threading.Thread(target=modify)
+    thread.start()
+    try:
+        for _ in range(200):
+            offsets, hits = tree.search_many(bboxes)
+            for i, zone in enumerate(zones):
+                found = hits[offsets[i] : offsets[i + 1]]
+                assert expected[i] <= {id(item) for item in found}
+                assert all(bbox_intersects(item, zone) for item in found)
+    finally:
+        stop.set()
+        thread.join()
+    assert len(tree) == len(DATA)
+
+
+def test_iter_search_yields_the_hits_of_search_in_chunks():
+    tree = rbush.RBush(4)
+    tree.load(DATA)
+    bbox = rbush.BBox(40, 20, 80, 70)
+    chunks = list(tree.iter_search(bbox, chunk_size=5))
+
+    assert len(chunks) > 1
+    assert all(len(chunk) >= 5 for chunk in chunks[:-1])
+    assert_sorted_equal([item for chunk in chunks for item in chunk], tree.search(bbox))
+    assert list(tree.iter_search(rbush.BBox(200, 200, 210, 210))) == []
+
+
+def test_iter_search_raises_if_the_tree_changes_during_iteration():
+    tree = rbush.RBush(4)
+    tree.load(DATA)
+    chunks = tree.iter_search(rbush.BBox(0, 0, 100, 100), chunk_size=1)
+    next(chunks)
+    tree.insert(tuple_to_dict((1, 1, 1, 1)))
+
+    with pytest.raises(RuntimeError):
+        next(chunks)
+
+
+def point_dist(item: dict, x: float, y: float) -> float:
+    dx = max(item["min_x"] - x, 0, x - item["max_x"])
+    dy = max(item["min_y"] - y, 0, y - item["max_y"])
+    return math.hypot(dx, dy)
+
+
+def test_knn_finds_the_k_closest_items_in_distance_order():
+    tree = rbush.RBush(4)
+    tree.load(DATA)
+    result = tree.knn(40, 40, 10)
+
+    expected = sorted(DATA, key=lambda item: point_dist(item, 40, 40))[:10]
+    assert [point_dist(item, 40, 40) for item in result] == [
+        point_dist(item, 40, 40) for item in expected
+    ]
+
+
+def test_knn_respects_max_distance_and_predicate():
+    tree = rbush.RBush(4)
+    tree.load(DATA)
+
+    result = tree.knn(40, 40, 1000, max_distance=10)
+    assert_sorted_equal(result, [item for item in DATA if point_dist(item, 40, 40) <= 10])
+    result = tree.knn(40, 40, 5, predicate=lambda item: item["min_x"] > 80)
+    assert len(result) == 5
+    assert all(item["min_x"] > 80 for item in result)
+    assert tree.knn(200, 200, 3, max_distance=1) == []
+
+
 def test_all_returns_all_items_in_the_tree():
     tree = rbush.RBush(4)
     tree.load(DATA)
@@ -314,6 +501,98 @@ def test_all_returns_all_items_in_the_tree():
     assert_sorted_equal(tree.search(rbush.BBox(0, 0, 100, 100)), DATA)
 
 
+def bbox_contains(a: dict, b: dict) -> bool:
+    return (
+        a["min_x"] <= b["min_x"]
+        and a["min_y"] <= b["min_y"]
+        and b["max_x"] <= a["max_x"]
+        and b["max_y"] <= a["max_y"]
+    )
+
+
+def bbox_intersects(a: dict, b: dict) -> bool:
+    return (
+        a["min_x"] <= b["max_x"]
+        and a["min_y"] <= b["max_y"]
+        and b["min_x"] <= a["max_x"]
+        and b["min_y"] <= a["max_y"]
+    )
+
+
+def test_join_pairs_the_items_of_both_trees_matching_the_predicate():
+    zones = [tuple_to_dict((x, y, x + 15, y + 15)) for x in range(0, 100, 10) for y in (0, 50)]
+    tree = rbush.RBush(4)
+    tree.load(DATA)
+    other = rbush.RBush(4)
+    other.load(zones)
+
+    def pairs(result):
+        return sorted((id(a), id(b)) for a, b in result)
+
+    def expected(match):
+        return sorted((id(a), id(b)) for a in DATA for b in zones if match(a, b))
+
+    assert pairs(tree.join(other)) == expected(bbox_intersects)
+    assert pairs(tree.join(other, "within")) == expected(lambda a, b: bbox_contains(b, a))
+    assert pairs(other.join(tree, "contains")) == sorted(
+        (b, a) for a, b in expected(lambda a, b: bbox_contains(b, a))
+    )
+    assert tree.join(rbush.RBush()) == []
+    with pytest.raises(ValueError):
+        tree.join(other, "touches")
+
+
+def test_join_can_run_while_another_thread_modifies_the_trees():
+    zones = [tuple_to_dict((x, y, x + 15, y + 15)) for x in range(0, 100, 10) for y in (0, 50)]
+    tree = rbush.RBush(4)
+    tree.load(DATA)
+    other = rbush.RBush(4)
+    other.load(zones)
+    moving = [tuple_to_dict((x, x, x + 5, x + 5)) for x in range(0, 100, 3)]
+    expected = sorted((id(a), id(b)) for a in DATA for b in zones if bbox_intersects(a, b))
+    data_ids = {id(item) for item in DATA}
+    zone_ids = {id(zone) for zone in zones}
+    stop = threading.Event()
+
+    def modify() -> None:
+        while not stop.is_set():
+            for item in moving:
+                tree.insert(item)
+                other.insert(item)
+            for item in moving:
+                tree.remove(item)
+                other.remove(item)
+
+    thread = threading.Thread(target=modify)
+    thread.start()
+    try:
+        for _ in range(100):
+            pairs = [(id(a), id(b)) for a, b in tree.join(other)]
+            assert sorted(p for p in pairs if p[0] in data_ids and p[1] in zone_ids) == expected
+    finally:
+        stop.set()
+        thread.join()
+
+
+def test_id_rbush_join_returns_pairs_of_ids():
+    np = pytest.importorskip("numpy")
+    coords = np.array([default_dict_key(item) for item in DATA], dtype=np.float64)
+    tree = rbush.IdRBush(4)
+    tree.load_arrays(coords)
+    other = rbush.IdRBush(4)
+    other.insert(7, rbush.BBox(40, 20, 80, 70))
+
+    pairs = tree.join(other)
+    assert pairs.shape == (12, 2)
+    assert sorted(pairs[:, 0].tolist()) == sorted(tree.search(rbush.BBox(40, 20, 80, 70)))
+    assert set(pairs[:, 1].tolist()) == {7}
+    within = tree.join(other, "within")
+    assert sorted(within[:, 0].tolist()) == [
+        i for i, item in enumerate(DATA) if bbox_contains(tuple_to_dict((40, 20, 80, 70)), item)
+    ]
+    assert tree.join(rbush.IdRBush()).shape == (0, 2)
+
+
 def test_serialize_and_deserialize_exports_and_imports_search_tree_in_JSON_format():
     tree = rbush.RBush(4)
     tree.load(DATA)
@@ -353,6 +632,190 @@ def test_insert_forms_a_valid_tree_if_items_are_inserted_one_by_one():
     assert_sorted_equal(tree.all(), tree2.all())
 
 
+def test_insert_buffer_gives_the_same_results_as_inserting_one_by_one():
+    tree = rbush.RBush(4, insert_buffer=10)
+    tree2 = rbush.RBush(4)
+    for item in DATA:
+        tree.insert(item)
+        tree2.insert(item)
+
+    bbox = rbush.BBox(40, 20, 80, 70)
+    assert len(tree) == len(DATA)
+    assert_sorted_equal(tree.all(), DATA)
+    assert_sorted_equal(tree.search(bbox), tree2.search(bbox))
+    assert tree.count(bbox) == tree2.count(bbox)
+    assert tree.collides(bbox)
+    assert [point_dist(item, 40, 40) for item in tree.knn(40, 40, 10)] == [
+        point_dist(item, 40, 40) for item in tree2.knn(40, 40, 10)
+    ]
+    assert len(tree.join(tree2)) == len(tree2.join(tree2))
+
+    tree.remove(DATA[-1])
+    assert len(tree) == len(DATA) - 1
+    assert_sorted_equal(tree.all(), DATA[:-1])
+
+
+def serialized_items(node: dict) -> list:
+    if node["is_leaf"]:
+        return node["children"]
+    return [item for child in node["children"] for item in serialized_items(child)]
+
+
+def test_flush_merges_the_insert_buffer_into_the_tree():
+    tree = rbush.RBush(4, insert_buffer=1000)
+    for item in DATA:
+        tree.insert(item)
+    assert len(tree) == len(DATA)
+    assert_sorted_equal(tree.search(rbush.BBox(0, 0, 100, 100)), DATA)
+
+    tree.flush()
+    data = tree.serialize()
+    assert data["root"]["height"] > 1
+    assert_sorted_equal(serialized_items(data["root"]), DATA)
+    tree.flush()
+    assert tree.serialize() == data
+
+
+def test_rstar_insert_strategy_gives_the_same_results_as_the_default_one():
+    tree = rbush.RBush(4, insert_strategy="rstar")
+    tree2 = rbush.RBush(4)
+    for item in DATA:
+        tree.insert(item)
+        tree2.insert(item)
+
+    bbox = rbush.BBox(40, 20, 80, 70)
+    assert len(tree) == len(DATA)
+    assert_sorted_equal(tree.all(), DATA)
+    assert_sorted_equal(tree.search(bbox), tree2.search(bbox))
+    assert tree.count(bbox) == tree2.count(bbox)
+
+    def check_node(node: dict) -> None:
+        assert 1 <= len(node["children"]) <= 4
+        for child in node["children"]:
+            child_bbox = child["bbox"] if not node["is_leaf"] else child
+            assert node["bbox"]["min_x"] <= child_bbox["min_x"]
+            assert node["bbox"]["min_y"] <= child_bbox["min_y"]
+            assert node["bbox"]["max_x"] >= child_bbox["max_x"]
+            assert node["bbox"]["max_y"] >= child_bbox["max_y"]
+            if not node["is_leaf"]:
+                assert child["height"] == node["height"] - 1
+                check_node(child)
+
+    check_node(tree.serialize()["root"])
+
+    tree.remove(DATA[-1])
+    assert_sorted_equal(tree.all(), DATA[:-1])
+
+    with pytest.raises(ValueError):
+        rbush.IdRBush(insert_strategy="rtree")
+
+
+def test_compact_bboxes_give_the_same_results_as_exact_ones():
+    np = pytest.importorskip("numpy")
+    # a grid finer than float precision, so that the boxes of the internal nodes are rounded
+    coords = np.array(
+        [
+            [1e6 + i * 1e-4, 1e6 + j * 1e-4, 1e6 + i * 1e-4, 1e6 + (j + 1) * 1e-4]
+            for i in range(40)
+            for j in range(40)
+        ]
+    )
+    tree = rbush.IdRBush(4, compact_bboxes=True)
+    tree2 = rbush.IdRBush(4)
+    tree.load_arrays(coords)
+    tree2.load_arrays(coords)
+    for i in range(0, len(coords), 7):
+        tree.insert(len(coords) + i, rbush.BBox(*coords[i]))
+        tree2.insert(len(coords) + i, rbush.BBox(*coords[i]))
+
+    for i in range(0, len(coords), 13):
+        min_x, min_y, max_x, max_y = coords[i]
+        # edges on the items and just off them
+        for bbox in [
+            rbush.BBox(min_x, min_y, max_x + 5e-4, max_y + 5e-4),
+            rbush.BBox(np.nextafter(max_x, 2e6), min_y, max_x + 5e-4, max_y + 5e-4),
+        ]:
+            assert sorted(tree.search(bbox)) == sorted(tree2.search(bbox))
+            assert tree.count(bbox) == tree2.count(bbox)
+            assert tree.collides(bbox) == tree2.collides(bbox)
+        assert list(tree.knn(min_x, max_y, 5)) == list(tree2.knn(min_x, max_y, 5))
+
+
+def test_stats_describes_the_levels_of_the_tree():
+    tree = rbush.RBush(4)
+    tree.load(DATA)
+    stats = tree.stats()
+
+    assert stats["size"] == len(DATA)
+    assert stats["buffered"] == 0
+    assert stats["height"] == tree.serialize()["root"]["height"]
+    assert [level["height"] for level in stats["levels"]] == list(range(stats["height"], 0, -1))
+    assert stats["nodes"] == sum(level["nodes"] for level in stats["levels"])
+    assert stats["levels"][0]["nodes"] == 1
+    assert stats["levels"][0]["overlap"] == 0
+    leaves = stats["levels"][-1]
+    assert leaves["fill"] * leaves["nodes"] * 4 == pytest.approx(len(DATA))
+    # the items are points, so the leaves are all dead space
+    assert leaves["dead_space"] == pytest.approx(leaves["area"])
+    assert stats["overlap"] == pytest.approx(sum(level["overlap"] for level in stats["levels"]))
+
+    single = rbush.RBush(4)
+    single.load([tuple_to_dict((0, 0, 2, 2)), tuple_to_dict((1, 1, 4, 4))])
+    assert single.stats()["dead_space"] == pytest.approx(16 - 4 - 9 + 1)
+
+
+def test_stats_can_run_while_another_thread_modifies_the_tree():
+    tree = rbush.RBush(4)
+    tree.load(DATA)
+    moving = [tuple_to_dict((x, x, x + 5, x + 5)) for x in range(0, 100, 3)]
+    stop = threading.Event()
+
+    def modify() -> None:
+        while not stop.is_set():
+            for item in moving:
+                tree.insert(item)
+            for item in moving:
+                tree.remove(item)
+
+    thread = threading.Thread(target=modify)
+    thread.start()
+    try:
+        for _ in range(200):
+            stats = tree.stats()
+            leaves = stats["levels"][-1]
+            assert leaves["fill"] * leaves["nodes"] * 4 == pytest.approx(stats["size"])
+            assert stats["nodes"] == sum(level["nodes"] for level in stats["levels"])
+    finally:
+        stop.set()
+        thread.join()
+
+
+def test_metrics_count_the_calls_and_the_work_of_the_queries():
+    tree = rbush.RBush(4)
+    tree.load(DATA)
+    rbush.reset_metrics()
+    for _ in range(10):
+        tree.search(rbush.BBox(40, 20, 80, 70))
+    tree.count(rbush.BBox(40, 20, 80, 70))
+
+    metrics = rbush.get_metrics()
+    assert metrics["search"]["calls"] == 10
+    assert metrics["count"]["calls"] == 1
+    assert metrics["insert"]["calls"] == 0
+    assert 0 < metrics["search"]["p50_ns"] <= metrics["search"]["p99_ns"]
+    assert metrics["search"]["nodes_visited"] >= metrics["search"]["leaves_scanned"] > 0
+    assert metrics["search"]["entries_tested"] > metrics["search"]["nodes_visited"]
+
+    rbush.set_metrics_enabled(False)
+    try:
+        tree.search(rbush.BBox(40, 20, 80, 70))
+    finally:
+        rbush.set_metrics_enabled(True)
+    assert rbush.get_metrics()["search"]["calls"] == 10
+    rbush.reset_metrics()
+    assert rbush.get_metrics()["search"]["calls"] == 0
+
+
 def test_remove_removes_items_correctly():
     tree = rbush.RBush(4)
     tree.load(DATA)
@@ -404,6 +867,136 @@ def test_remove_accepts_an_equals_function():
     assert_sorted_equal(tree.all(), DATA)
 
 
+def test_remove_with_identity_index_finds_items_without_their_bbox():
+    tree = rbush.RBush(4, identity_index=True)
+    tree.load(DATA)
+
+    item = tuple_to_dict((20, 70, 20, 70))
+    tree.insert(item)
+    # the index finds the item even though its bbox changed since it was inserted
+    item["min_x"] = item["max_x"] = 500
+    tree.remove(item)
+    tree.remove(tuple_to_dict((0, 0, 0, 0)))
+
+    assert_sorted_equal(tree.all(), DATA)
+    for i in range(len(DATA)):
+        tree.remove(DATA[i])
+    assert tree.serialize() == rbush.RBush(4).serialize()
+
+
+def test_remove_many_removes_the_given_items():
+    for identity_index in (False, True):
+        tree = rbush.RBush(4, identity_index=identity_index)
+        tree.load(DATA)
+
+        assert tree.remove_many(DATA[::2] + [tuple_to_dict((13, 13, 13, 13))]) == len(DATA[::2])
+        assert_sorted_equal(tree.all(), DATA[1::2])
+        assert len(tree) == len(DATA[1::2])
+        assert tree.remove_many(DATA[1::2]) == len(DATA[1::2])
+        assert tree.serialize() == rbush.RBush(4).serialize()
+
+
+def test_remove_in_removes_the_items_within_a_bbox():
+    tree = rbush.RBush(4)
+    tree.load(DATA)
+    bbox = rbush.BBox(40, 20, 80, 70)
+    found = tree.search(bbox)
+
+    assert tree.remove_in(bbox) == len(found)
+    assert tree.search(bbox) == []
+    assert_sorted_equal(tree.all(), [item for item in DATA if item not in found])
+    assert tree.remove_in(rbush.BBox(-10, -10, 110, 110)) == len(DATA) - len(found)
+    assert tree.serialize() == rbush.RBush(4).serialize()
+
+
+def intersects(a: tuple[float, ...], b: tuple[float, ...]) -> bool:
+    return a[0] <= b[2] and a[1] <= b[3] and a[2] >= b[0] and a[3] >= b[1]
+
+
+def test_update_moves_items_whose_bbox_changed():
+    for identity_index in (False, True):
+        for slack in (0.0, 5.0):
+            data = [tuple_to_dict(default_dict_key(item)) for item in DATA]
+            tree = rbush.RBush(4, identity_index=identity_index)
+            tree.load(data)
+
+            moved = data[::3]
+            old_bboxes = [tuple_to_bbox(default_dict_key(item)) for item in moved]
+            for i, item in enumerate(moved):
+                # a step within its leaf for some, across the whole space for others
+                step = 1 if i % 2 else 50
+                item["min_x"] += step
+                item["max_x"] += step
+            assert tree.update(moved[0], old_bboxes[0], slack=slack)
+            assert tree.update_many(moved[1:], old_bboxes[1:], slack=slack) == len(moved) - 1
+            assert not tree.update(tuple_to_dict((13, 13, 13, 13)), rbush.BBox(13, 13, 13, 13))
+
+            assert len(tree) == len(data)
+            assert_sorted_equal(tree.all(), data)
+            for query in ((40, 20, 80, 70), (60, 0, 110, 100)):
+                expected = [item for item in data if intersects(default_dict_key(item), query)]
+                assert_sorted_equal(tree.search(tuple_to_bbox(query)), expected)
+
+    with pytest.raises(ValueError):
+        rbush.RBush(4).update(data[0])
+
+
+def test_id_rbush_update_moves_ids_with_or_without_identity_index():
+    np = pytest.importorskip("numpy")
+    coords = np.array([default_dict_key(item) for item in DATA], dtype=np.float64)
+    ids = np.arange(0, len(DATA), 2, dtype=np.int64)
+    moved = coords.copy()
+    moved[ids] += 20
+    moved[1] -= 30
+
+    tree = rbush.IdRBush(4)
+    tree.load_arrays(coords)
+    with pytest.raises(ValueError):
+        tree.update_many(ids, moved[ids])
+    assert tree.update_many(ids, moved[ids], coords[ids]) == len(ids)
+    assert tree.update(1, rbush.BBox(*moved[1]), rbush.BBox(*coords[1]))
+
+    indexed = rbush.IdRBush(4, identity_index=True)
+    indexed.load_arrays(coords)
+    assert indexed.update_many(ids, moved[ids], slack=1.0) == len(ids)
+    assert indexed.update(1, rbush.BBox(*moved[1]), slack=1.0)
+
+    query = (40, 20, 80, 70)
+    expected = [i for i, row in enumerate(moved) if intersects(row, query)]
+    assert sorted(tree.search(tuple_to_bbox(query))) == expected
+    assert sorted(indexed.search(tuple_to_bbox(query))) == expected
+
+
+def test_optimize_repacks_the_subtrees_worn_by_removes():
+    items = []
+    for i in range(1000):
+        x, y = i * 37 % 100, i * 61 % 100 + i / 100
+        items.append(tuple_to_dict((x, y, x + 1, y + 1)))
+    tree = rbush.RBush(4)
+    for item in items:
+        tree.insert(item)
+    for i, item in enumerate(items):
+        if i % 3:
+            tree.remove(item)
+    kept = items[::3]
+    snapshot = tree.snapshot()
+    nodes = tree.stats()["nodes"]
+
+    assert 0 < tree.optimize(100) <= 100
+    for _ in range(100):
+        if not tree.optimize(100):
+            break
+    assert tree.optimize(len(kept)) == 0
+    assert len(tree) == len(kept)
+    assert tree.stats()["nodes"] < nodes / 2
+    for query in [(0, 0, 100, 100), (20, 30, 45, 60), (90, 90, 95, 95)]:
+        expected = [item for item in kept if intersects(default_dict_key(item), query)]
+        assert_sorted_equal(tree.search(tuple_to_bbox(query)), expected)
+    # the snapshot keeps the nodes as they were before repacking
+    assert snapshot.stats()["nodes"] == nodes
+    assert len(snapshot.search(rbush.BBox(0, 0, 100, 100))) == len(kept)
+
+
 def test_clear_should_clear_all_the_data_in_the_tree():
     tree = rbush.RBush(4)
     tree.load(DATA)
@@ -588,3 +1181,419 @@ def test_split_issue_32():
     }
 
     assert tree.serialize() == expected
+
+
+def test_id_rbush_load_arrays_returns_the_ids_of_the_matching_rows():
+    np = pytest.importorskip("numpy")
+    coords = np.array([default_dict_key(item) for item in DATA], dtype=np.float64)
+    tree = rbush.IdRBush(4)
+    tree.load_arrays(coords)
+    bbox = rbush.BBox(40, 20, 80, 70)
+
+    expected = rbush.RBush(4)
+    expected.load(DATA)
+    assert_sorted_equal([DATA[i] for i in tree.search(bbox)], expected.search(bbox))
+    assert sorted(tree.all()) == list(range(len(DATA)))
+    assert tree.collides(bbox)
+    assert not tree.collides(rbush.BBox(200, 200, 210, 210))
+
+
+def test_id_rbush_load_arrays_accepts_ids_and_merges_with_existing_data():
+    np = pytest.importorskip("numpy")
+    coords = np.array([[0, 0, 1, 1], [5, 5, 6, 6], [10, 10, 11, 11]])
+    tree = rbush.IdRBush(4)
+    tree.load_arrays(coords, ids=np.array([7, 8, 9]))
+    tree.load_arrays(coords + 100)
+
+    assert sorted(tree.search(rbush.BBox(4, 4, 12, 12))) == [8, 9]
+    assert sorted(tree.search(rbush.BBox(100, 100, 200, 200))) == [0, 1, 2]
+    assert sorted(tree.all()) == [0, 1, 2, 7, 8, 9]
+
+
+def test_id_rbush_load_arrays_rejects_bad_shapes():
+    np = pytest.importorskip("numpy")
+    tree = rbush.IdRBush(4)
+    with pytest.raises(ValueError):
+        tree.load_arrays(np.zeros((3, 3)))
+    with pytest.raises(ValueError):
+        tree.load_arrays(np.zeros((3, 4)), ids=np.arange(2))
+
+
+def test_load_builds_the_same_tree_whatever_the_number_of_threads():
+    np = pytest.importorskip("numpy")
+    rng = np.random.default_rng(0)
+    mins = rng.random((50_000, 2)) * 1000
+    coords = np.hstack([mins, mins + rng.random((50_000, 2))])
+    num_threads = rbush.get_num_threads()
+    try:
+        ids = []
+        for n in (1, 4):
+            rbush.set_num_threads(n)
+            assert rbush.get_num_threads() == n
+            tree = rbush.IdRBush(9)
+            tree.load_arrays(coords)
+            ids.append(tree.all())
+    finally:
+        rbush.set_num_threads(num_threads)
+
+    assert np.array_equal(ids[0], ids[1])
+    assert sorted(ids[0]) == list(range(len(coords)))
+
+
+def test_id_rbush_insert_and_remove_ids_with_their_bbox():
+    np = pytest.importorskip("numpy")
+    tree = rbush.IdRBush(4)
+    for i, item in enumerate(DATA):
+        tree.insert(i, rbush.BBox(*default_dict_key(item)))
+    result = tree.search(rbush.BBox(0, 0, 100, 100))
+
+    assert result.dtype == np.int64
+    assert sorted(result) == list(range(len(DATA)))
+    assert len(tree) == len(DATA)
+    assert tree.count(rbush.BBox(40, 20, 80, 70)) == 12
+    for i, item in enumerate(DATA):
+        tree.remove(i, rbush.BBox(*default_dict_key(item)))
+    assert len(tree.all()) == 0
+    assert len(tree) == 0
+
+
+def test_id_rbush_removes_ids_in_bulk_with_or_without_identity_index():
+    np = pytest.importorskip("numpy")
+    coords = np.array([default_dict_key(item) for item in DATA], dtype=np.float64)
+    ids = np.arange(0, len(DATA), 2, dtype=np.int64)
+
+    tree = rbush.IdRBush(4)
+    tree.load_arrays(coords)
+    with pytest.raises(ValueError):
+        tree.remove(0)
+    with pytest.raises(ValueError):
+        tree.remove_many(ids)
+    assert tree.remove_many(ids, coords[::2]) == len(ids)
+    assert sorted(tree.all()) == list(range(1, len(DATA), 2))
+
+    indexed = rbush.IdRBush(4, identity_index=True)
+    indexed.load_arrays(coords)
+    indexed.remove(1)
+    assert indexed.remove_many(ids) == len(ids)
+    assert sorted(indexed.all()) == list(range(3, len(DATA), 2))
+    assert indexed.remove_in(rbush.BBox(-10, -10, 110, 110)) == len(range(3, len(DATA), 2))
+    assert len(indexed) == 0
+
+
+def test_id_rbush_search_many_returns_int64_arrays():
+    np = pytest.importorskip("numpy")
+    tree = rbush.IdRBush(4)
+    tree.load_arrays(np.array([default_dict_key(item) for item in DATA], dtype=np.float64))
+    bboxes = np.array([[40, 20, 80, 70], [200, 200, 210, 210]], dtype=np.float64)
+    offsets, hits = tree.search_many(bboxes)
+
+    assert offsets.dtype == np.int64
+    assert hits.dtype == np.int64
+    assert offsets.tolist() == [0, 12, 12]
+    assert sorted(hits) == sorted(tree.search(rbush.BBox(40, 20, 80, 70)))
+
+
+def test_id_rbush_save_can_be_mapped_and_loaded_back(tmp_path):
+    np = pytest.importorskip("numpy")
+    coords = np.array([default_dict_key(item) for item in DATA], dtype=np.float64)
+    tree = rbush.IdRBush(4)
+    tree.load_arrays(coords)
+    path = str(tmp_path / "tree.rbush")
+    tree.save(path)
+
+    mapped = rbush.MappedRBush(path)
+    loaded = rbush.IdRBush()
+    loaded.load_file(path)
+    bbox = rbush.BBox(40, 20, 80, 70)
+    assert len(mapped) == len(DATA)
+    assert sorted(mapped.search(bbox)) == sorted(tree.search(bbox))
+    assert sorted(loaded.search(bbox)) == sorted(tree.search(bbox))
+    assert mapped.collides(bbox)
+    nearest = [point_dist(DATA[i], 40, 40) for i in mapped.knn(40, 40, 5)]
+    assert nearest == sorted(point_dist(item, 40, 40) for item in DATA)[:5]
+    assert sorted(mapped.all()) == list(range(len(DATA)))
+    offsets, hits = mapped.search_many([bbox])
+    assert offsets.tolist() == [0, 12]
+
+    loaded.insert(1000, rbush.BBox(0, 0, 1, 1))
+    assert 1000 in loaded.search(rbush.BBox(0, 0, 1, 1))
+
+
+def test_id_rbush_save_over_a_mapped_file_leaves_the_mapping_as_it_was(tmp_path):
+    np = pytest.importorskip("numpy")
+    coords = np.array([default_dict_key(item) for item in DATA], dtype=np.float64)
+    tree = rbush.IdRBush(4)
+    tree.load_arrays(coords)
+    path = str(tmp_path / "tree.rbush")
+    tree.save(path)
+    mapped = rbush.MappedRBush(path)
+    bbox = rbush.BBox(40, 20, 80, 70)
+    expected = sorted(mapped.search(bbox))
+
+    tree.remove_in(rbush.BBox(0, 0, 50, 50))
+    tree.save(path)
+    assert len(mapped) == len(DATA)
+    assert sorted(mapped.search(bbox)) == expected
+    assert sorted(mapped.all()) == list(range(len(DATA)))
+    assert sorted(rbush.MappedRBush(path).search(bbox)) == sorted(tree.search(bbox))
+    assert os.listdir(tmp_path) == ["tree.rbush"]
+
+
+def test_id_rbush_publish_can_be_attached_to_until_unlinked():
+    np = pytest.importorskip("numpy")
+    coords = np.array([default_dict_key(item) for item in DATA], dtype=np.float64)
+    tree = rbush.IdRBush(4, insert_buffer=8)
+    tree.load_arrays(coords[:-5])
+    for i in range(len(DATA) - 5, len(DATA)):
+        tree.insert(i, rbush.BBox(*coords[i]))
+    name = f"/rbush_test_{os.getpid()}"
+    tree.publish(name)
+    try:
+        shared = rbush.SharedRBush(name)
+        bbox = rbush.BBox(40, 20, 80, 70)
+        assert len(shared) == len(DATA)
+        assert sorted(shared.search(bbox)) == sorted(tree.search(bbox))
+        assert shared.collides(bbox)
+        nearest = [point_dist(DATA[i], 40, 40) for i in shared.knn(40, 40, 5)]
+        assert nearest == sorted(point_dist(item, 40, 40) for item in DATA)[:5]
+        assert sorted(shared.all()) == list(range(len(DATA)))
+
+        # publishing again replaces the segment, the trees attached to the old one keep it
+        smaller = rbush.IdRBush(4)
+        smaller.insert(7, rbush.BBox(0, 0, 1, 1))
+        smaller.publish(name)
+        assert len(rbush.SharedRBush(name)) == 1
+        assert len(shared) == len(DATA)
+    finally:
+        rbush.SharedRBush.unlink(name)
+    assert sorted(shared.search(bbox)) == sorted(tree.search(bbox))
+    with pytest.raises(OSError):
+        rbush.SharedRBush(name)
+    with pytest.raises(OSError):
+        rbush.SharedRBush.unlink(name)
+
+
+def test_snapshot_keeps_the_tree_as_it_was_when_taken():
+    tree = rbush.RBush(4, insert_buffer=5)
+    tree.load(DATA[:30])
+    for item in DATA[30:40]:
+        tree.insert(item)
+    snapshot = tree.snapshot()
+    chunks = snapshot.iter_search(rbush.BBox(0, 0, 100, 100), chunk_size=4)
+    first_chunk = next(chunks)
+
+    for item in DATA[40:]:
+        tree.insert(item)
+    tree.remove_many(DATA[:10])
+    tree.remove_in(rbush.BBox(0, 0, 30, 30))
+    snapshot2 = tree.snapshot()
+    tree.clear()
+
+    def in_bbox(items: list[dict], bbox: rbush.BBox) -> list[dict]:
+        return [
+            item
+            for item in items
+            if item["min_x"] <= bbox.max_x
+            and item["max_x"] >= bbox.min_x
+            and item["min_y"] <= bbox.max_y
+            and item["max_y"] >= bbox.min_y
+        ]
+
+    bbox = rbush.BBox(40, 20, 80, 70)
+    assert len(snapshot) == 40
+    assert_sorted_equal(snapshot.all(), DATA[:40])
+    assert_sorted_equal(snapshot.search(bbox), in_bbox(DATA[:40], bbox))
+    assert snapshot.count(bbox) == len(in_bbox(DATA[:40], bbox))
+    assert_sorted_equal(first_chunk + [item for chunk in chunks for item in chunk], DATA[:40])
+    removed = in_bbox(DATA[10:], rbush.BBox(0, 0, 30, 30))
+    assert_sorted_equal(snapshot2.all(), [item for item in DATA[10:] if item not in removed])
+    assert len(tree) == 0
+    with pytest.raises(RuntimeError):
+        snapshot.insert(DATA[0])
+    with pytest.raises(RuntimeError):
+        snapshot.clear()
+
+
+def test_id_rbush_snapshot_can_be_queried_while_the_tree_is_modified():
+    np = pytest.importorskip("numpy")
+    coords = np.array([default_dict_key(item) for item in DATA], dtype=np.float64)
+    tree = rbush.IdRBush(4, identity_index=True)
+    tree.load_arrays(coords)
+    snapshot = tree.snapshot()
+    bbox = rbush.BBox(40, 20, 80, 70)
+    expected = sorted(tree.search(bbox))
+    results = []
+
+    def query() -> None:
+        for _ in range(200):
+            results.append(sorted(snapshot.search(bbox)))
+
+    threads = [threading.Thread(target=query) for _ in range(4)]
+    for thread in threads:
+        thread.start()
+    for i in range(len(DATA)):
+        tree.remove(i)
+        tree.insert(1000 + i, rbush.BBox(*coords[i]))
+    for thread in threads:
+        thread.join()
+
+    assert all(result == expected for result in results)
+    assert sorted(tree.search(bbox)) == [1000 + i for i in expected]
+
+
+def test_point_rbush_finds_the_same_ids_as_an_id_rbush_of_points():
+    np = pytest.importorskip("numpy")
+    points = np.array([(item["min_x"], item["min_y"]) for item in DATA], dtype=np.float64)
+
+    for max_entries in (4, 9):
+        tree = rbush.PointRBush(max_entries)
+        tree.load_arrays(points[:-10])
+        for i in range(len(DATA) - 10, len(DATA)):
+            tree.insert(i, *points[i])
+        boxes = rbush.IdRBush(max_entries)
+        boxes.load_arrays(np.hstack([points, points])[:-10])
+        for i in range(len(DATA) - 10, len(DATA)):
+            boxes.insert(i, rbush.BBox(*points[i], *points[i]))
+
+        assert len(tree) == len(DATA)
+        for bbox in (rbush.BBox(40, 20, 80, 70), rbush.BBox(-10, -10, 110, 110)):
+            assert list(tree.search(bbox)) == list(boxes.search(bbox))
+            assert tree.count(bbox) == boxes.count(bbox)
+        assert not tree.collides(rbush.BBox(200, 200, 300, 300))
+        assert list(tree.knn(40, 40, 5)) == list(boxes.knn(40, 40, 5))
+
+
+def test_point_rbush_removes_ids_with_or_without_identity_index():
+    np = pytest.importorskip("numpy")
+    points = np.array([(item["min_x"], item["min_y"]) for item in DATA], dtype=np.float64)
+    ids = np.arange(0, len(DATA), 2, dtype=np.int64)
+
+    tree = rbush.PointRBush(4)
+    with pytest.raises(ValueError):
+        tree.load_arrays(np.zeros((3, 4)))
+    tree.load_arrays(points)
+    with pytest.raises(ValueError):
+        tree.remove(0)
+    tree.remove(0, *points[0])
+    assert tree.remove_many(ids[1:], points[ids[1:]]) == len(ids) - 1
+    assert sorted(tree.all()) == list(range(1, len(DATA), 2))
+
+    indexed = rbush.PointRBush(4, identity_index=True)
+    indexed.load_arrays(points)
+    indexed.remove(1)
+    assert indexed.remove_many(ids) == len(ids)
+    assert sorted(indexed.all()) == list(range(3, len(DATA), 2))
+
+
+def test_point_rbush_update_moves_ids_with_or_without_identity_index():
+    np = pytest.importorskip("numpy")
+    points = np.array([(item["min_x"], item["min_y"]) for item in DATA], dtype=np.float64)
+    ids = np.arange(0, len(DATA), 2, dtype=np.int64)
+    moved = points.copy()
+    moved[ids] += 20
+    moved[1] -= 30
+
+    tree = rbush.PointRBush(4)
+    tree.load_arrays(points)
+    with pytest.raises(ValueError):
+        tree.update_many(ids, moved[ids])
+    with pytest.raises(ValueError):
+        tree.update_many(ids, np.zeros((len(ids), 4)), points[ids])
+    with pytest.raises(ValueError):
+        tree.update(1, *moved[1], old_x=points[1][0])
+    assert tree.update_many(ids, moved[ids], points[ids]) == len(ids)
+    assert tree.update(1, *moved[1], *points[1])
+
+    indexed = rbush.PointRBush(4, identity_index=True)
+    indexed.load_arrays(points)
+    assert indexed.update_many(ids, moved[ids], slack=1.0) == len(ids)
+    assert indexed.update(1, *moved[1], slack=1.0)
+
+    query = (40, 20, 80, 70)
+    expected = [i for i, (x, y) in enumerate(moved) if intersects((x, y, x, y), query)]
+    assert sorted(tree.search(tuple_to_bbox(query))) == expected
+    assert sorted(indexed.search(tuple_to_bbox(query))) == expected
+
+
+def test_point_rbush_save_can_be_mapped_and_loaded_back(tmp_path):
+    np = pytest.importorskip("numpy")
+    points = np.array([(item["min_x"], item["min_y"]) for item in DATA], dtype=np.float64)
+    tree = rbush.PointRBush(4)
+    tree.load_arrays(points)
+    path = str(tmp_path / "tree.rbush")
+    tree.save(path)
+
+    mapped = rbush.MappedRBush(path)
+    loaded = rbush.PointRBush()
+    loaded.load_file(path)
+    bbox = rbush.BBox(40, 20, 80, 70)
+    assert len(mapped) == len(DATA)
+    assert sorted(mapped.search(bbox)) == sorted(tree.search(bbox))
+    assert sorted(loaded.search(bbox)) == sorted(tree.search(bbox))
+    nearest = [math.hypot(*(points[i] - 40)) for i in mapped.knn(40, 40, 5)]
+    assert nearest == sorted(math.hypot(x - 40, y - 40) for x, y in points)[:5]
+
+    boxes = rbush.IdRBush(4)
+    boxes.insert(0, rbush.BBox(0, 0, 1, 1))
+    boxes.save(path)
+    with pytest.raises(ValueError):
+        loaded.load_file(path)
+    assert len(loaded) == len(DATA)
+
+
+def test_mapped_rbush_rejects_invalid_files(tmp_path):
+    path = tmp_path / "tree.rbush"
+    path.write_bytes(b"not a tree")
+    with pytest.raises(ValueError):
+        rbush.MappedRBush(str(path))
+    with pytest.raises(OSError):
+        rbush.MappedRBush(str(tmp_path / "missing.rbush"))
+
+
+def test_static_rbush_finds_the_same_items_as_rbush():
+    tree = rbush.RBush(4)
+    tree.load(DATA)
+    static = rbush.StaticRBush(DATA, 4)
+    bbox = rbush.BBox(40, 20, 80, 70)
+
+    assert len(static) == len(DATA)
+    assert_sorted_equal(static.search(bbox), tree.search(bbox))
+    assert all(any(item is data for data in DATA) for item in static.search(bbox))
+    assert static.collides(bbox)
+    assert not static.collides(rbush.BBox(200, 200, 210, 210))
+    assert_sorted_equal(static.all(), DATA)
+    offsets, hits = static.search_many([bbox, rbush.BBox(200, 200, 210, 210)])
+    assert offsets == [0, 12, 12]
+    assert_sorted_equal(hits, tree.search(bbox))
+
+
+def test_static_rbush_knn():
+    static = rbush.StaticRBush(DATA)
+
+    result = static.knn(40, 40, 10)
+    expected = sorted(DATA, key=lambda item: point_dist(item, 40, 40))[:10]
+    assert [point_dist(item, 40, 40) for item in result] == [
+        point_dist(item, 40, 40) for item in expected
+    ]
+    result = static.knn(40, 40, 1000, max_distance=10)
+    assert_sorted_equal(result, [item for item in DATA if point_dist(item, 40, 40) <= 10])
+    result = static.knn(40, 40, 5, predicate=lambda item: item["min_x"] > 80)
+    assert len(result) == 5
+    assert all(item["min_x"] > 80 for item in result)
+
+
+def test_static_rbush_with_a_bbox_layout_and_no_items():
+    items = [(*default_dict_key(item), i) for i, item in enumerate(DATA)]
+    static = rbush.StaticRBush(items, bbox_layout=rbush.BBoxLayout.indices())
+    tree = rbush.RBush(4)
+    tree.load(DATA)
+    bbox = rbush.BBox(40, 20, 80, 70)
+    result = static.search(bbox)
+    assert sorted(item[:4] for item in result) == sorted(map(default_dict_key, tree.search(bbox)))
+    assert all(items[item[4]] is item for item in result)
+
+    empty = rbush.StaticRBush([])
+    assert len(empty) == 0
+    assert empty.search(rbush.BBox(0, 0, 100, 100)) == []
+    assert not empty.collides(rbush.BBox(0, 0, 100, 100))
+    assert empty.knn(0, 0, 3) == []